@@ -0,0 +1,38 @@
+#include "SimpleFMOD.h"
+
+using namespace SFMOD;
+
+// Replay a recording made with SimpleFMOD::StartRecording() without a sound card, as fast as possible,
+// and report how long it took and a hash of the output (compare hashes to check that a change didn't alter the mix)
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		std::cout << "Usage: Replay <recording> [<runs>]" << std::endl;
+		return 1;
+	}
+
+	int runs = argc >= 3? atoi(argv[2]) : 1;
+
+	// Each run gets a new SimpleFMOD, so the timings and hashes of the runs are comparable
+	for (int run = 0; run < runs; run++)
+	{
+		ReplayStats stats;
+
+		if (!SimpleFMOD::Replay(argv[1], stats))
+		{
+			std::cout << "Could not read " << argv[1] << std::endl;
+			return 1;
+		}
+
+		std::cout << "Run " << run + 1 << ": " << stats.commands << " commands, " << stats.updates << " updates, "
+			<< stats.samplesMixed << " samples in " << stats.wallMs << "ms" << std::endl;
+		std::cout << "  Update: mean " << stats.meanUpdateUs << "us, max " << stats.maxUpdateUs << "us" << std::endl;
+		std::cout << "  Output hash: " << std::hex << stats.outputHash << std::dec << std::endl;
+
+		if (stats.unrecorded)
+			std::cout << "  Warning: the recording used objects whose calls weren't recorded" << std::endl;
+	}
+
+	return 0;
+}
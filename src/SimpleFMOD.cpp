@@ -1,4 +1,11 @@
 #include "SimpleFMOD.h"
+#include <complex>
+#include <unordered_map>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SFMOD_SSE2
+#endif
 
 /*
 SimpleFMOD - Library to enable simple use of basic FMOD features
@@ -19,17 +26,94 @@ namespace SFMOD
 		}
 	}
 
+	// Like ErrorCheck(), but running out of memory (such as a MemoryPolicy budget) is reported and survived
+	static bool MemoryCheck(FMOD_RESULT result)
+	{
+		if (result == FMOD_ERR_MEMORY)
+		{
+			std::cout << "FMOD out of memory: " << FMOD_ErrorString(result) << std::endl;
+			return false;
+		}
+
+		ErrorCheck(result);
+		return true;
+	}
+
+	// FMOD memory callbacks, forwarding to the installed policy
+	static MemoryPolicy *installedPolicy = NULL;
+
+	// Serializes installing the policy with creating FMOD systems, as instances may be created on several threads
+	// at once (see RenderFarm) and FMOD's memory can only be set up before the first system exists
+	static std::mutex systemCreateLock;
+	static bool systemCreated = false;
+
+	static void *F_CALLBACK policyAlloc(unsigned int size, FMOD_MEMORY_TYPE, const char *)
+	{
+		return installedPolicy->Alloc(size);
+	}
+
+	static void *F_CALLBACK policyRealloc(void *ptr, unsigned int size, FMOD_MEMORY_TYPE, const char *)
+	{
+		return installedPolicy->Realloc(ptr, size);
+	}
+
+	static void F_CALLBACK policyFree(void *ptr, FMOD_MEMORY_TYPE, const char *)
+	{
+		installedPolicy->Free(ptr);
+	}
+
+	// Commands in recordings
+	enum RecordedCommand
+	{
+		RecUpdate, RecLoadSong, RecLoadEffect, RecCreateBus, RecBusVolume, RecBusMute, RecBusPaused, RecCrossfade,
+		RecSongStart, RecSongStop, RecSongTogglePause, RecSongSetPaused, RecSongSetVolume, RecSongFade,
+		RecEffectPlay, RecEffectPlayAt, RecPlayMany, RecUnrecorded, RecAddSend, RecSendLevel
+	};
+
 	// Initialize FMOD sound system
-	SimpleFMOD::SimpleFMOD()
+	SimpleFMOD::SimpleFMOD(MemoryPolicy *memoryPolicy)
+	{
+		SimpleFMODSettings settings;
+		settings.memoryPolicy = memoryPolicy;
+		init(settings);
+	}
+
+	SimpleFMOD::SimpleFMOD(const SimpleFMODSettings &settings)
 	{
+		init(settings);
+	}
+
+	void SimpleFMOD::init(const SimpleFMODSettings &settings)
+	{
+		MemoryPolicy *memoryPolicy = settings.memoryPolicy;
 		unsigned int version;
 		int numDrivers;
 		FMOD_SPEAKERMODE speakerMode;
 		FMOD_CAPS caps;
 		char name[256];
 
-		// Create FMOD interface object
-		ErrorCheck(FMOD::System_Create(&system));
+		{
+			std::lock_guard<std::mutex> guard(systemCreateLock);
+
+			// Route FMOD's memory through the policy. This must happen before anything else in FMOD, and only once
+			// per process: a policy given once a system exists is ignored
+			if (memoryPolicy && !installedPolicy && !systemCreated)
+			{
+				int poolLength;
+				void *pool = memoryPolicy->GetPool(poolLength);
+
+				installedPolicy = memoryPolicy;
+
+				if (pool)
+					ErrorCheck(FMOD::Memory_Initialize(pool, poolLength, 0, 0, 0));
+				else
+					ErrorCheck(FMOD::Memory_Initialize(0, 0, policyAlloc, policyRealloc, policyFree));
+			}
+
+			// Create FMOD interface object
+			ErrorCheck(FMOD::System_Create(&system));
+			systemCreated = true;
+		}
 
 		// Check version
 		ErrorCheck(system->getVersion(&version));
@@ -42,9 +126,26 @@ namespace SFMOD
 	
 		// Get number of sound cards
 		ErrorCheck(system->getNumDrivers(&numDrivers));
-	
+
+		nonRealtime = settings.nonRealtime;
+		dspTime = nonRealtime || (settings.mixOutput && !settings.mixOutput->GetSettings().realtime);
+
+		// Passed to the output plugin's init callback
+		void *driverData = NULL;
+
+		// Mix on demand with no sound card
+		if (nonRealtime)
+			ErrorCheck(system->setOutput(FMOD_OUTPUTTYPE_NOSOUND_NRT));
+
+		// Mix into the application's own buffers
+		else if (settings.mixOutput)
+		{
+			settings.mixOutput->select(system);
+			driverData = settings.mixOutput;
+		}
+
 		// No sound cards (disable sound)
-		if (numDrivers == 0)
+		else if (numDrivers == 0)
 			ErrorCheck(system->setOutput(FMOD_OUTPUTTYPE_NOSOUND));
 
 		// At least one sound card
@@ -71,287 +172,964 @@ namespace SFMOD
 				ErrorCheck(system->setSoftwareFormat(48000, FMOD_SOUND_FORMAT_PCMFLOAT, 0, 0, FMOD_DSP_RESAMPLER_LINEAR));
 		}
 
-		// Initialise FMOD
-		FMOD_RESULT result = system->init(100, FMOD_INIT_NORMAL, 0);
+		// Initialise FMOD (decoding streams in update() when non-realtime, so that they keep pace with the mixer)
+		FMOD_INITFLAGS flags = nonRealtime? FMOD_INIT_STREAM_FROM_UPDATE : FMOD_INIT_NORMAL;
+		FMOD_RESULT result = system->init(100, flags, driverData);
 
 		// If the selected speaker mode isn't supported by this sound card, swtich it back to stereo
 		if (result == FMOD_ERR_OUTPUT_CREATEBUFFER)
 		{
 			ErrorCheck(system->setSpeakerMode(FMOD_SPEAKERMODE_STEREO));
-			result = system->init(100, FMOD_INIT_NORMAL, 0);
+			result = system->init(100, flags, driverData);
 		}
 		ErrorCheck(result);
 
-		// Create two channel groups to allow master volume control
+		// Get the output sample rate for DSP clock calculations
+		ErrorCheck(system->getSoftwareFormat(&sampleRate, 0, 0, 0, 0, 0));
+		frameClock = GetDSPClock();
+
+		// Telemetry clock
+		LARGE_INTEGER counter, frequency;
+		QueryPerformanceCounter(&counter);
+		QueryPerformanceFrequency(&frequency);
+		counterStart = counter.QuadPart;
+		counterTicksPerUs = frequency.QuadPart / 1000000.0;
+		telemetryEnabled = settings.telemetry;
+		telemetryFrames = 0;
+		memset(telemetry, 0, sizeof(telemetry));
+
+		memoryBudget = 0;
+		std::fill(residentBytes, residentBytes + LoadModeCount, 0);
+
+		unsigned int blockLength;
+		int numBlocks;
+		ErrorCheck(system->getDSPBufferSize(&blockLength, &numBlocks));
+		startLatency = blockLength * 2;
+
+		recordFile = NULL;
+		recordIds = 0;
+
+		memset(wheel, 0, sizeof(wheel));
+		wheelTime = GetTimeMs();
+		timerCount = 0;
+		updatingResources = false;
+		activeHoles = false;
+
+		// Create two buses to allow master volume control
 		// One for music, one for effects
-		ErrorCheck(system->createChannelGroup(NULL, &channelMusic));
-		ErrorCheck(system->createChannelGroup(NULL, &channelEffects));
+		channelMusic = busGroups[CreateBus("music").id];
+		channelEffects = busGroups[CreateBus("effects").id];
+
+		if (settings.recordFile)
+			StartRecording(settings.recordFile);
 	}
 
 	// Release FMOD sound system
 	SimpleFMOD::~SimpleFMOD()
 	{
+		StopRecording();
+
+		crossfader.reset();
+
 		system->release();
 	}
 
 	// Per-frame sound system update
 	void SimpleFMOD::Update()
 	{
+		if (recordFile)
+			record(RecUpdate);
+
+		// Statistics are only gathered when asked for, as they cost several FMOD calls per frame
+		bool measure = telemetryEnabled;
+		FrameStats &stats = telemetry[telemetryFrames % TelemetryFrames];
+		double resourceStart = 0.0;
+
+		if (measure)
+		{
+			stats.frame = telemetryFrames++;
+			stats.startUs = nowUs();
+		}
+
+		frameClock = GetDSPClock();
+
+		flushBuses();
+
 		ErrorCheck(system->update());
 
-		for (auto &r : updateableResources)
-			r->Update();
+		if (measure)
+		{
+			resourceStart = nowUs();
+			stats.systemUpdateUs = resourceStart - stats.startUs;
+		}
+
+		// Wake sleeping resources which are due, then update the active ones. Resources deactivated during the loop
+		// leave a hole rather than moving another resource, so each is updated at most once; resources activated
+		// during the loop are appended and updated from the next frame
+		advanceTimers(GetTimeMs());
+
+		if (measure)
+			stats.resourcesUpdated = static_cast<int>(activeResources.size());
+
+		updatingResources = true;
+
+		for (size_t i = 0, count = activeResources.size(); i < count; i++)
+			if (activeResources[i])
+				activeResources[i]->Update();
+
+		updatingResources = false;
+
+		if (activeHoles)
+		{
+			size_t kept = 0;
+
+			for (size_t i = 0; i < activeResources.size(); i++)
+				if (SimpleFMODResource *res = activeResources[i])
+				{
+					res->activeIndex = static_cast<int>(kept);
+					activeResources[kept++] = res;
+				}
+
+			activeResources.resize(kept);
+			activeHoles = false;
+		}
+
+		if (!measure)
+			return;
+
+		stats.starvingStreams = 0;
+
+		for (auto r : streamResources)
+			if (r->IsStarving())
+				stats.starvingStreams++;
+
+		stats.resourceUpdateUs = nowUs() - resourceStart;
+
+		float geometryCPU;
+		system->getCPUUsage(&stats.dspCPU, &stats.streamCPU, &geometryCPU, &stats.updateCPU, &stats.totalCPU);
+		system->getChannelsPlaying(&stats.channelsPlaying);
+
+		// Don't wait for the memory lock just to read statistics
+		if (FMOD::Memory_GetStats(&stats.memoryCurrent, &stats.memoryMax, false) != FMOD_OK)
+			stats.memoryCurrent = stats.memoryMax = -1;
 	}
 
-	// Register a resource for update (interal use only)
-	void SimpleFMOD::registerResource(SimpleFMODResource *res)
+	// Time source for fades
+	unsigned int SimpleFMOD::GetTimeMs() const
 	{
-		updateableResources.push_back(res);
+		return dspTime? static_cast<unsigned int>(frameClock * 1000 / sampleRate) : GetTickCount();
 	}
 
-	// Unregister a resource from update (interal use only)
-	void SimpleFMOD::unregisterResource(SimpleFMODResource *res)
+	// Microseconds since creation
+	double SimpleFMOD::nowUs() const
 	{
-		updateableResources.remove(res);
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return (counter.QuadPart - counterStart) / counterTicksPerUs;
 	}
 
-	// Get and set master volumes
-	float SimpleFMOD::GetMasterVolumeMusic()
+	// Write frame statistics in Chrome's trace event format: update phases as slices, the rest as counters
+	bool SimpleFMOD::WriteChromeTrace(const char *filename) const
 	{
-		float vol;
-		channelMusic->getVolume(&vol);
-		return vol;
+		FILE *f = fopen(filename, "w");
+
+		if (!f)
+			return false;
+
+		fprintf(f, "{\"traceEvents\":[\n");
+		fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"SimpleFMOD::Update\"}}");
+
+		for (int age = GetFrameStatsCount() - 1; age >= 0; age--)
+		{
+			const FrameStats &s = GetFrameStats(age);
+
+			fprintf(f, ",\n{\"name\":\"Update\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%llu}}",
+				s.startUs, s.systemUpdateUs + s.resourceUpdateUs, s.frame);
+			fprintf(f, ",\n{\"name\":\"System::update\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+				s.startUs, s.systemUpdateUs);
+			fprintf(f, ",\n{\"name\":\"Resources\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+				s.startUs + s.systemUpdateUs, s.resourceUpdateUs);
+			fprintf(f, ",\n{\"name\":\"FMOD CPU\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"dsp\":%.2f,\"stream\":%.2f,\"update\":%.2f,\"total\":%.2f}}",
+				s.startUs, s.dspCPU, s.streamCPU, s.updateCPU, s.totalCPU);
+			fprintf(f, ",\n{\"name\":\"Voices\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"channels\":%d,\"starving\":%d}}",
+				s.startUs, s.channelsPlaying, s.starvingStreams);
+			fprintf(f, ",\n{\"name\":\"FMOD memory\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"current\":%d,\"max\":%d}}",
+				s.startUs, s.memoryCurrent, s.memoryMax);
+
+			if (s.starvingStreams)
+				fprintf(f, ",\n{\"name\":\"Starving\",\"ph\":\"i\",\"s\":\"p\",\"pid\":1,\"tid\":1,\"ts\":%.3f}", s.startUs);
+		}
+
+		fprintf(f, "\n]}\n");
+
+		bool ok = !ferror(f);
+		fclose(f);
+		return ok;
 	}
 
-	float SimpleFMOD::GetMasterVolumeEffects()
+	// Get the current DSP clock as a 64-bit sample count
+	unsigned long long SimpleFMOD::GetDSPClock()
 	{
-		float vol;
-		channelEffects->getVolume(&vol);
-		return vol;
+		unsigned int hi, lo;
+		ErrorCheck(system->getDSPClock(&hi, &lo));
+		return (static_cast<unsigned long long>(hi) << 32) | lo;
 	}
 
-	void SimpleFMOD::SetMasterVolumeMusic(float vol)
+	// Start a batch of sound effects sample-aligned
+	unsigned long long SimpleFMOD::PlayMany(const PlayRequest *requests, int count, FMOD::Channel **channels, unsigned long long startClock)
 	{
-		vol = max(min(vol, 1.0f), 0.0f);
+		if (recordFile)
+		{
+			record(RecPlayMany);
+			recordValue(static_cast<long long>(startClock? startClock - frameClock : 0));
+			recordValue(count);
 
-		channelMusic->setVolume(vol);
-	}
+			for (int i = 0; i < count; i++)
+			{
+				recordValue(requests[i].effect? requests[i].effect->recordId : 0);
+				recordValue(requests[i].bus.id);
+				recordValue(requests[i].volume);
+				recordValue(requests[i].pitch);
+				recordValue(requests[i].delay);
+			}
+		}
 
-	void SimpleFMOD::SetMasterVolumeEffects(float vol)
-	{
-		vol = max(min(vol, 1.0f), 0.0f);
+		if (!startClock)
+			startClock = GetDSPClock() + startLatency;
+
+		batch.clear();
+
+		if (channels)
+			std::fill(channels, channels + count, static_cast<FMOD::Channel *>(NULL));
+
+		// Set every voice up paused. Failures only drop the voice concerned
+		for (int i = 0; i < count; i++)
+		{
+			const PlayRequest &r = requests[i];
+			SoundEffect *e = r.effect;
+			unsigned long long clock = startClock + r.delay;
+			FMOD::Channel *existing;
+
+			// A playback rate of zero or less would never end
+			if (!e || !e->Get() || !(r.pitch > 0.0f))
+				continue;
+
+			if (!e->admit(clock, existing))
+			{
+				if (channels)
+					channels[i] = existing;
+				continue;
+			}
+
+			FMOD::Channel *channel;
+
+			if (system->playSound(FMOD_CHANNEL_FREE, e->Get(), true, &channel) != FMOD_OK)
+				continue;
+
+			FMOD::ChannelGroup *group = validBus(r.bus)? busGroups[r.bus.id] : e->channelGroup;
+
+			if (group)
+				channel->setChannelGroup(group);
+
+			if (r.pitch != 1.0f)
+			{
+				float frequency;
+				e->Get()->getDefaults(&frequency, 0, 0, 0);
+				channel->setFrequency(frequency * r.pitch);
+			}
+
+			channel->setDelay(FMOD_DELAYTYPE_DSPCLOCK_START, static_cast<unsigned int>(clock >> 32), static_cast<unsigned int>(clock));
+
+			e->track(channel, clock, r.pitch, r.volume);
+			batch.push_back(channel);
+
+			if (channels)
+				channels[i] = channel;
+		}
+
+		// Release them together; the mixer cannot run in between
+		system->lockDSP();
+
+		for (auto channel : batch)
+			channel->setPaused(false);
 
-		channelEffects->setVolume(vol);
+		system->unlockDSP();
+
+		return startClock;
 	}
 
-	// Song factory
-	Song SimpleFMOD::LoadSong(const char *data, FMOD::ChannelGroup *channelGroup, FMOD_MODE mode, FMOD_CREATESOUNDEXINFO info)
+	// Register a resource for update (interal use only)
+	void SimpleFMOD::registerResource(SimpleFMODResource *res, bool active)
 	{
-		return Song(this, data, channelGroup, mode, info);
+		if (active)
+			activate(res);
 	}
 
-	Song SimpleFMOD::LoadSong(const char *filename, FMOD_MODE mode)
+	// Unregister a resource from update (interal use only). Does nothing if it isn't registered
+	void SimpleFMOD::unregisterResource(SimpleFMODResource *res)
 	{
-		return Song(this, filename, channelMusic, mode);
+		deactivate(res);
+
+		if (res->stream)
+		{
+			streamResources.erase(std::find(streamResources.begin(), streamResources.end(), res));
+			res->stream = false;
+		}
 	}
 
-	Song SimpleFMOD::LoadSong(int resourceId, LPCTSTR resourceType, FMOD_MODE mode)
+	// Give a moved resource's place in the active set, timer wheel and stream list to the object it is moved into
+	void SimpleFMOD::moveResource(SimpleFMODResource *from, SimpleFMODResource *to)
 	{
-		return Song(this, resourceId, resourceType, channelMusic, mode);
+		bool active = from->activeIndex != -1;
+		bool sleeping = from->timerLink != NULL;
+		bool stream = from->stream;
+		unsigned int wakeTime = from->wakeTime;
+
+		unregisterResource(from);
+
+		if (active)
+			activate(to);
+		else if (sleeping)
+			schedule(to, wakeTime);
+
+		if (stream)
+			watchStream(to);
 	}
 
-	// Sound effect factory
-	SoundEffect SimpleFMOD::LoadSoundEffect(const char *filename, FMOD_MODE mode)
+	void SimpleFMOD::watchStream(SimpleFMODResource *res)
 	{
-		return SoundEffect(this, filename, channelEffects, mode);
+		if (!res->stream)
+		{
+			streamResources.push_back(res);
+			res->stream = true;
+		}
 	}
 
-	SoundEffect SimpleFMOD::LoadSoundEffect(int resourceId, LPCTSTR resourceType, FMOD_MODE mode)
+	// Add a resource to the active set, waking it if it is asleep
+	void SimpleFMOD::activate(SimpleFMODResource *res)
 	{
-		return SoundEffect(this, resourceId, resourceType, channelEffects, mode);
+		cancelTimer(res);
+
+		if (res->activeIndex != -1)
+			return;
+
+		res->activeIndex = static_cast<int>(activeResources.size());
+		activeResources.push_back(res);
 	}
 
-	// Set up a song
-	Song::Song(SimpleFMOD *fmod, const char *data, FMOD::ChannelGroup *cg, FMOD_MODE mode, FMOD_CREATESOUNDEXINFO info) : SimpleFMODResource(fmod)
+	// Remove a resource from the active set and the timer wheel (swap-remove, fixing up the index of the one moved,
+	// or just clear the slot during the update loop)
+	void SimpleFMOD::deactivate(SimpleFMODResource *res)
 	{
-		// Set stream size higher than the default (16384) to try to help reduce stuttering
-		engine->FMOD()->setStreamBufferSize(65536, FMOD_TIMEUNIT_RAWBYTES);
+		cancelTimer(res);
 
-		// Open the stream
-		FMOD::Sound *s;
-		ErrorCheck(engine->FMOD()->createStream(data, mode, &info, &s));
-		resource = ResourceType(s);
+		int i = res->activeIndex;
 
-		// Remember channel group
-		channelGroup = cg;
+		if (i == -1)
+			return;
 
-		fade = false;
+		if (updatingResources)
+		{
+			activeResources[i] = NULL;
+			activeHoles = true;
+			res->activeIndex = -1;
+			return;
+		}
+
+		activeResources[i] = activeResources.back();
+		activeResources[i]->activeIndex = i;
+		activeResources.pop_back();
+		res->activeIndex = -1;
 	}
 
-	Song::Song(SimpleFMOD *fmod, const char *filename, FMOD::ChannelGroup *cg, FMOD_MODE mode) : SimpleFMODResource(fmod)
+	// Put a resource to sleep until a time. The level is the one whose slots are just finer than the time remaining
+	void SimpleFMOD::schedule(SimpleFMODResource *res, unsigned int timeMs)
 	{
-		// Set stream size higher than the default (16384) to try to help reduce stuttering
-		engine->FMOD()->setStreamBufferSize(65536, FMOD_TIMEUNIT_RAWBYTES);
+		deactivate(res);
 
-		// Open the stream
-		FMOD::Sound *s;
-		ErrorCheck(engine->FMOD()->createStream(filename, mode, 0, &s));
-		resource = ResourceType(s);
+		int remaining = static_cast<int>(timeMs - wheelTime);
 
-		// Remember channel group
-		channelGroup = cg;
+		if (remaining <= 0)
+		{
+			activate(res);
+			return;
+		}
 
-		fade = false;
-	}
+		// Beyond the range of the wheel: sleep as long as possible, then sleep again
+		const int range = 1 << (WheelBits * WheelLevels);
 
-	Song::Song(SimpleFMOD *fmod, int resourceId, LPCTSTR resourceType, FMOD::ChannelGroup *cg, FMOD_MODE mode) : SimpleFMODResource(fmod)
-	{
-		HRSRC rsrc = FindResource(NULL, MAKEINTRESOURCE(resourceId), resourceType);
-		HGLOBAL handle = LoadResource(NULL, rsrc);
+		if (remaining >= range)
+		{
+			remaining = range - 1;
+			timeMs = wheelTime + remaining;
+		}
 
-		DWORD audioSize = SizeofResource(NULL, rsrc);
-		LPVOID audioData = LockResource(handle);
+		int level = 0;
 
-		FMOD_CREATESOUNDEXINFO audioInfo;
-		memset(&audioInfo, 0, sizeof(FMOD_CREATESOUNDEXINFO));
-		audioInfo.cbsize = sizeof(FMOD_CREATESOUNDEXINFO);
-		audioInfo.length = static_cast<unsigned int>(audioSize);
+		while (remaining >= 1 << (WheelBits * (level + 1)))
+			level++;
 
-		engine->FMOD()->setStreamBufferSize(65536, FMOD_TIMEUNIT_RAWBYTES);
+		SimpleFMODResource *&head = wheel[level][(timeMs >> (WheelBits * level)) & (WheelSlots - 1)];
 
-		FMOD::Sound *s;
-		ErrorCheck(engine->FMOD()->createStream(static_cast<const char *>(audioData), FMOD_OPENMEMORY | mode, &audioInfo, &s));
-		resource = ResourceType(s);
+		res->wakeTime = timeMs;
+		res->timerNext = head;
 
-		// Remember channel group
-		channelGroup = cg;
+		if (head)
+			head->timerLink = &res->timerNext;
 
-		fade = false;
+		head = res;
+		res->timerLink = &head;
+		timerCount++;
 	}
 
-	// Update a song's fade status
-	void Song::Update()
+	// Put a resource to sleep until a DSP clock
+	void SimpleFMOD::scheduleClock(SimpleFMODResource *res, unsigned long long clock)
 	{
-		if (fade)
-		{
-			// Get fade progression from 0.0f - 1.0f depending on number of milliseconds elapsed since fade started
-			float progress = min(static_cast<float>(GetTickCount() - fadeStartTick) / fadeLength, 1.0f);
+		unsigned long long now = GetDSPClock();
+		unsigned int ms = clock > now? static_cast<unsigned int>((clock - now) * 1000 / sampleRate) : 0;
 
-			// Fade is over if progression is at 1.0f
-			if (progress == 1.0f)
-				fade = false;
+		schedule(res, GetTimeMs() + ms);
+	}
 
-			// Translate linear progress into a smooth sine-squared fade effect
-			float volume = static_cast<float>(sin(progress * M_PI / 2));
-			volume *= volume;
+	void SimpleFMOD::cancelTimer(SimpleFMODResource *res)
+	{
+		if (!res->timerLink)
+			return;
 
-			// Scale volume between start and target volumes
-			volume = volume * (fadeTargetVol - fadeStartVol) + fadeStartVol;
+		*res->timerLink = res->timerNext;
 
-			// Alter song volume
-			SetVolume(volume);
+		if (res->timerNext)
+			res->timerNext->timerLink = res->timerLink;
 
-			// Post-fade processing
-			if (!fade)
-				SetPaused(fadePauseAfter);
-		}
+		res->timerNext = NULL;
+		res->timerLink = NULL;
+		timerCount--;
 	}
 
-	// Start playing a song
-	FMOD::Channel *Song::Start(bool paused)
+	// Move the wheel on to a time, one millisecond at a time, waking the resources which are due
+	void SimpleFMOD::advanceTimers(unsigned int timeMs)
 	{
-		// Channel volume will be set to 1.0f (max) automatically
-		ErrorCheck(engine->FMOD()->playSound(FMOD_CHANNEL_FREE, resource.get(), true, &channel));
+		// Nothing asleep: just catch up
+		if (timerCount == 0)
+		{
+			wheelTime = timeMs;
+			return;
+		}
 
-		// Add to channel group (for master volume)
-		if (channelGroup)
-			channel->setChannelGroup(channelGroup);
+		while (static_cast<int>(timeMs - wheelTime) > 0)
+		{
+			wheelTime++;
 
-		// Songs repeat forever by default
-		channel->setLoopCount(-1);
-		channel->setMode(FMOD_LOOP_NORMAL);
+			// Each level which has just wrapped brings down the next slot of the level above
+			for (int level = 1; level < WheelLevels; level++)
+			{
+				if (wheelTime & ((1u << (WheelBits * level)) - 1))
+					break;
 
-		// Flush buffer to ensure loop logic is executed
-		channel->setPosition(0, FMOD_TIMEUNIT_MS);
+				SimpleFMODResource *&head = wheel[level][(wheelTime >> (WheelBits * level)) & (WheelSlots - 1)];
+				SimpleFMODResource *res = head;
+				head = NULL;
 
-		// Set paused or not as applicable
-		if (!paused)
-			channel->setPaused(paused);
+				while (res)
+				{
+					SimpleFMODResource *next = res->timerNext;
+					res->timerNext = NULL;
+					res->timerLink = NULL;
+					timerCount--;
 
-		// Cancel any fade that was previously applied
-		fade = false;
+					schedule(res, res->wakeTime);
+					res = next;
+				}
+			}
 
-		return channel;
+			SimpleFMODResource *&due = wheel[0][wheelTime & (WheelSlots - 1)];
+
+			while (due)
+				activate(due);
+		}
 	}
 
-	// Stop a song and free the channel
-	void Song::Stop()
+	// Get and set master volumes
+	float SimpleFMOD::GetMasterVolumeMusic()
 	{
-		channel->stop();
-		channel = NULL;
+		return GetBusVolume(GetMusicBus());
 	}
 
-	// Get the FMOD channel used by a song
-	FMOD::Channel *Song::GetChannel()
+	float SimpleFMOD::GetMasterVolumeEffects()
 	{
-		return channel;
+		return GetBusVolume(GetEffectsBus());
 	}
 
-	// Pause/unpause a song
-	bool Song::TogglePause()
+	void SimpleFMOD::SetMasterVolumeMusic(float vol)
 	{
-		bool isPaused;
-		channel->getPaused(&isPaused);
-		channel->setPaused(!isPaused);
-		return !isPaused;
+		SetBusVolume(GetMusicBus(), vol);
 	}
 
-	bool Song::GetPaused()
+	void SimpleFMOD::SetMasterVolumeEffects(float vol)
 	{
-		bool paused;
-		channel->getPaused(&paused);
-		return paused;
+		SetBusVolume(GetEffectsBus(), vol);
 	}
 
-	void Song::SetPaused(bool paused)
+	// Create a mix bus under a parent bus (or the master channel group)
+	Bus SimpleFMOD::CreateBus(const char *name, Bus parent)
 	{
-		channel->setPaused(paused);
+		if (recordFile)
+		{
+			record(RecCreateBus);
+			recordString(name);
+			recordValue(parent.id);
+		}
+
+		FMOD::ChannelGroup *group;
+		ErrorCheck(system->createChannelGroup(name, &group));
+
+		if (validBus(parent))
+			ErrorCheck(busGroups[parent.id]->addGroup(group));
+
+		busNames.push_back(name);
+		busParents.push_back(validBus(parent)? parent.id : -1);
+		busGroups.push_back(group);
+		busVolume.push_back(1.0f);
+		busMute.push_back(0);
+		busPaused.push_back(0);
+		busDirty.push_back(0);
+
+		return Bus(static_cast<int>(busGroups.size()) - 1);
 	}
 
-	// Set song volume
-	void Song::SetVolume(float volume)
+	// Look up a bus by name
+	Bus SimpleFMOD::FindBus(const char *name) const
 	{
-		channel->setVolume(volume);
+		for (size_t i = 0; i < busNames.size(); i++)
+			if (busNames[i] == name)
+				return Bus(static_cast<int>(i));
+
+		return Bus();
 	}
 
-	// Begin fading a song for ms milliseconds from the current volume to a target volume of 'target'
-	void Song::Fade(int ms, float target, bool pauseWhenDone)
+	// Send one bus's output to another (post-fader)
+	int SimpleFMOD::AddSend(Bus from, Bus to, float level)
 	{
-		float currentVolume;
+		if (!validBus(from) || !validBus(to))
+			return -1;
 
-		fadeLength = ms;
-		fadeStartTick = GetTickCount();
+		if (recordFile)
+		{
+			record(RecAddSend);
+			recordValue(from.id);
+			recordValue(to.id);
+			recordValue(level);
+		}
 
-		channel->getVolume(&currentVolume);
-		fadeStartVol = currentVolume;
-		fadeTargetVol = target;
-		fade = true;
-		fadePauseAfter = pauseWhenDone;
+		FMOD::DSP *source, *target;
+		FMOD::DSPConnection *connection;
+
+		ErrorCheck(busGroups[from.id]->getDSPHead(&source));
+		ErrorCheck(busGroups[to.id]->getDSPHead(&target));
+		ErrorCheck(target->addInput(source, &connection));
+
+		connection->setMix(level);
+		sends.push_back(connection);
+		sendBuses.push_back(std::make_pair(from.id, to.id));
+
+		return static_cast<int>(sends.size()) - 1;
 	}
 
-	// Prepare a sound effect
-	SoundEffect::SoundEffect(SimpleFMOD *fmod, const char *filename, FMOD::ChannelGroup *cg, FMOD_MODE mode) : SimpleFMODResource(fmod)
+	void SimpleFMOD::SetSendLevel(int send, float level)
 	{
-		FMOD::Sound *s;
-		ErrorCheck(engine->FMOD()->createSound(filename, mode, 0, &s));
+		if (send < 0 || send >= static_cast<int>(sends.size()))
+			return;
+
+		if (recordFile)
+		{
+			record(RecSendLevel);
+			recordValue(send);
+			recordValue(level);
+		}
+
+		sends[send]->setMix(level);
+	}
+
+	// Load a bus configuration file
+	bool SimpleFMOD::LoadBusConfig(const char *filename)
+	{
+		FILE *f = fopen(filename, "r");
+
+		if (!f)
+			return false;
+
+		char line[256];
+
+		while (fgets(line, sizeof(line), f))
+			busConfigLine(line);
+
+		fclose(f);
+		return true;
+	}
+
+	void SimpleFMOD::busConfigLine(const char *line)
+	{
+		char command[16], name[64], target[64];
+		float level;
+
+		int fields = sscanf(line, "%15s %63s %63s %f", command, name, target, &level);
+
+		if (fields < 2 || command[0] == '#')
+			return;
+
+		if (!strcmp(command, "bus"))
+		{
+			Bus bus = CreateBus(name, (fields >= 3 && strcmp(target, "-"))? FindBus(target) : Bus());
+
+			if (fields == 4)
+				SetBusVolume(bus, level);
+		}
+
+		else if (!strcmp(command, "send") && fields == 4)
+		{
+			Bus from = FindBus(name), to = FindBus(target);
+
+			if (from.IsValid() && to.IsValid())
+				AddSend(from, to, level);
+		}
+	}
+
+	// Change bus state (applied on the next update, and only if it actually changed)
+	void SimpleFMOD::SetBusVolume(Bus bus, float volume)
+	{
+		if (!validBus(bus))
+			return;
+
+		if (recordFile)
+		{
+			record(RecBusVolume);
+			recordValue(bus.id);
+			recordValue(volume);
+		}
+
+		volume = max(min(volume, 1.0f), 0.0f);
+
+		if (busVolume[bus.id] != volume)
+		{
+			busVolume[bus.id] = volume;
+			markBusDirty(bus.id);
+		}
+	}
+
+	void SimpleFMOD::SetBusMute(Bus bus, bool mute)
+	{
+		if (!validBus(bus))
+			return;
+
+		if (recordFile)
+		{
+			record(RecBusMute);
+			recordValue(bus.id);
+			recordValue(static_cast<unsigned char>(mute));
+		}
+
+		if ((busMute[bus.id] != 0) != mute)
+		{
+			busMute[bus.id] = mute;
+			markBusDirty(bus.id);
+		}
+	}
+
+	void SimpleFMOD::SetBusPaused(Bus bus, bool paused)
+	{
+		if (!validBus(bus))
+			return;
+
+		if (recordFile)
+		{
+			record(RecBusPaused);
+			recordValue(bus.id);
+			recordValue(static_cast<unsigned char>(paused));
+		}
+
+		if ((busPaused[bus.id] != 0) != paused)
+		{
+			busPaused[bus.id] = paused;
+			markBusDirty(bus.id);
+		}
+	}
+
+	void SimpleFMOD::markBusDirty(int bus)
+	{
+		if (!busDirty[bus])
+		{
+			busDirty[bus] = 1;
+			dirtyBuses.push_back(bus);
+		}
+	}
+
+	// Send changed bus state to FMOD
+	void SimpleFMOD::flushBuses()
+	{
+		for (auto bus : dirtyBuses)
+		{
+			busGroups[bus]->setVolume(busVolume[bus]);
+			busGroups[bus]->setMute(busMute[bus] != 0);
+			busGroups[bus]->setPaused(busPaused[bus] != 0);
+			busDirty[bus] = 0;
+		}
+
+		dirtyBuses.clear();
+	}
+
+	// Crossfade the music to a new stream
+	void SimpleFMOD::CrossfadeTo(const char *filename, int ms, FadeCurve curve, FMOD_MODE mode)
+	{
+		static const FadeCurveFunction curves[] = { Crossfader::Linear, Crossfader::EqualPower, Crossfader::SineSquared };
+
+		// Values outside the enum get the default curve
+		if (curve < FadeLinear || curve > FadeSineSquared)
+			curve = FadeEqualPower;
+
+		CrossfadeTo(filename, ms, curves[curve], mode);
+	}
+
+	void SimpleFMOD::CrossfadeTo(const char *filename, int ms, FadeCurveFunction curve, FMOD_MODE mode)
+	{
+		// User-defined curves can't be recorded, so are replayed as equal-power
+		if (recordFile)
+		{
+			record(RecCrossfade);
+			recordString(filename);
+			recordValue(ms);
+			recordValue(static_cast<unsigned char>(curve == Crossfader::Linear? FadeLinear : curve == Crossfader::SineSquared? FadeSineSquared : FadeEqualPower));
+			recordValue(mode);
+		}
+
+		if (!crossfader)
+			crossfader.reset(new Crossfader(this, channelMusic));
+
+		crossfader->CrossfadeTo(filename, ms, curve, mode);
+	}
+
+	FMOD::Channel *SimpleFMOD::GetCrossfadeChannel()
+	{
+		return crossfader? crossfader->GetChannel() : NULL;
+	}
+
+	// Song factory
+	Song SimpleFMOD::LoadSong(const char *data, FMOD::ChannelGroup *channelGroup, FMOD_MODE mode, FMOD_CREATESOUNDEXINFO info)
+	{
+		return Song(this, data, channelGroup, mode, info);
+	}
+
+	Song SimpleFMOD::LoadSong(const char *filename, FMOD_MODE mode)
+	{
+		Song song(this, filename, channelMusic, mode);
+		recordLoad(song, true, filename, mode, Bus(), -1, 0.0f);
+		return song;
+	}
+
+	Song SimpleFMOD::LoadSong(int resourceId, LPCTSTR resourceType, FMOD_MODE mode)
+	{
+		return Song(this, resourceId, resourceType, channelMusic, mode);
+	}
+
+	// FMOD mode flags of each load mode
+	static const FMOD_MODE loadModeFlags[LoadModeCount] = { 0, FMOD_CREATESAMPLE, FMOD_CREATECOMPRESSEDSAMPLE, FMOD_CREATESTREAM };
+
+	// Load mode implied by FMOD mode flags
+	static LoadMode loadModeOf(FMOD_MODE mode)
+	{
+		return (mode & FMOD_CREATESTREAM)? LoadStream : (mode & FMOD_CREATECOMPRESSEDSAMPLE)? LoadCompressed : LoadDecoded;
+	}
+
+	// Sound effect factory
+	SoundEffect SimpleFMOD::LoadSoundEffect(const char *filename, FMOD_MODE mode)
+	{
+		SoundEffect effect(this, filename, channelEffects, mode);
+		account(effect, loadModeOf(mode), true);
+		recordLoad(effect, false, filename, mode, Bus(), -1, 0.0f);
+		return effect;
+	}
+
+	SoundEffect SimpleFMOD::LoadSoundEffect(int resourceId, LPCTSTR resourceType, FMOD_MODE mode)
+	{
+		SoundEffect effect(this, resourceId, resourceType, channelEffects, mode);
+		account(effect, loadModeOf(mode), true);
+		return effect;
+	}
+
+	// Load into a specific bus
+	Song SimpleFMOD::LoadSong(const char *filename, Bus bus, FMOD_MODE mode)
+	{
+		Song song(this, filename, GetBusChannelGroup(bus), mode);
+		recordLoad(song, true, filename, mode, bus, -1, 0.0f);
+		return song;
+	}
+
+	SoundEffect SimpleFMOD::LoadSoundEffect(const char *filename, Bus bus, FMOD_MODE mode)
+	{
+		SoundEffect effect(this, filename, GetBusChannelGroup(bus), mode);
+		account(effect, loadModeOf(mode), true);
+		recordLoad(effect, false, filename, mode, bus, -1, 0.0f);
+		return effect;
+	}
+
+	// Load a sound effect in a chosen or automatically selected load mode
+	SoundEffect SimpleFMOD::LoadSoundEffect(const char *filename, LoadMode loadMode, float playsPerMinute, Bus bus, FMOD_MODE mode)
+	{
+		LoadMode requested = loadMode;
+
+		if (loadMode == LoadAuto)
+			loadMode = chooseLoadMode(filename, playsPerMinute, mode);
+
+		SoundEffect effect(this, filename, bus.IsValid()? GetBusChannelGroup(bus) : channelEffects, (mode & ~(FMOD_CREATESAMPLE | FMOD_CREATECOMPRESSEDSAMPLE | FMOD_CREATESTREAM)) | loadModeFlags[loadMode]);
+		account(effect, loadMode, true);
+		recordLoad(effect, false, filename, mode, bus, requested, playsPerMinute);
+		return effect;
+	}
+
+	// Pick a load mode for an asset. Decoded PCM costs no CPU to play but takes the most memory; compressed samples
+	// trade decoding CPU per voice for memory; streams cost almost no memory but only play one voice from disk
+	LoadMode SimpleFMOD::chooseLoadMode(const char *filename, float playsPerMinute, FMOD_MODE mode)
+	{
+		// Sounds decoding to no more than this are always kept decoded if they fit
+		static const size_t smallDecodedBytes = 256 * 1024;
+
+		// Sounds longer than this are streamed unless played often
+		static const float longSeconds = 10.0f;
+
+		// Sounds played at least this often are worth decoding
+		static const float hotPlaysPerMinute = 10.0f;
+
+		// Open the header only to find the decoded size
+		FMOD::Sound *probe;
+
+		if (system->createSound(filename, (mode & ~(FMOD_CREATECOMPRESSEDSAMPLE | FMOD_CREATESTREAM)) | FMOD_OPENONLY, 0, &probe) != FMOD_OK)
+			return LoadDecoded;
+
+		unsigned int length = 0;
+		float frequency = 44100.0f;
+		int channels = 1, bits = 16;
+
+		probe->getLength(&length, FMOD_TIMEUNIT_PCM);
+		probe->getFormat(0, 0, &channels, &bits);
+		probe->getDefaults(&frequency, 0, 0, 0);
+		probe->release();
+
+		size_t decodedBytes = static_cast<size_t>(length) * channels * max(bits, 8) / 8;
+		float seconds = length / frequency;
+
+		size_t fileBytes = decodedBytes;
+
+		if (FILE *f = fopen(filename, "rb"))
+		{
+			fseek(f, 0, SEEK_END);
+			fileBytes = static_cast<size_t>(ftell(f));
+			fclose(f);
+		}
+
+		size_t used = GetResidentBytes();
+		size_t available = memoryBudget? (used < memoryBudget? memoryBudget - used : 0) : ~static_cast<size_t>(0);
+
+		bool hot = playsPerMinute >= hotPlaysPerMinute;
+
+		// Short or frequently played sounds are decoded when they fit
+		if ((decodedBytes <= smallDecodedBytes || hot || seconds <= longSeconds) && decodedBytes <= available)
+		{
+			// Unless compressing saves a lot and the sound is neither small nor hot
+			if (decodedBytes > smallDecodedBytes && !hot && fileBytes * 2 < decodedBytes && seconds > 1.0f)
+				return LoadCompressed;
+
+			return LoadDecoded;
+		}
+
+		// Keep long rare sounds out of memory
+		if (seconds > longSeconds && !hot)
+			return LoadStream;
+
+		// Compressed data (roughly the file size) if that fits and is really smaller
+		if (fileBytes <= available && fileBytes * 2 < decodedBytes)
+			return LoadCompressed;
+
+		return LoadStream;
+	}
+
+	// Add or remove a sound effect's memory from the per-mode totals
+	void SimpleFMOD::account(SoundEffect &effect, LoadMode loadMode, bool add)
+	{
+		if (add)
+		{
+			unsigned int used = 0;
+
+			if (effect.Get())
+				effect.Get()->getMemoryInfo(FMOD_MEMBITS_ALL, 0, &used, 0);
+
+			effect.loadMode = loadMode;
+			effect.residentBytes = used;
+			residentBytes[loadMode] += used;
+		}
+		else
+			residentBytes[loadMode] -= min(residentBytes[loadMode], effect.residentBytes);
+	}
+
+	size_t SimpleFMOD::GetResidentBytes() const
+	{
+		size_t total = 0;
+
+		for (int m = 0; m < LoadModeCount; m++)
+			total += residentBytes[m];
+
+		return total;
+	}
+
+	// Set up a song
+	Song::Song(SimpleFMOD *fmod, const char *data, FMOD::ChannelGroup *cg, FMOD_MODE mode, FMOD_CREATESOUNDEXINFO info) : SimpleFMODResource(fmod, false)
+	{
+		WatchStarving();
+
+		// Set stream size higher than the default (16384) to try to help reduce stuttering
+		engine->FMOD()->setStreamBufferSize(65536, FMOD_TIMEUNIT_RAWBYTES);
+
+		// Open the stream
+		FMOD::Sound *s = NULL;
+		MemoryCheck(engine->FMOD()->createStream(data, mode, &info, &s));
+		resource = ResourceType(s);
+
+		// Remember channel group
+		channelGroup = cg;
+		channel = NULL;
+
+		fade = false;
+		tempo = 120.0f;
+		firstBeatMs = 0.0f;
+
+		loadMarkers();
+	}
+
+	Song::Song(SimpleFMOD *fmod, const char *filename, FMOD::ChannelGroup *cg, FMOD_MODE mode) : SimpleFMODResource(fmod, false)
+	{
+		WatchStarving();
+
+		// Set stream size higher than the default (16384) to try to help reduce stuttering
+		engine->FMOD()->setStreamBufferSize(65536, FMOD_TIMEUNIT_RAWBYTES);
+
+		// Open the stream
+		FMOD::Sound *s = NULL;
+		MemoryCheck(engine->FMOD()->createStream(filename, mode, 0, &s));
 		resource = ResourceType(s);
 
 		// Remember channel group
 		channelGroup = cg;
+		channel = NULL;
+
+		fade = false;
+		tempo = 120.0f;
+		firstBeatMs = 0.0f;
+
+		loadMarkers();
 	}
 
-	SoundEffect::SoundEffect(SimpleFMOD *fmod, int resourceId, LPCTSTR resourceType, FMOD::ChannelGroup *cg, FMOD_MODE mode) : SimpleFMODResource(fmod)
+	Song::Song(SimpleFMOD *fmod, int resourceId, LPCTSTR resourceType, FMOD::ChannelGroup *cg, FMOD_MODE mode) : SimpleFMODResource(fmod, false)
 	{
+		WatchStarving();
+
 		HRSRC rsrc = FindResource(NULL, MAKEINTRESOURCE(resourceId), resourceType);
 		HGLOBAL handle = LoadResource(NULL, rsrc);
 
@@ -363,26 +1141,5678 @@ namespace SFMOD
 		audioInfo.cbsize = sizeof(FMOD_CREATESOUNDEXINFO);
 		audioInfo.length = static_cast<unsigned int>(audioSize);
 
-		FMOD::Sound *s;
-		ErrorCheck(engine->FMOD()->createSound(static_cast<const char *>(audioData), FMOD_OPENMEMORY | mode, &audioInfo, &s));
+		engine->FMOD()->setStreamBufferSize(65536, FMOD_TIMEUNIT_RAWBYTES);
+
+		FMOD::Sound *s = NULL;
+		MemoryCheck(engine->FMOD()->createStream(static_cast<const char *>(audioData), FMOD_OPENMEMORY | mode, &audioInfo, &s));
 		resource = ResourceType(s);
 
 		// Remember channel group
 		channelGroup = cg;
+		channel = NULL;
+
+		fade = false;
+		tempo = 120.0f;
+		firstBeatMs = 0.0f;
+
+		loadMarkers();
 	}
 
-	// Play a sound effect
-	void SoundEffect::Play()
+	// Whether the stream has run dry
+	bool Song::IsStarving()
 	{
-		FMOD::Channel *channel;
+		bool starving = false;
+
+		if (resource)
+			resource->getOpenState(0, 0, &starving, 0);
+
+		return starving;
+	}
+
+	// Update a song's fade status
+	void Song::Update()
+	{
+		// The song may have failed to start (for example over its memory budget)
+		if (!channel)
+			fade = false;
+
+		if (fade)
+		{
+			// Get fade progression from 0.0f - 1.0f depending on number of milliseconds elapsed since fade started
+			float progress = min(static_cast<float>(engine->GetTimeMs() - fadeStartTick) / fadeLength, 1.0f);
+
+			// Fade is over if progression is at 1.0f
+			if (progress == 1.0f)
+				fade = false;
+
+			// Translate linear progress into a smooth sine-squared fade effect
+			float volume = static_cast<float>(sin(progress * M_PI / 2));
+			volume *= volume;
+
+			// Scale volume between start and target volumes
+			volume = volume * (fadeTargetVol - fadeStartVol) + fadeStartVol;
+
+			// Alter song volume (directly, as this is not an API call to record)
+			channel->setVolume(volume);
+
+			// Post-fade processing
+			if (!fade)
+				channel->setPaused(fadePauseAfter);
+		}
+
+		// Deliver the events raised since the last update
+		SongEvent event;
+
+		while (events && events->Pop(event))
+			if (callbacks[event.type])
+				callbacks[event.type](*this, event);
+
+		// Nothing to do until the next fade or event
+		if (!fade)
+			Deactivate();
+	}
+
+	// Take over a sound that is already open
+	Song::Song(SimpleFMOD *fmod, FMOD::Sound *sound, FMOD::ChannelGroup *cg) : SimpleFMODResource(fmod, false)
+	{
+		WatchStarving();
+
+		resource = ResourceType(sound);
+		channelGroup = cg;
+		channel = NULL;
+
+		fade = false;
+		tempo = 120.0f;
+		firstBeatMs = 0.0f;
+
+		loadMarkers();
+	}
+
+	// Start playing a song
+	FMOD::Channel *Song::Start(bool paused)
+	{
+		if (engine->recordFile)
+		{
+			engine->record(RecSongStart);
+			engine->recordValue(recordId);
+			engine->recordValue(static_cast<unsigned char>(paused));
+		}
 
 		// Channel volume will be set to 1.0f (max) automatically
-		ErrorCheck(engine->FMOD()->playSound(FMOD_CHANNEL_FREE, resource.get(), true, &channel));
+		if (!resource || !MemoryCheck(engine->FMOD()->playSound(FMOD_CHANNEL_FREE, resource.get(), true, &channel)))
+			return channel = NULL;
 
 		// Add to channel group (for master volume)
 		if (channelGroup)
 			channel->setChannelGroup(channelGroup);
 
-		channel->setPaused(false);
+		// Songs repeat forever by default
+		channel->setLoopCount(-1);
+		channel->setMode(FMOD_LOOP_NORMAL);
+
+		// Flush buffer to ensure loop logic is executed
+		channel->setPosition(0, FMOD_TIMEUNIT_MS);
+
+		// Report markers, loops and the end through the channel callback
+		if (events)
+		{
+			channel->setUserData(this);
+			channel->setCallback(channelCallback);
+		}
+
+		// Set paused or not as applicable
+		if (!paused)
+			channel->setPaused(paused);
+
+		// Cancel any fade that was previously applied
+		fade = false;
+
+		return channel;
+	}
+
+	// Stop a song and free the channel
+	void Song::Stop()
+	{
+		if (engine->recordFile)
+		{
+			engine->record(RecSongStop);
+			engine->recordValue(recordId);
+		}
+
+		if (channel)
+			channel->stop();
+
+		channel = NULL;
+	}
+
+	// Get the FMOD channel used by a song
+	FMOD::Channel *Song::GetChannel()
+	{
+		return channel;
+	}
+
+	Song::Song(Song &&o) : SimpleFMODResource(std::move(o)), fade(false), tempo(o.tempo), firstBeatMs(o.firstBeatMs), channel(o.channel),
+		channelGroup(o.channelGroup), markers(std::move(o.markers)), loopPoint(o.loopPoint), events(std::move(o.events))
+	{
+		std::move(o.callbacks, o.callbacks + SongEventTypes, callbacks);
+
+		// The channel callback finds the song through the channel
+		if (channel && events)
+			channel->setUserData(this);
+
+		o.channel = NULL;
+	}
+
+	Song &Song::operator=(Song &&o)
+	{
+		if (this != &o)
+		{
+			if (channel && events)
+				channel->setCallback(NULL);
+
+			this->SimpleFMODResource::operator=(std::move(o));
+			channel = o.channel;
+			channelGroup = o.channelGroup;
+			fade = false;
+			tempo = o.tempo;
+			firstBeatMs = o.firstBeatMs;
+			markers = std::move(o.markers);
+			loopPoint = o.loopPoint;
+			events = std::move(o.events);
+			std::move(o.callbacks, o.callbacks + SongEventTypes, callbacks);
+
+			if (channel && events)
+				channel->setUserData(this);
+
+			o.channel = NULL;
+		}
+		return *this;
+	}
+
+	// Stop events arriving for a song which no longer exists
+	Song::~Song()
+	{
+		if (channel && events)
+			channel->setCallback(NULL);
+	}
+
+	// Markers from the sync points in the file (such as WAV cue points)
+	void Song::loadMarkers()
+	{
+		markers.clear();
+		loopPoint = NULL;
+
+		int count = 0;
+
+		if (!resource || resource->getNumSyncPoints(&count) != FMOD_OK)
+			return;
+
+		for (int i = 0; i < count; i++)
+		{
+			FMOD_SYNCPOINT *point;
+			char name[256];
+			Marker marker;
+
+			if (resource->getSyncPoint(i, &point) != FMOD_OK || resource->getSyncPointInfo(point, name, 256, &marker.position, FMOD_TIMEUNIT_PCM) != FMOD_OK)
+				continue;
+
+			marker.point = point;
+			marker.name = name;
+			markers.push_back(marker);
+		}
+	}
+
+	// Add a marker
+	int Song::AddMarker(unsigned int ms, const char *name)
+	{
+		Marker marker;
+
+		if (!resource || resource->addSyncPoint(ms, FMOD_TIMEUNIT_MS, name, &marker.point) != FMOD_OK)
+			return -1;
+
+		resource->getSyncPointInfo(marker.point, 0, 0, &marker.position, FMOD_TIMEUNIT_PCM);
+		marker.name = name;
+		markers.push_back(marker);
+
+		return static_cast<int>(markers.size()) - 1;
+	}
+
+	// Register an event callback. The event queue and the loop point are only created once they are needed
+	void Song::SetCallback(SongEventType type, SongEventCallback callback)
+	{
+		callbacks[type] = callback;
+
+		if (!events)
+			events.reset(new SPSCQueue<SongEvent, 64>());
+
+		if (type == SongLoop && !loopPoint && resource)
+		{
+			unsigned int length;
+			resource->getLength(&length, FMOD_TIMEUNIT_PCM);
+			resource->addSyncPoint(length > 0? length - 1 : 0, FMOD_TIMEUNIT_PCM, "SimpleFMOD loop", &loopPoint);
+		}
+	}
+
+	// Queue an event, timestamped with the DSP clock at which its sample was mixed
+	void Song::raise(SongEventType type, int marker, unsigned int position)
+	{
+		if (!callbacks[type])
+			return;
+
+		SongEvent event = { type, marker, marker >= 0? markers[marker].name.c_str() : NULL, position, engine->GetDSPClock() };
+
+		// The channel has moved on since the sample at 'position' was mixed (by a whole pass, if it wrapped)
+		unsigned int now;
+		float frequency;
+
+		if (type != SongEnd && channel->getPosition(&now, FMOD_TIMEUNIT_PCM) == FMOD_OK && channel->getFrequency(&frequency) == FMOD_OK
+			&& frequency > 0.0f)
+		{
+			unsigned int length;
+			resource->getLength(&length, FMOD_TIMEUNIT_PCM);
+
+			// In double: 'behind' times the output rate overflows 32 bits after a stall of a couple of seconds
+			unsigned int behind = now >= position? now - position : now + length - position;
+			event.clock -= min(static_cast<unsigned long long>(static_cast<double>(behind) * engine->GetSampleRate() / frequency), event.clock);
+		}
+
+		events->Push(event);
+	}
+
+	// Channel callback: turn FMOD's sync point and end notifications into song events. FMOD calls it from
+	// System::update(), so the events are delivered by the song's Update() in the same frame
+	FMOD_RESULT F_CALLBACK Song::channelCallback(FMOD_CHANNEL *c, FMOD_CHANNEL_CALLBACKTYPE type, void *commanddata1, void *commanddata2)
+	{
+		FMOD::Channel *channel = reinterpret_cast<FMOD::Channel *>(c);
+		Song *me;
+
+		if (channel->getUserData(reinterpret_cast<void **>(&me)) != FMOD_OK || !me || !me->events)
+			return FMOD_OK;
+
+		if (type == FMOD_CHANNEL_CALLBACKTYPE_SYNCPOINT)
+		{
+			FMOD_SYNCPOINT *point;
+			unsigned int position;
+
+			if (me->resource->getSyncPoint(static_cast<int>(reinterpret_cast<intptr_t>(commanddata1)), &point) != FMOD_OK)
+				return FMOD_OK;
+
+			me->resource->getSyncPointInfo(point, 0, 0, &position, FMOD_TIMEUNIT_PCM);
+
+			// The loop point on the last sample: the song wraps to the start unless this is its last pass
+			if (point == me->loopPoint)
+			{
+				int loopsLeft;
+
+				if (channel->getLoopCount(&loopsLeft) == FMOD_OK && loopsLeft != 0)
+					me->raise(SongLoop, -1, position + 1);
+			}
+			else
+			{
+				for (size_t m = 0; m < me->markers.size(); m++)
+					if (me->markers[m].point == point)
+					{
+						me->raise(SongMarker, static_cast<int>(m), position);
+						break;
+					}
+			}
+		}
+
+		else if (type == FMOD_CHANNEL_CALLBACKTYPE_END)
+		{
+			unsigned int length = 0;
+			me->resource->getLength(&length, FMOD_TIMEUNIT_PCM);
+			me->raise(SongEnd, -1, length);
+		}
+
+		// Get the events delivered this frame
+		me->Activate();
+		return FMOD_OK;
+	}
+
+	// Pause/unpause a song
+	bool Song::TogglePause()
+	{
+		if (engine->recordFile)
+		{
+			engine->record(RecSongTogglePause);
+			engine->recordValue(recordId);
+		}
+
+		// A song that failed to start has nothing to pause
+		if (!channel)
+			return false;
+
+		bool isPaused;
+		channel->getPaused(&isPaused);
+		channel->setPaused(!isPaused);
+		return !isPaused;
+	}
+
+	bool Song::GetPaused()
+	{
+		bool paused = false;
+
+		if (channel)
+			channel->getPaused(&paused);
+
+		return paused;
+	}
+
+	void Song::SetPaused(bool paused)
+	{
+		if (engine->recordFile)
+		{
+			engine->record(RecSongSetPaused);
+			engine->recordValue(recordId);
+			engine->recordValue(static_cast<unsigned char>(paused));
+		}
+
+		if (channel)
+			channel->setPaused(paused);
+	}
+
+	// Set song volume
+	void Song::SetVolume(float volume)
+	{
+		if (engine->recordFile)
+		{
+			engine->record(RecSongSetVolume);
+			engine->recordValue(recordId);
+			engine->recordValue(volume);
+		}
+
+		if (channel)
+			channel->setVolume(volume);
+	}
+
+	// Begin fading a song for ms milliseconds from the current volume to a target volume of 'target'
+	void Song::Fade(int ms, float target, bool pauseWhenDone)
+	{
+		float currentVolume;
+
+		if (engine->recordFile)
+		{
+			engine->record(RecSongFade);
+			engine->recordValue(recordId);
+			engine->recordValue(ms);
+			engine->recordValue(target);
+			engine->recordValue(static_cast<unsigned char>(pauseWhenDone));
+		}
+
+		if (!channel)
+			return;
+
+		fadeLength = ms;
+		fadeStartTick = engine->GetTimeMs();
+
+		channel->getVolume(&currentVolume);
+		fadeStartVol = currentVolume;
+		fadeTargetVol = target;
+		fade = true;
+		fadePauseAfter = pauseWhenDone;
+
+		Activate();
+	}
+
+	// Set the tempo grid of a song
+	void Song::SetTempo(float bpm, float firstBeat)
+	{
+		tempo = bpm;
+		firstBeatMs = firstBeat;
+	}
+
+	// Get the DSP clock at which the song reaches the next grid line
+	unsigned long long Song::GetGridClock(int gridDivision, int gridOffset)
+	{
+		unsigned int position;
+		float frequency;
+		unsigned long long now;
+
+		// Without a channel there is no grid: as soon as possible
+		if (!channel)
+			return engine->GetDSPClock() + engine->startLatency;
+
+		// Read the song position and the DSP clock in the same mixer block
+		engine->FMOD()->lockDSP();
+		channel->getPosition(&position, FMOD_TIMEUNIT_PCM);
+		now = engine->GetDSPClock();
+		engine->FMOD()->unlockDSP();
+
+		channel->getFrequency(&frequency);
+
+		// Song time relative to the first beat, and length of one grid step, in seconds
+		double seconds = static_cast<double>(position) / frequency - firstBeatMs / 1000.0;
+		double gridLength = 60.0 / (tempo * max(gridDivision, 1));
+
+		double next = (floor(seconds / gridLength) + 1 + gridOffset) * gridLength;
+
+		return now + static_cast<unsigned long long>((next - seconds) * engine->GetSampleRate() + 0.5);
+	}
+
+	// Prepare a sound effect
+	SoundEffect::SoundEffect(SimpleFMOD *fmod, const char *filename, FMOD::ChannelGroup *cg, FMOD_MODE mode) : SimpleFMODResource(fmod, false)
+	{
+		FMOD::Sound *s = NULL;
+		MemoryCheck(engine->FMOD()->createSound(filename, mode, 0, &s));
+		resource = ResourceType(s);
+
+		// Remember channel group
+		channelGroup = cg;
+
+		lengthClock = 0;
+		lastChannel = NULL;
+		lastTrigger = 0;
+		coalesced = 0;
+		lastVolume = 1.0f;
+		loadMode = LoadDecoded;
+		residentBytes = 0;
+	}
+
+	SoundEffect::SoundEffect(SimpleFMOD *fmod, int resourceId, LPCTSTR resourceType, FMOD::ChannelGroup *cg, FMOD_MODE mode) : SimpleFMODResource(fmod, false)
+	{
+		HRSRC rsrc = FindResource(NULL, MAKEINTRESOURCE(resourceId), resourceType);
+		HGLOBAL handle = LoadResource(NULL, rsrc);
+
+		DWORD audioSize = SizeofResource(NULL, rsrc);
+		LPVOID audioData = LockResource(handle);
+
+		FMOD_CREATESOUNDEXINFO audioInfo;
+		memset(&audioInfo, 0, sizeof(FMOD_CREATESOUNDEXINFO));
+		audioInfo.cbsize = sizeof(FMOD_CREATESOUNDEXINFO);
+		audioInfo.length = static_cast<unsigned int>(audioSize);
+
+		FMOD::Sound *s = NULL;
+		MemoryCheck(engine->FMOD()->createSound(static_cast<const char *>(audioData), FMOD_OPENMEMORY | mode, &audioInfo, &s));
+		resource = ResourceType(s);
+
+		// Remember channel group
+		channelGroup = cg;
+
+		lengthClock = 0;
+		lastChannel = NULL;
+		lastTrigger = 0;
+		coalesced = 0;
+		lastVolume = 1.0f;
+		loadMode = LoadDecoded;
+		residentBytes = 0;
+	}
+
+	// Take over a sound that is already open
+	SoundEffect::SoundEffect(SimpleFMOD *fmod, FMOD::Sound *sound, FMOD::ChannelGroup *cg) : SimpleFMODResource(fmod, false)
+	{
+		resource = ResourceType(sound);
+		channelGroup = cg;
+
+		lengthClock = 0;
+		lastChannel = NULL;
+		lastTrigger = 0;
+		coalesced = 0;
+		lastVolume = 1.0f;
+		loadMode = LoadDecoded;
+		residentBytes = 0;
+	}
+
+	// Play a sound effect
+	void SoundEffect::Play()
+	{
+		if (engine->recordFile)
+		{
+			engine->record(RecEffectPlay);
+			engine->recordValue(recordId);
+		}
+
+		unsigned long long clock = engine->GetFrameClock();
+		FMOD::Channel *existing;
+
+		if (admit(clock, existing))
+			start(clock, false);
+	}
+
+	// Play a sound effect at a specific DSP clock tick
+	FMOD::Channel *SoundEffect::PlayAt(unsigned long long dspClock)
+	{
+		// The clock is recorded relative to the frame, as the clock itself will differ on replay
+		if (engine->recordFile)
+		{
+			engine->record(RecEffectPlayAt);
+			engine->recordValue(recordId);
+			engine->recordValue(static_cast<long long>(dspClock - engine->GetFrameClock()));
+		}
+
+		FMOD::Channel *existing;
+
+		if (!admit(dspClock, existing))
+			return existing;
+
+		return start(dspClock, true);
+	}
+
+	// Decide whether a trigger may start a channel. Only bookkeeping here: culled triggers never reach FMOD
+	bool SoundEffect::admit(unsigned long long clock, FMOD::Channel *&existing)
+	{
+		unsigned long long sinceLast = clock - lastTrigger;
+		bool recent = lastChannel && clock >= lastTrigger;
+
+		existing = NULL;
+
+		// Merge into the last instance, raising its gain
+		if (recent && policy.coalesceMs > 0 && sinceLast * 1000 < static_cast<unsigned long long>(policy.coalesceMs) * engine->GetSampleRate())
+		{
+			coalesced++;
+			setCoalescedVolume();
+			existing = lastChannel;
+			return false;
+		}
+
+		if (recent && policy.minRetriggerMs > 0 && sinceLast * 1000 < static_cast<unsigned long long>(policy.minRetriggerMs) * engine->GetSampleRate())
+			return false;
+
+		if (policy.maxInstances > 0)
+		{
+			// Forget instances that have run to the end
+			unsigned long long now = engine->GetFrameClock();
+
+			instances.erase(std::remove_if(instances.begin(), instances.end(),
+				[now](const std::pair<FMOD::Channel *, unsigned long long> &i) { return i.second <= now; }), instances.end());
+
+			// Looping instances are only ever ended from outside, so ask FMOD about them when at the cap
+			if (static_cast<int>(instances.size()) >= policy.maxInstances)
+				instances.erase(std::remove_if(instances.begin(), instances.end(),
+					[](const std::pair<FMOD::Channel *, unsigned long long> &i) { bool playing = false; return i.second == ~0ULL && (i.first->isPlaying(&playing) != FMOD_OK || !playing); }), instances.end());
+
+			if (static_cast<int>(instances.size()) >= policy.maxInstances)
+				return false;
+		}
+
+		return true;
+	}
+
+	// Start a new instance
+	FMOD::Channel *SoundEffect::start(unsigned long long clock, bool delayed)
+	{
+		FMOD::Channel *channel;
+
+		// Channel volume will be set to 1.0f (max) automatically
+		if (!resource || !MemoryCheck(engine->FMOD()->playSound(FMOD_CHANNEL_FREE, resource.get(), true, &channel)))
+			return NULL;
+
+		// Add to channel group (for master volume)
+		if (channelGroup)
+			channel->setChannelGroup(channelGroup);
+
+		// The channel stays silent until the mixer reaches the requested clock
+		if (delayed)
+			channel->setDelay(FMOD_DELAYTYPE_DSPCLOCK_START, static_cast<unsigned int>(clock >> 32), static_cast<unsigned int>(clock));
+
+		// Tracked (which sets its volume) before it can be heard
+		track(channel, clock);
+		channel->setPaused(false);
+
+		return channel;
+	}
+
+	// Return accounted memory when the sound is released
+	void SoundEffect::release()
+	{
+		if (engine && resource && residentBytes)
+			engine->account(*this, loadMode, false);
+
+		residentBytes = 0;
+	}
+
+	void SoundEffect::track(FMOD::Channel *channel, unsigned long long clock, float pitch, float volume)
+	{
+		lastChannel = channel;
+		lastTrigger = clock;
+		coalesced = 1;
+		lastVolume = volume;
+
+		setCoalescedVolume();
+
+		if (policy.maxInstances > 0)
+		{
+			FMOD_MODE mode;
+			resource->getMode(&mode);
+
+			if (!lengthClock)
+			{
+				unsigned int length;
+				float frequency;
+
+				resource->getLength(&length, FMOD_TIMEUNIT_PCM);
+				resource->getDefaults(&frequency, 0, 0, 0);
+				lengthClock = static_cast<unsigned long long>(static_cast<double>(length) * engine->GetSampleRate() / frequency) + 1;
+			}
+
+			instances.push_back(std::make_pair(channel, (mode & (FMOD_LOOP_NORMAL | FMOD_LOOP_BIDI))? ~0ULL : clock + static_cast<unsigned long long>(lengthClock / pitch)));
+		}
+	}
+
+	// Channel volumes are limited to 1.0f, so coalescing leaves headroom for the gain of merged triggers
+	void SoundEffect::setCoalescedVolume()
+	{
+		float gain = 1.0f;
+
+		if (policy.coalesceMs > 0)
+		{
+			float headroom = max(policy.maxCoalesceGain, 1.0f);
+			gain = min(sqrtf(static_cast<float>(coalesced)), headroom) / headroom;
+		}
+
+		if (lastVolume * gain != 1.0f)
+			lastChannel->setVolume(lastVolume * gain);
+	}
+
+	// Play a sound effect on a song's beat grid
+	FMOD::Channel *SoundEffect::PlayQuantized(Song &song, int gridDivision, int gridOffset)
+	{
+		return PlayAt(song.GetGridClock(gridDivision, gridOffset));
+	}
+
+	// Hash the contents of a file (64-bit FNV-1a)
+	static bool hashFile(const char *filename, unsigned long long &hash)
+	{
+		FILE *f = fopen(filename, "rb");
+
+		if (!f)
+			return false;
+
+		std::vector<unsigned char> buffer(65536);
+		size_t read;
+
+		hash = 14695981039346656037ULL;
+
+		while ((read = fread(&buffer[0], 1, buffer.size(), f)) > 0)
+			for (size_t i = 0; i < read; i++)
+				hash = (hash ^ buffer[i]) * 1099511628211ULL;
+
+		fclose(f);
+		return true;
+	}
+
+	// Convert one decoded sample to floating point (-1.0f to +1.0f)
+	static float sampleToFloat(const char *sample, FMOD_SOUND_FORMAT format)
+	{
+		switch (format)
+		{
+		case FMOD_SOUND_FORMAT_PCM8:
+			return *reinterpret_cast<const signed char *>(sample) / 128.0f;
+
+		case FMOD_SOUND_FORMAT_PCM16:
+			return *reinterpret_cast<const short *>(sample) / 32768.0f;
+
+		case FMOD_SOUND_FORMAT_PCM24:
+			{
+				const unsigned char *b = reinterpret_cast<const unsigned char *>(sample);
+				int v = (b[0] << 8) | (b[1] << 16) | (b[2] << 24);
+				return (v >> 8) / 8388608.0f;
+			}
+
+		case FMOD_SOUND_FORMAT_PCM32:
+			return *reinterpret_cast<const int *>(sample) / 2147483648.0f;
+
+		case FMOD_SOUND_FORMAT_PCMFLOAT:
+			return *reinterpret_cast<const float *>(sample);
+
+		default:
+			return 0.0f;
+		}
+	}
+
+	// Start building or loading a waveform pyramid
+	WaveformCache::WaveformCache(SimpleFMOD *fmod, const char *file, const char *dir)
+		: engine(fmod), filename(file), cacheDir(dir? dir : ""), state(Building), progress(0), cancel(false),
+		  file(INVALID_HANDLE_VALUE), mapping(NULL), header(NULL)
+	{
+		worker = std::thread(&WaveformCache::build, this);
+	}
+
+	// Stop any build in progress and release the mapping
+	WaveformCache::~WaveformCache()
+	{
+		cancel = true;
+
+		if (worker.joinable())
+			worker.join();
+
+		unmap();
+	}
+
+	// Background thread: find the cached pyramid by content hash or decode the sound and create it
+	void WaveformCache::build()
+	{
+		unsigned long long hash;
+
+		if (!hashFile(filename.c_str(), hash))
+		{
+			state = Failed;
+			return;
+		}
+
+		// Cache file is keyed by the content hash so that editing the asset invalidates it, and assets sharing a cache directory share pyramids
+		char key[32];
+		sprintf(key, "%016llx.sfwf", hash);
+
+		std::string path = cacheDir.empty()? filename + "." + key : cacheDir + "\\" + key;
+
+		// Already cached
+		if (map(path, hash))
+		{
+			progress = 1000;
+			state = Ready;
+			return;
+		}
+
+		std::vector<PackedPeak> level0;
+		unsigned int sampleRate;
+		unsigned long long totalFrames;
+
+		if (!decode(level0, sampleRate, totalFrames) || !write(path, hash, sampleRate, totalFrames, level0) || !map(path, hash))
+		{
+			state = Failed;
+			return;
+		}
+
+		progress = 1000;
+		state = Ready;
+	}
+
+	// Decode the whole sound into the finest level of the pyramid
+	bool WaveformCache::decode(std::vector<PackedPeak> &level0, unsigned int &sampleRate, unsigned long long &totalFrames)
+	{
+		// Open the file for decoding only (no playback buffers are created)
+		FMOD::Sound *s;
+		if (engine->FMOD()->createSound(filename.c_str(), FMOD_OPENONLY | FMOD_ACCURATETIME, 0, &s) != FMOD_OK)
+			return false;
+
+		ResourceType sound(s);
+
+		FMOD_SOUND_FORMAT format;
+		int channels, bits;
+		float frequency;
+		unsigned int length;
+
+		sound->getFormat(0, &format, &channels, &bits);
+		sound->getDefaults(&frequency, 0, 0, 0);
+		sound->getLength(&length, FMOD_TIMEUNIT_PCM);
+
+		if (format < FMOD_SOUND_FORMAT_PCM8 || format > FMOD_SOUND_FORMAT_PCMFLOAT || channels < 1 || bits < 8)
+			return false;
+
+		int sampleBytes = bits / 8;
+		int frameBytes = sampleBytes * channels;
+
+		std::vector<char> buffer(BaseBucket * frameBytes * 64);
+		level0.reserve(length / BaseBucket + 1);
+
+		// Accumulators for the bucket in progress
+		float bucketMin = 0.0f, bucketMax = 0.0f;
+		double bucketSum = 0.0;
+		unsigned int bucketFrames = 0;
+
+		totalFrames = 0;
+
+		for (;;)
+		{
+			if (cancel)
+				return false;
+
+			unsigned int read = 0;
+			FMOD_RESULT result = sound->readData(&buffer[0], static_cast<unsigned int>(buffer.size()), &read);
+
+			unsigned int frames = read / frameBytes;
+
+			for (unsigned int i = 0; i < frames; i++)
+			{
+				for (int c = 0; c < channels; c++)
+				{
+					float v = sampleToFloat(&buffer[i * frameBytes + c * sampleBytes], format);
+
+					bucketMin = (bucketFrames == 0 && c == 0)? v : min(bucketMin, v);
+					bucketMax = (bucketFrames == 0 && c == 0)? v : max(bucketMax, v);
+					bucketSum += v * v;
+				}
+
+				if (++bucketFrames == BaseBucket)
+				{
+					PackedPeak p = { static_cast<short>(max(bucketMin, -1.0f) * 32767), static_cast<short>(min(bucketMax, 1.0f) * 32767),
+						static_cast<short>(min(sqrt(bucketSum / (bucketFrames * channels)), 1.0) * 32767) };
+					level0.push_back(p);
+
+					bucketSum = 0.0;
+					bucketFrames = 0;
+				}
+			}
+
+			totalFrames += frames;
+
+			// Decoding is 90% of the work, writing the pyramid is the rest
+			if (length)
+				progress = static_cast<int>(min(totalFrames * 900 / length, 900ULL));
+
+			if (result != FMOD_OK || read < buffer.size())
+				break;
+		}
+
+		// Partial final bucket
+		if (bucketFrames)
+		{
+			PackedPeak p = { static_cast<short>(max(bucketMin, -1.0f) * 32767), static_cast<short>(min(bucketMax, 1.0f) * 32767),
+				static_cast<short>(min(sqrt(bucketSum / (bucketFrames * channels)), 1.0) * 32767) };
+			level0.push_back(p);
+		}
+
+		sampleRate = static_cast<unsigned int>(frequency);
+
+		return totalFrames > 0 && sampleRate > 0;
+	}
+
+	// Build the coarser levels by merging pairs of buckets and write the pyramid to disk
+	bool WaveformCache::write(const std::string &path, unsigned long long hash, unsigned int sampleRate, unsigned long long totalFrames, std::vector<PackedPeak> &level0)
+	{
+		std::vector<std::vector<PackedPeak>> levels;
+		levels.push_back(std::vector<PackedPeak>());
+		levels.back().swap(level0);
+
+		while (levels.back().size() > 1 && levels.size() < 32)
+		{
+			const std::vector<PackedPeak> &fine = levels.back();
+			std::vector<PackedPeak> coarse((fine.size() + 1) / 2);
+
+			for (size_t i = 0; i < coarse.size(); i++)
+			{
+				const PackedPeak &a = fine[i * 2];
+				const PackedPeak &b = (i * 2 + 1 < fine.size())? fine[i * 2 + 1] : a;
+
+				coarse[i].min = min(a.min, b.min);
+				coarse[i].max = max(a.max, b.max);
+				coarse[i].rms = static_cast<short>(sqrt((static_cast<double>(a.rms) * a.rms + static_cast<double>(b.rms) * b.rms) / 2));
+			}
+
+			levels.push_back(std::vector<PackedPeak>());
+			levels.back().swap(coarse);
+		}
+
+		Header h;
+		memset(&h, 0, sizeof(Header));
+		memcpy(h.magic, "SFMODWF", 8);
+		h.version = 1;
+		h.sampleRate = sampleRate;
+		h.contentHash = hash;
+		h.totalFrames = totalFrames;
+		h.baseBucket = BaseBucket;
+		h.numLevels = static_cast<unsigned int>(levels.size());
+
+		unsigned long long offset = sizeof(Header);
+
+		for (unsigned int l = 0; l < h.numLevels; l++)
+		{
+			h.levelOffset[l] = offset;
+			h.levelCount[l] = levels[l].size();
+			offset += levels[l].size() * sizeof(PackedPeak);
+		}
+
+		// Write to a temporary file first so that a crash never leaves a truncated pyramid behind
+		std::string temp = path + ".tmp";
+		FILE *f = fopen(temp.c_str(), "wb");
+
+		if (!f)
+			return false;
+
+		bool ok = fwrite(&h, sizeof(Header), 1, f) == 1;
+
+		for (unsigned int l = 0; ok && l < h.numLevels; l++)
+			ok = fwrite(&levels[l][0], sizeof(PackedPeak), levels[l].size(), f) == levels[l].size();
+
+		fclose(f);
+
+		return ok && MoveFileEx(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+	}
+
+	// Memory-map a pyramid file and check it matches the asset
+	bool WaveformCache::map(const std::string &path, unsigned long long hash)
+	{
+		file = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER size;
+		GetFileSizeEx(file, &size);
+
+		if (size.QuadPart >= static_cast<LONGLONG>(sizeof(Header)))
+		{
+			mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+			if (mapping)
+				header = static_cast<const Header *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		}
+
+		bool valid = header && memcmp(header->magic, "SFMODWF", 8) == 0 && header->version == 1 && header->contentHash == hash
+			&& header->numLevels > 0 && header->numLevels <= 32 && header->sampleRate > 0;
+
+		for (unsigned int l = 0; valid && l < header->numLevels; l++)
+			valid = header->levelOffset[l] + header->levelCount[l] * sizeof(PackedPeak) <= static_cast<unsigned long long>(size.QuadPart);
+
+		if (!valid)
+			unmap();
+
+		return valid;
+	}
+
+	void WaveformCache::unmap()
+	{
+		if (header)
+			UnmapViewOfFile(header);
+
+		if (mapping)
+			CloseHandle(mapping);
+
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+
+		header = NULL;
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+	}
+
+	// Get the length of the sound in seconds
+	double WaveformCache::GetLength() const
+	{
+		if (!IsReady())
+			return 0.0;
+
+		return static_cast<double>(header->totalFrames) / header->sampleRate;
+	}
+
+	// Get peaks for a time range at a given pixel width
+	// The level is chosen so that each pixel covers between one and two buckets, so the cost is proportional to the number of pixels
+	int WaveformCache::GetPeaks(double startSec, double endSec, int pixels, WaveformPeak *out) const
+	{
+		if (!IsReady() || pixels <= 0 || endSec <= startSec)
+			return 0;
+
+		double framesPerPixel = (endSec - startSec) * header->sampleRate / pixels;
+
+		// Pick the coarsest level whose buckets are no wider than one pixel
+		unsigned int level = 0;
+		double bucketFrames = header->baseBucket;
+
+		while (level + 1 < header->numLevels && bucketFrames * 2 <= framesPerPixel)
+		{
+			level++;
+			bucketFrames *= 2;
+		}
+
+		const PackedPeak *peaks = reinterpret_cast<const PackedPeak *>(reinterpret_cast<const char *>(header) + header->levelOffset[level]);
+		long long count = static_cast<long long>(header->levelCount[level]);
+
+		double firstBucket = startSec * header->sampleRate / bucketFrames;
+		double bucketsPerPixel = framesPerPixel / bucketFrames;
+
+		for (int p = 0; p < pixels; p++)
+		{
+			long long b0 = static_cast<long long>(floor(firstBucket + p * bucketsPerPixel));
+			long long b1 = static_cast<long long>(floor(firstBucket + (p + 1) * bucketsPerPixel));
+
+			b1 = max(b1, b0 + 1);
+			b0 = max(b0, 0LL);
+			b1 = min(b1, count);
+
+			// Outside the sound
+			if (b0 >= b1)
+			{
+				out[p].min = out[p].max = out[p].rms = 0.0f;
+				continue;
+			}
+
+			short lo = peaks[b0].min, hi = peaks[b0].max;
+			double sumSquares = 0.0;
+
+			for (long long b = b0; b < b1; b++)
+			{
+				lo = min(lo, peaks[b].min);
+				hi = max(hi, peaks[b].max);
+				sumSquares += static_cast<double>(peaks[b].rms) * peaks[b].rms;
+			}
+
+			out[p].min = lo / 32767.0f;
+			out[p].max = hi / 32767.0f;
+			out[p].rms = static_cast<float>(sqrt(sumSquares / (b1 - b0)) / 32767.0);
+		}
+
+		return pixels;
+	}
+
+	// Attach a level meter to a channel group
+	MeterTap::MeterTap(SimpleFMOD *fmod, FMOD::ChannelGroup *channelGroup) : position(0)
+	{
+		FMOD_DSP_DESCRIPTION desc;
+		memset(&desc, 0, sizeof(FMOD_DSP_DESCRIPTION));
+
+		strcpy(desc.name, "SimpleFMOD meter");
+		desc.read = read;
+		desc.userdata = this;
+
+		ErrorCheck(fmod->FMOD()->createDSP(&desc, &dsp));
+		ErrorCheck(channelGroup->addDSP(dsp, 0));
+	}
+
+	MeterTap::~MeterTap()
+	{
+		dsp->remove();
+		dsp->release();
+	}
+
+	// Measure one block of audio on the mixer thread (audio passes through unchanged)
+	FMOD_RESULT F_CALLBACK MeterTap::read(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer, unsigned int length, int inchannels, int outchannels)
+	{
+		MeterTap *me;
+		reinterpret_cast<FMOD::DSP *>(dsp_state->instance)->getUserData(reinterpret_cast<void **>(&me));
+
+		memcpy(outbuffer, inbuffer, length * outchannels * sizeof(float));
+
+		MeterFrame &frame = me->levels.Back();
+
+		for (int c = 0; c < 2; c++)
+		{
+			float peak = 0.0f;
+			float sum = 0.0f;
+
+			if (c < inchannels)
+			{
+				for (unsigned int i = 0; i < length; i++)
+				{
+					float v = inbuffer[i * inchannels + c];
+					peak = max(peak, fabs(v));
+					sum += v * v;
+				}
+			}
+
+			frame.peak[c] = peak;
+			frame.rms[c] = length? sqrt(sum / length) : 0.0f;
+		}
+
+		me->position += length;
+		frame.position = me->position;
+
+		me->levels.Publish();
+
+		return FMOD_OK;
+	}
+
+	// Set up a spectrogram
+	Spectrogram::Spectrogram(SimpleFMOD *fmod, int fftSize, int numFrames, Layout l, Scale sc, int outputBins, bool db, float floorDb)
+		: layout(l), scale(sc), decibels(db), floorDecibels(floorDb), fftBins(fftSize), frames(max(numFrames, 1)), writeIndex(0), count(0)
+	{
+		bins = (outputBins > 0 && sc != Linear)? outputBins : fftBins;
+
+		// getSpectrum() spreads fftBins bins from 0Hz to the Nyquist frequency
+		binWidth = fmod->GetSampleRate() / 2.0f / fftBins;
+
+		data.assign(static_cast<size_t>(frames) * bins, floorDb);
+		captureLeft.resize(fftBins);
+		captureRight.resize(fftBins);
+		frame.resize(max(fftBins, bins));
+
+		if (scale != Linear)
+			buildFilterBank();
+	}
+
+	// Convert between Hz and the mel scale
+	static float hzToMel(float hz) { return 2595.0f * log10(1.0f + hz / 700.0f); }
+	static float melToHz(float mel) { return 700.0f * (pow(10.0f, mel / 2595.0f) - 1.0f); }
+
+	// Build the sparse re-binning matrix: one triangular filter per output bin, spaced on the log or mel scale
+	void Spectrogram::buildFilterBank()
+	{
+		float nyquist = binWidth * fftBins;
+
+		// Filter edges (bins + 2 points) evenly spaced on the chosen scale between the first FFT bin and Nyquist
+		std::vector<float> edges(bins + 2);
+		float low = binWidth;
+
+		for (int k = 0; k < bins + 2; k++)
+		{
+			float t = static_cast<float>(k) / (bins + 1);
+
+			if (scale == Mel)
+				edges[k] = melToHz(hzToMel(low) + t * (hzToMel(nyquist) - hzToMel(low)));
+			else
+				edges[k] = low * pow(nyquist / low, t);
+		}
+
+		rowStart.assign(1, 0);
+		weights.clear();
+
+		for (int k = 0; k < bins; k++)
+		{
+			float left = edges[k], centre = edges[k + 1], right = edges[k + 2];
+			size_t first = weights.size();
+			float total = 0.0f;
+
+			for (int j = static_cast<int>(left / binWidth); j <= static_cast<int>(right / binWidth) + 1 && j < fftBins; j++)
+			{
+				float f = j * binWidth;
+				float w = (f <= centre)? (f - left) / (centre - left) : (right - f) / (right - centre);
+
+				if (w > 0.0f)
+				{
+					Weight e = { j, w };
+					weights.push_back(e);
+					total += w;
+				}
+			}
+
+			// Filters narrower than an FFT bin interpolate between the two nearest bins instead
+			if (total == 0.0f)
+			{
+				float pos = min(centre / binWidth, static_cast<float>(fftBins - 1));
+				int j = static_cast<int>(pos);
+				Weight a = { j, 1.0f - (pos - j) };
+				Weight b = { min(j + 1, fftBins - 1), pos - j };
+				weights.push_back(a);
+				weights.push_back(b);
+				total = 1.0f;
+			}
+
+			// Normalize each filter so that it averages its bins
+			for (size_t i = first; i < weights.size(); i++)
+				weights[i].weight /= total;
+
+			rowStart.push_back(static_cast<int>(weights.size()));
+		}
+	}
+
+	// Capture from a channel
+	void Spectrogram::Capture(FMOD::Channel *channel, int channels, FMOD_DSP_FFT_WINDOW window)
+	{
+		channel->getSpectrum(&captureLeft[0], fftBins, 0, window);
+
+		if (channels > 1)
+		{
+			channel->getSpectrum(&captureRight[0], fftBins, 1, window);
+
+			for (int i = 0; i < fftBins; i++)
+				captureLeft[i] = (captureLeft[i] + captureRight[i]) / 2;
+		}
+
+		Push(&captureLeft[0]);
+	}
+
+	// Capture from a channel group
+	void Spectrogram::Capture(FMOD::ChannelGroup *channelGroup, int channels, FMOD_DSP_FFT_WINDOW window)
+	{
+		channelGroup->getSpectrum(&captureLeft[0], fftBins, 0, window);
+
+		if (channels > 1)
+		{
+			channelGroup->getSpectrum(&captureRight[0], fftBins, 1, window);
+
+			for (int i = 0; i < fftBins; i++)
+				captureLeft[i] = (captureLeft[i] + captureRight[i]) / 2;
+		}
+
+		Push(&captureLeft[0]);
+	}
+
+	// Add a frame to the ring, overwriting the oldest
+	void Spectrogram::Push(const float *spectrum)
+	{
+		// Re-bin (sparse matrix-vector product) or copy
+		if (scale != Linear)
+		{
+			for (int k = 0; k < bins; k++)
+			{
+				float sum = 0.0f;
+
+				for (int i = rowStart[k]; i < rowStart[k + 1]; i++)
+					sum += spectrum[weights[i].input] * weights[i].weight;
+
+				frame[k] = sum;
+			}
+		}
+		else
+			memcpy(&frame[0], spectrum, bins * sizeof(float));
+
+		if (decibels)
+			ToDecibels(&frame[0], bins, floorDecibels);
+
+		// Store the frame as a row, or as one column of the bin-major ring
+		if (layout == FrameMajor)
+			memcpy(&data[static_cast<size_t>(writeIndex) * bins], &frame[0], bins * sizeof(float));
+		else
+			for (int k = 0; k < bins; k++)
+				data[static_cast<size_t>(k) * frames + writeIndex] = frame[k];
+
+		writeIndex = (writeIndex + 1) % frames;
+		count = min(count + 1, frames);
+	}
+
+	// Get the centre frequency of a stored bin
+	float Spectrogram::GetBinFrequency(int bin) const
+	{
+		if (scale == Linear)
+			return bin * binWidth;
+
+		// Weighted centre of the filter's input bins
+		float centre = 0.0f;
+
+		for (int i = rowStart[bin]; i < rowStart[bin + 1]; i++)
+			centre += weights[i].input * weights[i].weight;
+
+		return centre * binWidth;
+	}
+
+	// Get a frame (FrameMajor layout)
+	const float *Spectrogram::GetFrame(int age) const
+	{
+		if (layout != FrameMajor || age < 0 || age >= count)
+			return NULL;
+
+		return &data[static_cast<size_t>((writeIndex - 1 - age + frames) % frames) * bins];
+	}
+
+	// Get a bin's history (BinMajor layout)
+	int Spectrogram::GetBinHistory(int bin, const float **first, int *firstCount, const float **second, int *secondCount) const
+	{
+		if (layout != BinMajor || bin < 0 || bin >= bins)
+			return 0;
+
+		const float *row = &data[static_cast<size_t>(bin) * frames];
+
+		// Until the ring has wrapped, history is a single span from the start of the row
+		if (count < frames)
+		{
+			*first = row;
+			*firstCount = count;
+			*second = NULL;
+			*secondCount = 0;
+		}
+		else
+		{
+			*first = row + writeIndex;
+			*firstCount = frames - writeIndex;
+			*second = row;
+			*secondCount = writeIndex;
+		}
+
+		return count;
+	}
+
+	// Linear magnitude to decibels: 20 * log10(x), using a polynomial approximation of log2 on four values at a time
+	void Spectrogram::ToDecibels(float *values, int count, float floorDecibels)
+	{
+		float floorValue = pow(10.0f, floorDecibels / 20.0f);
+		int i = 0;
+
+#ifdef SFMOD_SSE2
+		const __m128 floorVec = _mm_set1_ps(floorValue);
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128i mantissaMask = _mm_set1_epi32(0x007FFFFF);
+		const __m128i bias = _mm_set1_epi32(127);
+		const __m128 scaleDb = _mm_set1_ps(6.0205999f);
+
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 x = _mm_max_ps(_mm_loadu_ps(values + i), floorVec);
+			__m128i bits = _mm_castps_si128(x);
+
+			// Split into exponent and mantissa t in [0, 1)
+			__m128 exponent = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), bias));
+			__m128 t = _mm_sub_ps(_mm_or_ps(_mm_castsi128_ps(_mm_and_si128(bits, mantissaMask)), one), one);
+
+			// log2(1 + t) (error below 0.001dB)
+			__m128 p = _mm_set1_ps(0.045870744f);
+			p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(-0.19439042f));
+			p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(0.41539775f));
+			p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(-0.70867493f));
+			p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(1.4418251f));
+			p = _mm_mul_ps(p, t);
+
+			_mm_storeu_ps(values + i, _mm_mul_ps(_mm_add_ps(exponent, p), scaleDb));
+		}
+#endif
+
+		for (; i < count; i++)
+			values[i] = 20.0f * log10(max(values[i], floorValue));
+	}
+
+	// In-place radix-2 complex FFT with precomputed twiddle factors and bit-reversal table
+	class FFT
+	{
+	private:
+		int size;
+		std::vector<std::complex<float>> twiddles;
+		std::vector<int> reversed;
+
+	public:
+		FFT(int n) : size(n), twiddles(n / 2), reversed(n)
+		{
+			for (int i = 0; i < n / 2; i++)
+				twiddles[i] = std::polar(1.0f, static_cast<float>(-2 * M_PI * i / n));
+
+			int bits = 0;
+			while ((1 << bits) < n)
+				bits++;
+
+			for (int j = 0; j < n; j++)
+			{
+				int r = 0;
+				for (int b = 0; b < bits; b++)
+					r |= ((j >> b) & 1) << (bits - 1 - b);
+				reversed[j] = r;
+			}
+		}
+
+		int Size() const { return size; }
+
+		// Forward transform (inverse = true for the unscaled inverse transform)
+		void Transform(std::complex<float> *data, bool inverse = false) const
+		{
+			for (int i = 0; i < size; i++)
+				if (i < reversed[i])
+					std::swap(data[i], data[reversed[i]]);
+
+			for (int len = 2; len <= size; len <<= 1)
+			{
+				int step = size / len;
+
+				for (int i = 0; i < size; i += len)
+					for (int j = 0; j < len / 2; j++)
+					{
+						std::complex<float> w = inverse? std::conj(twiddles[j * step]) : twiddles[j * step];
+						std::complex<float> u = data[i + j];
+						std::complex<float> v = data[i + j + len / 2] * w;
+
+						data[i + j] = u + v;
+						data[i + j + len / 2] = u - v;
+					}
+			}
+		}
+	};
+
+	// Set up an empty fingerprint index
+	FingerprintIndex::FingerprintIndex() : file(INVALID_HANDLE_VALUE), mapping(NULL), view(NULL), header(NULL), pendingSorted(true) {}
+
+	FingerprintIndex::~FingerprintIndex()
+	{
+		close();
+	}
+
+	void FingerprintIndex::close()
+	{
+		if (view)
+			UnmapViewOfFile(view);
+
+		if (mapping)
+			CloseHandle(mapping);
+
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+
+		file = INVALID_HANDLE_VALUE;
+		mapping = NULL;
+		view = NULL;
+		header = NULL;
+	}
+
+	// Map an index file
+	bool FingerprintIndex::Open(const char *path)
+	{
+		close();
+
+		file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER size;
+		GetFileSizeEx(file, &size);
+
+		if (size.QuadPart >= static_cast<LONGLONG>(sizeof(Header)))
+		{
+			mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+			if (mapping)
+				view = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		}
+
+		header = reinterpret_cast<const Header *>(view);
+
+		bool valid = header && memcmp(header->magic, "SFMODFP", 8) == 0 && header->version == 1;
+
+		// Every section must lie within the file, in order, and every track's fingerprint and name within their
+		// sections, so a truncated or damaged index is rejected rather than read out of bounds
+		if (valid)
+		{
+			const Header &h = *header;
+			unsigned long long fileSize = static_cast<unsigned long long>(size.QuadPart);
+
+			valid = h.tracksOffset >= sizeof(Header) && h.tracksOffset <= fileSize && h.numTracks <= (fileSize - h.tracksOffset) / sizeof(TrackInfo)
+				&& h.tracksOffset + h.numTracks * sizeof(TrackInfo) <= h.namesOffset && h.namesOffset <= h.hashesOffset
+				&& h.hashesOffset % sizeof(unsigned int) == 0 && h.hashesOffset <= h.entriesOffset && h.entriesOffset <= fileSize
+				&& h.numEntries <= (fileSize - h.entriesOffset) / sizeof(Entry);
+
+			const TrackInfo *tracks = reinterpret_cast<const TrackInfo *>(view + h.tracksOffset);
+			unsigned long long numHashes = (h.entriesOffset - h.hashesOffset) / sizeof(unsigned int);
+			unsigned long long namesSize = h.hashesOffset - h.namesOffset;
+
+			for (unsigned int t = 0; valid && t < h.numTracks; t++)
+				valid = tracks[t].hashOffset <= numHashes && tracks[t].hashCount <= numHashes - tracks[t].hashOffset
+					&& tracks[t].nameOffset < namesSize
+					&& memchr(view + h.namesOffset + tracks[t].nameOffset, 0, static_cast<size_t>(namesSize - tracks[t].nameOffset)) != NULL;
+		}
+
+		if (!valid)
+			close();
+
+		return valid;
+	}
+
+	// Get the fingerprint of an indexed track
+	const unsigned int *FingerprintIndex::trackHashes(int track, unsigned int &count) const
+	{
+		if (track < mappedTracks())
+		{
+			const TrackInfo &info = reinterpret_cast<const TrackInfo *>(view + header->tracksOffset)[track];
+			count = info.hashCount;
+			return reinterpret_cast<const unsigned int *>(view + header->hashesOffset) + info.hashOffset;
+		}
+
+		const Fingerprint &fp = pendingPrints[track - mappedTracks()];
+		count = static_cast<unsigned int>(fp.size());
+		return fp.empty()? NULL : &fp[0];
+	}
+
+	const char *FingerprintIndex::GetTrackName(int track) const
+	{
+		if (track < 0 || track >= GetTrackCount())
+			return NULL;
+
+		if (track < mappedTracks())
+			return view + header->namesOffset + reinterpret_cast<const TrackInfo *>(view + header->tracksOffset)[track].nameOffset;
+
+		return pendingNames[track - mappedTracks()].c_str();
+	}
+
+	// Add a track
+	int FingerprintIndex::Add(const char *name, const Fingerprint &fingerprint)
+	{
+		int track = GetTrackCount();
+
+		pendingNames.push_back(name);
+		pendingPrints.push_back(fingerprint);
+
+		for (size_t i = 0; i < fingerprint.size(); i++)
+		{
+			Entry e = { fingerprint[i], static_cast<unsigned int>(track), static_cast<unsigned int>(i) };
+			pendingEntries.push_back(e);
+		}
+
+		pendingSorted = false;
+		return track;
+	}
+
+	// Write the merged index
+	bool FingerprintIndex::Save(const char *path)
+	{
+		int numTracks = GetTrackCount();
+
+		// Merge the mapped and pending postings
+		std::vector<Entry> entries;
+
+		if (header)
+		{
+			const Entry *mapped = reinterpret_cast<const Entry *>(view + header->entriesOffset);
+			entries.assign(mapped, mapped + header->numEntries);
+		}
+
+		entries.insert(entries.end(), pendingEntries.begin(), pendingEntries.end());
+		std::sort(entries.begin(), entries.end());
+
+		// Track table and names
+		std::vector<TrackInfo> tracks(numTracks);
+		std::string names;
+		unsigned long long hashCount = 0;
+
+		for (int t = 0; t < numTracks; t++)
+		{
+			unsigned int count;
+			trackHashes(t, count);
+
+			tracks[t].hashOffset = hashCount;
+			tracks[t].hashCount = count;
+			tracks[t].nameOffset = static_cast<unsigned int>(names.size());
+
+			names += GetTrackName(t);
+			names += '\0';
+			hashCount += count;
+		}
+
+		Header h;
+		memset(&h, 0, sizeof(Header));
+		memcpy(h.magic, "SFMODFP", 8);
+		h.version = 1;
+		h.numTracks = numTracks;
+		h.tracksOffset = sizeof(Header);
+		h.namesOffset = h.tracksOffset + numTracks * sizeof(TrackInfo);
+		h.hashesOffset = (h.namesOffset + names.size() + 3) & ~3ULL;
+		h.entriesOffset = h.hashesOffset + hashCount * sizeof(unsigned int);
+		h.numEntries = entries.size();
+
+		std::string temp = std::string(path) + ".tmp";
+		FILE *f = fopen(temp.c_str(), "wb");
+
+		if (!f)
+			return false;
+
+		static const char padding[4] = { 0 };
+
+		bool ok = fwrite(&h, sizeof(Header), 1, f) == 1
+			&& (tracks.empty() || fwrite(&tracks[0], sizeof(TrackInfo), tracks.size(), f) == tracks.size())
+			&& fwrite(names.c_str(), 1, names.size(), f) == names.size()
+			&& fwrite(padding, 1, static_cast<size_t>(h.hashesOffset - h.namesOffset - names.size()), f) == h.hashesOffset - h.namesOffset - names.size();
+
+		for (int t = 0; ok && t < numTracks; t++)
+		{
+			unsigned int count;
+			const unsigned int *hashes = trackHashes(t, count);
+			ok = count == 0 || fwrite(hashes, sizeof(unsigned int), count, f) == count;
+		}
+
+		ok = ok && (entries.empty() || fwrite(&entries[0], sizeof(Entry), entries.size(), f) == entries.size());
+		fclose(f);
+
+		if (!ok)
+			return false;
+
+		// The old file must be unmapped before it can be replaced
+		close();
+
+		if (!MoveFileEx(temp.c_str(), path, MOVEFILE_REPLACE_EXISTING) || !Open(path))
+			return false;
+
+		pendingNames.clear();
+		pendingPrints.clear();
+		pendingEntries.clear();
+		pendingSorted = true;
+		return true;
+	}
+
+	// Find matching tracks: vote for (track, time offset) pairs sharing exact hashes, then verify the best candidates by bit error rate
+	std::vector<FingerprintMatch> FingerprintIndex::Query(const Fingerprint &fingerprint, float minSimilarity, int maxResults) const
+	{
+		std::vector<FingerprintMatch> results;
+
+		if (fingerprint.empty() || maxResults <= 0)
+			return results;
+
+		if (!pendingSorted)
+		{
+			std::sort(pendingEntries.begin(), pendingEntries.end());
+			pendingSorted = true;
+		}
+
+		const Entry *mapped = header? reinterpret_cast<const Entry *>(view + header->entriesOffset) : NULL;
+		const Entry *mappedEnd = header? mapped + header->numEntries : NULL;
+		const Entry *pending = pendingEntries.empty()? NULL : &pendingEntries[0];
+		const Entry *pendingEnd = pending? pending + pendingEntries.size() : NULL;
+
+		// Votes keyed by track and alignment (track frame - query frame)
+		std::unordered_map<unsigned long long, int> votes;
+
+		for (size_t q = 0; q < fingerprint.size(); q++)
+		{
+			Entry key = { fingerprint[q], 0, 0 };
+			const Entry *ranges[2][2] = { { mapped, mappedEnd }, { pending, pendingEnd } };
+
+			for (int r = 0; r < 2; r++)
+			{
+				if (!ranges[r][0])
+					continue;
+
+				std::pair<const Entry *, const Entry *> found = std::equal_range(ranges[r][0], ranges[r][1], key);
+
+				// Very common hashes (e.g. silence) carry no information
+				if (static_cast<unsigned int>(found.second - found.first) > MaxPostings)
+					continue;
+
+				for (const Entry *e = found.first; e != found.second; e++)
+				{
+					unsigned int alignment = e->frame - static_cast<unsigned int>(q);
+					votes[(static_cast<unsigned long long>(e->track) << 32) | alignment]++;
+				}
+			}
+		}
+
+		// Most voted alignments first
+		std::vector<std::pair<int, unsigned long long>> candidates;
+		candidates.reserve(votes.size());
+
+		for (auto &v : votes)
+			candidates.push_back(std::make_pair(v.second, v.first));
+
+		size_t numCandidates = min(candidates.size(), static_cast<size_t>(maxResults) * 4);
+		std::partial_sort(candidates.begin(), candidates.begin() + numCandidates, candidates.end(), std::greater<std::pair<int, unsigned long long>>());
+
+		// Verify candidates by comparing the whole overlapping region
+		for (size_t i = 0; i < numCandidates; i++)
+		{
+			int track = static_cast<int>(candidates[i].second >> 32);
+			int alignment = static_cast<int>(static_cast<unsigned int>(candidates[i].second));
+
+			// Postings naming a track the index doesn't have
+			if (track < 0 || track >= GetTrackCount())
+				continue;
+
+			unsigned int count;
+			const unsigned int *hashes = trackHashes(track, count);
+
+			int start = max(0, -alignment);
+			int end = min(static_cast<int>(fingerprint.size()), static_cast<int>(count) - alignment);
+
+			if (end <= start)
+				continue;
+
+			unsigned int errors = 0;
+
+			for (int q = start; q < end; q++)
+			{
+				unsigned int x = fingerprint[q] ^ hashes[q + alignment];
+
+				// Population count
+				x = x - ((x >> 1) & 0x55555555);
+				x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+				errors += (((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+			}
+
+			float similarity = 1.0f - static_cast<float>(errors) / (32.0f * (end - start));
+
+			if (similarity < minSimilarity)
+				continue;
+
+			// Keep the best alignment per track
+			bool seen = false;
+
+			for (auto &m : results)
+				if (m.track == track)
+				{
+					seen = true;
+
+					if (similarity > m.similarity)
+					{
+						m.similarity = similarity;
+						m.offset = static_cast<double>(alignment) * FrameHop / SampleRate;
+					}
+				}
+
+			if (!seen)
+			{
+				FingerprintMatch m = { track, similarity, static_cast<double>(alignment) * FrameHop / SampleRate };
+				results.push_back(m);
+			}
+		}
+
+		std::sort(results.begin(), results.end(), [] (const FingerprintMatch &a, const FingerprintMatch &b) { return a.similarity > b.similarity; });
+
+		if (static_cast<int>(results.size()) > maxResults)
+			results.resize(maxResults);
+
+		return results;
+	}
+
+	// Compute a fingerprint: decode to mono at 5512Hz, take 0.37s Hann-windowed frames every 11.6ms,
+	// measure the energy of 33 log-spaced bands from 300Hz to 2kHz and encode the signs of the
+	// energy differences between neighbouring bands and consecutive frames as 32 bits
+	bool FingerprintIndex::Extract(SimpleFMOD *fmod, const char *filename, Fingerprint &fingerprint, float maxSeconds)
+	{
+		static const int FrameSize = 2048;
+		static const int Bands = 33;
+
+		fingerprint.clear();
+
+		FMOD::Sound *s;
+		if (fmod->FMOD()->createSound(filename, FMOD_OPENONLY | FMOD_ACCURATETIME, 0, &s) != FMOD_OK)
+			return false;
+
+		ResourceType sound(s);
+
+		FMOD_SOUND_FORMAT format;
+		int channels, bits;
+		float frequency;
+
+		sound->getFormat(0, &format, &channels, &bits);
+		sound->getDefaults(&frequency, 0, 0, 0);
+
+		if (format < FMOD_SOUND_FORMAT_PCM8 || format > FMOD_SOUND_FORMAT_PCMFLOAT || channels < 1 || bits < 8 || frequency < SampleRate)
+			return false;
+
+		int sampleBytes = bits / 8;
+		int frameBytes = sampleBytes * channels;
+
+		// Decode, downmix and decimate by averaging (a box filter is enough below 2kHz)
+		std::vector<char> buffer(frameBytes * 16384);
+		std::vector<float> signal;
+
+		double step = frequency / SampleRate;
+		double phase = 0.0;
+		float sum = 0.0f;
+		int summed = 0;
+		size_t limit = maxSeconds > 0.0f? static_cast<size_t>(maxSeconds * SampleRate) : 0;
+
+		for (;;)
+		{
+			unsigned int read = 0;
+			FMOD_RESULT result = sound->readData(&buffer[0], static_cast<unsigned int>(buffer.size()), &read);
+
+			unsigned int frames = read / frameBytes;
+
+			for (unsigned int i = 0; i < frames; i++)
+			{
+				for (int c = 0; c < channels; c++)
+					sum += sampleToFloat(&buffer[i * frameBytes + c * sampleBytes], format);
+
+				summed += channels;
+
+				if (++phase >= step)
+				{
+					phase -= step;
+					signal.push_back(sum / summed);
+					sum = 0.0f;
+					summed = 0;
+				}
+			}
+
+			if (result != FMOD_OK || read < buffer.size() || (limit && signal.size() >= limit))
+				break;
+		}
+
+		if (limit && signal.size() > limit)
+			signal.resize(limit);
+
+		if (signal.size() < FrameSize)
+			return false;
+
+		// FFT bin range of each band
+		int edges[Bands + 1];
+
+		for (int b = 0; b <= Bands; b++)
+			edges[b] = static_cast<int>(300.0 * pow(2000.0 / 300.0, static_cast<double>(b) / Bands) * FrameSize / SampleRate);
+
+		FFT fft(FrameSize);
+		std::vector<float> window(FrameSize);
+		std::vector<std::complex<float>> spectrum(FrameSize);
+		float energy[Bands], previous[Bands];
+
+		for (int i = 0; i < FrameSize; i++)
+			window[i] = static_cast<float>(0.5 - 0.5 * cos(2 * M_PI * i / (FrameSize - 1)));
+
+		fingerprint.reserve((signal.size() - FrameSize) / FrameHop + 1);
+
+		for (size_t start = 0; start + FrameSize <= signal.size(); start += FrameHop)
+		{
+			for (int i = 0; i < FrameSize; i++)
+				spectrum[i] = std::complex<float>(signal[start + i] * window[i], 0.0f);
+
+			fft.Transform(&spectrum[0]);
+
+			for (int b = 0; b < Bands; b++)
+			{
+				energy[b] = 0.0f;
+
+				for (int k = edges[b]; k < max(edges[b + 1], edges[b] + 1); k++)
+					energy[b] += std::norm(spectrum[k]);
+			}
+
+			if (start > 0)
+			{
+				unsigned int hash = 0;
+
+				for (int b = 0; b < Bands - 1; b++)
+					if ((energy[b] - energy[b + 1]) - (previous[b] - previous[b + 1]) > 0.0f)
+						hash |= 1u << b;
+
+				fingerprint.push_back(hash);
+			}
+
+			memcpy(previous, energy, sizeof(energy));
+		}
+
+		return true;
+	}
+
+	// Set up an empty playlist
+	Playlist::Playlist(SimpleFMOD *fmod, FMOD::ChannelGroup *cg, int preload, FMOD_MODE m)
+		: SimpleFMODResource(fmod, false), channelGroup(cg? cg : fmod->GetMusicChannelGroup()), mode(m), preloadMs(preload), loop(false), paused(false)
+	{
+		WatchStarving();
+		fmod->MarkUnrecorded("Playlist");
+
+		Slot empty = { -1, NULL, NULL, false, 0, 0 };
+		current = next = empty;
+
+		// Two mixer blocks is always far enough ahead for the mixer not to have passed the start clock
+		unsigned int blockLength;
+		int numBlocks;
+		engine->FMOD()->getDSPBufferSize(&blockLength, &numBlocks);
+		startLatency = blockLength * 2;
+	}
+
+	Playlist::~Playlist()
+	{
+		Stop();
+	}
+
+	void Playlist::Add(const char *filename)
+	{
+		tracks.push_back(filename);
+
+		// The playing track may no longer be the last
+		Activate();
+	}
+
+	// Track after the given one (-1 at the end of a non-looping playlist)
+	int Playlist::following(int track) const
+	{
+		if (track + 1 < static_cast<int>(tracks.size()))
+			return track + 1;
+
+		return (loop && !tracks.empty())? 0 : -1;
+	}
+
+	// Begin opening a track in the background
+	void Playlist::open(Slot &slot, int track)
+	{
+		Slot empty = { track, NULL, NULL, false, 0, 0 };
+		slot = empty;
+
+		engine->FMOD()->setStreamBufferSize(65536, FMOD_TIMEUNIT_RAWBYTES);
+
+		if (engine->FMOD()->createStream(tracks[track].c_str(), mode | FMOD_NONBLOCKING | FMOD_LOOP_OFF, 0, &slot.sound) != FMOD_OK)
+			slot.sound = NULL;
+	}
+
+	// Schedule an opened track to start at a DSP clock. Returns false if it is still opening, or if it failed to open or
+	// to play (the slot's sound is then handed over to be released, so Update() skips the track as if the open had failed)
+	bool Playlist::schedule(Slot &slot, unsigned long long clock)
+	{
+		FMOD_OPENSTATE state;
+		slot.sound->getOpenState(&state, 0, 0, 0);
+
+		if (state == FMOD_OPENSTATE_ERROR)
+		{
+			finished.push_back(slot.sound);
+			slot.sound = NULL;
+			return false;
+		}
+
+		if (state != FMOD_OPENSTATE_READY)
+			return false;
+
+		if (!MemoryCheck(engine->FMOD()->playSound(FMOD_CHANNEL_FREE, slot.sound, true, &slot.channel)))
+		{
+			finished.push_back(slot.sound);
+			slot.sound = NULL;
+			slot.channel = NULL;
+			return false;
+		}
+
+		if (channelGroup)
+			slot.channel->setChannelGroup(channelGroup);
+
+		// End clock from the length of the stream converted to output samples
+		unsigned int length;
+		float frequency;
+		slot.sound->getLength(&length, FMOD_TIMEUNIT_PCM);
+		slot.channel->getFrequency(&frequency);
+
+		slot.startClock = clock;
+		slot.endClock = clock + static_cast<unsigned long long>(static_cast<double>(length) * engine->GetSampleRate() / frequency + 0.5);
+
+		slot.channel->setDelay(FMOD_DELAYTYPE_DSPCLOCK_START, static_cast<unsigned int>(slot.startClock >> 32), static_cast<unsigned int>(slot.startClock));
+		slot.channel->setPaused(false);
+
+		slot.scheduled = true;
+		return true;
+	}
+
+	// Stop a track's channel and hand its stream over to be released later
+	void Playlist::release(Slot &slot)
+	{
+		if (slot.channel)
+			slot.channel->stop();
+
+		if (slot.sound)
+			finished.push_back(slot.sound);
+
+		Slot empty = { -1, NULL, NULL, false, 0, 0 };
+		slot = empty;
+	}
+
+	// Start playing from a track
+	void Playlist::Play(int track)
+	{
+		Stop();
+
+		if (track < 0 || track >= static_cast<int>(tracks.size()))
+			return;
+
+		open(current, track);
+		paused = false;
+
+		Activate();
+	}
+
+	// Stop playback and release all streams
+	void Playlist::Stop()
+	{
+		release(current);
+		release(next);
+
+		for (auto s : finished)
+			s->release();
+
+		finished.clear();
+	}
+
+	// Pause or resume the playlist
+	void Playlist::SetPaused(bool pause)
+	{
+		Activate();
+
+		if (pause == paused || !current.channel)
+		{
+			paused = pause;
+			return;
+		}
+
+		paused = pause;
+
+		if (pause)
+		{
+			current.channel->setPaused(true);
+
+			// The next track can't be scheduled until we know when playback resumes
+			if (next.channel)
+			{
+				next.channel->stop();
+				next.channel = NULL;
+				next.scheduled = false;
+			}
+		}
+		else
+		{
+			// Resume and recalculate the end clock from the position reached, within the same mixer block
+			unsigned int position, length;
+			float frequency;
+
+			engine->FMOD()->lockDSP();
+			current.channel->setPaused(false);
+			current.channel->getPosition(&position, FMOD_TIMEUNIT_PCM);
+			unsigned long long now = engine->GetDSPClock();
+			engine->FMOD()->unlockDSP();
+
+			current.sound->getLength(&length, FMOD_TIMEUNIT_PCM);
+			current.channel->getFrequency(&frequency);
+
+			current.endClock = now + static_cast<unsigned long long>(static_cast<double>(length - min(position, length)) * engine->GetSampleRate() / frequency + 0.5);
+		}
+	}
+
+	// Whether the playing track's stream has run dry
+	bool Playlist::IsStarving()
+	{
+		bool starving = false;
+
+		if (current.sound)
+			current.sound->getOpenState(0, 0, &starving, 0);
+
+		return starving;
+	}
+
+	// Open, schedule and retire tracks
+	void Playlist::Update()
+	{
+		// Release one finished stream per update (releasing a stream waits for its stream thread)
+		if (!finished.empty())
+		{
+			finished.back()->release();
+			finished.pop_back();
+		}
+
+		// Nothing to do until Play() or SetPaused(false), once the finished streams are released
+		if (current.track == -1 || paused)
+		{
+			if (finished.empty())
+				Deactivate();
+
+			return;
+		}
+
+		// The first track failed to open (or turned out to be unreadable): move on to the one after it
+		if (!current.sound)
+		{
+			int track = following(current.track);
+			release(current);
+
+			if (track != -1)
+				open(current, track);
+
+			return;
+		}
+
+		unsigned long long now = engine->GetDSPClock();
+
+		// First track: start it as soon as it is open
+		if (!current.scheduled)
+		{
+			schedule(current, now + startLatency);
+			return;
+		}
+
+		// Current track has finished: the scheduled next track takes over
+		if (now >= current.endClock)
+		{
+			release(current);
+			current = next;
+
+			Slot empty = { -1, NULL, NULL, false, 0, 0 };
+			next = empty;
+
+			// The next track wasn't ready in time; it starts (with a gap) as soon as it is
+			if (current.sound && !current.scheduled)
+				schedule(current, now + startLatency);
+
+			return;
+		}
+
+		// Open the next track ahead of time
+		unsigned long long preload = static_cast<unsigned long long>(preloadMs) * engine->GetSampleRate() / 1000;
+
+		if (next.track == -1 && current.endClock - now <= preload)
+		{
+			int track = following(current.track);
+
+			if (track != -1)
+				open(next, track);
+		}
+
+		// Stitch the next track onto the exact end sample of the current one
+		if (next.sound && !next.scheduled)
+			schedule(next, current.endClock);
+
+		// Skip tracks which could not be opened
+		else if (next.track != -1 && !next.sound)
+		{
+			int track = following(next.track);
+			next.track = -1;
+
+			if (track != -1)
+				open(next, track);
+		}
+
+		// Sleep until the current track ends, or until the next one is due to be opened
+		if (finished.empty() && (next.scheduled || next.track == -1))
+		{
+			if (next.track == -1 && following(current.track) != -1)
+				WakeAtClock(current.endClock - preload);
+			else
+				WakeAtClock(current.endClock);
+		}
+	}
+
+	// Built-in fade curves
+	float Crossfader::Linear(float progress)
+	{
+		return progress;
+	}
+
+	float Crossfader::EqualPower(float progress)
+	{
+		return static_cast<float>(sin(progress * M_PI / 2));
+	}
+
+	float Crossfader::SineSquared(float progress)
+	{
+		float v = static_cast<float>(sin(progress * M_PI / 2));
+		return v * v;
+	}
+
+	// Set up the two decks and their ramp DSPs
+	Crossfader::Crossfader(SimpleFMOD *fmod, FMOD::ChannelGroup *cg) : SimpleFMODResource(fmod, false), active(0), opening(false), fading(false), fadeEnd(0), fadeMs(0), fadeCurve(EqualPower),
+		retiring(false), retireEnd(0), pendingMode(FMOD_DEFAULT), channelGroup(cg)
+	{
+		WatchStarving();
+
+		for (int d = 0; d < 2; d++)
+		{
+			Deck &deck = decks[d];
+			Ramp ramp = { 0, 0, 1, true, EqualPower };
+
+			deck.sound = NULL;
+			deck.channel = NULL;
+			deck.ramp = ramp;
+
+			FMOD_DSP_DESCRIPTION desc;
+			memset(&desc, 0, sizeof(FMOD_DSP_DESCRIPTION));
+
+			strcpy(desc.name, "SimpleFMOD crossfade");
+			desc.read = read;
+			desc.userdata = &deck.ramp;
+
+			ErrorCheck(engine->FMOD()->createDSP(&desc, &deck.dsp));
+		}
+
+		unsigned int blockLength;
+		int numBlocks;
+		engine->FMOD()->getDSPBufferSize(&blockLength, &numBlocks);
+		startLatency = blockLength * 2;
+	}
+
+	Crossfader::~Crossfader()
+	{
+		Stop();
+
+		decks[0].dsp->release();
+		decks[1].dsp->release();
+	}
+
+	// Stop a deck and close its stream
+	void Crossfader::stopDeck(Deck &deck)
+	{
+		if (deck.channel)
+		{
+			deck.dsp->remove();
+			deck.channel->stop();
+		}
+
+		if (deck.sound)
+			deck.sound->release();
+
+		deck.channel = NULL;
+		deck.sound = NULL;
+	}
+
+	void Crossfader::Stop()
+	{
+		stopDeck(decks[0]);
+		stopDeck(decks[1]);
+
+		opening = false;
+		fading = false;
+		retiring = false;
+	}
+
+	// Begin opening the incoming stream. At most two streams exist at once: a previous target which hasn't started
+	// yet is closed first, and a fade in progress is handed over without a jump in level (see Update())
+	void Crossfader::CrossfadeTo(const char *filename, int ms, FadeCurveFunction curve, FMOD_MODE mode)
+	{
+		fadeMs = ms;
+		fadeCurve = curve;
+
+		// Still ramping out a deck from an interrupted fade: only change what opens after it
+		if (retiring)
+		{
+			pendingFile = filename;
+			pendingMode = mode;
+			return;
+		}
+
+		if (opening)
+		{
+			stopDeck(decks[active]);
+			active = 1 - active;
+			opening = false;
+		}
+
+		// A fade is in progress: the incoming deck carries on and becomes the outgoing one, but the old outgoing
+		// deck must make way for the new stream. Ramp it out quickly from its current gain, then open the new stream
+		else if (fading)
+		{
+			Ramp &ramp = decks[1 - active].ramp;
+			unsigned long long quick = max(static_cast<unsigned long long>(RetireMs) * engine->GetSampleRate() / 1000, 1ULL);
+
+			engine->FMOD()->lockDSP();
+
+			if (ramp.clock < ramp.start)
+				ramp.start = ramp.clock;
+
+			unsigned long long done = min(ramp.clock - ramp.start, ramp.length);
+
+			if (ramp.length - done > quick)
+			{
+				unsigned long long position = static_cast<unsigned long long>(static_cast<double>(done) / ramp.length * quick);
+				ramp.start = ramp.clock - position;
+				ramp.length = quick;
+			}
+
+			retireEnd = ramp.start + ramp.length;
+
+			engine->FMOD()->unlockDSP();
+
+			fading = false;
+			retiring = true;
+			pendingFile = filename;
+			pendingMode = mode;
+
+			Activate();
+			return;
+		}
+
+		open(filename, mode);
+	}
+
+	// Open a stream on the other deck, which must be empty
+	void Crossfader::open(const char *filename, FMOD_MODE mode)
+	{
+		active = 1 - active;
+		opening = true;
+
+		Activate();
+
+		engine->FMOD()->setStreamBufferSize(65536, FMOD_TIMEUNIT_RAWBYTES);
+
+		// If the file can't be opened, the current music carries on on the other deck
+		if (engine->FMOD()->createStream(filename, mode | FMOD_NONBLOCKING | FMOD_LOOP_NORMAL, 0, &decks[active].sound) != FMOD_OK)
+		{
+			decks[active].sound = NULL;
+			opening = false;
+			active = 1 - active;
+		}
+	}
+
+	// Whether either deck's stream has run dry
+	bool Crossfader::IsStarving()
+	{
+		for (auto &deck : decks)
+		{
+			bool starving = false;
+
+			if (deck.sound && deck.sound->getOpenState(0, 0, &starving, 0) == FMOD_OK && starving)
+				return true;
+		}
+
+		return false;
+	}
+
+	// Start the incoming stream once it is open, and close the outgoing one once the fade is over
+	void Crossfader::Update()
+	{
+		// Open the stream requested during a fade once the deck it abandoned is silent
+		if (retiring)
+		{
+			if (engine->GetDSPClock() < retireEnd)
+			{
+				WakeAtClock(retireEnd);
+				return;
+			}
+
+			stopDeck(decks[1 - active]);
+			retiring = false;
+			open(pendingFile.c_str(), pendingMode);
+		}
+
+		if (opening)
+		{
+			Deck &in = decks[active];
+			Deck &out = decks[1 - active];
+
+			FMOD_OPENSTATE state;
+			in.sound->getOpenState(&state, 0, 0, 0);
+
+			// The stream couldn't be opened, or there's no memory to play it: the outgoing music carries on
+			if (state == FMOD_OPENSTATE_ERROR
+				|| (state == FMOD_OPENSTATE_READY && !MemoryCheck(engine->FMOD()->playSound(FMOD_CHANNEL_FREE, in.sound, true, &in.channel))))
+			{
+				in.channel = NULL;
+				stopDeck(in);
+				active = 1 - active;
+				opening = false;
+			}
+
+			else if (state == FMOD_OPENSTATE_READY)
+			{
+
+				if (channelGroup)
+					in.channel->setChannelGroup(channelGroup);
+
+				// Songs repeat forever
+				in.channel->setLoopCount(-1);
+				in.channel->addDSP(in.dsp, 0);
+
+				// Set both ramps and the start clock in the same mixer block
+				engine->FMOD()->lockDSP();
+
+				unsigned long long now = engine->GetDSPClock();
+				unsigned long long start = now + startLatency;
+				unsigned long long length = max(static_cast<unsigned long long>(fadeMs) * engine->GetSampleRate() / 1000, 1ULL);
+
+				Ramp ramp = { now, start, length, true, fadeCurve };
+				in.ramp = ramp;
+
+				if (out.channel)
+				{
+					ramp.fadeIn = false;
+
+					// The outgoing deck may still be fading in from an interrupted crossfade: fade it out from its
+					// current gain along its own curve, starting now
+					if (out.ramp.fadeIn && out.ramp.clock < out.ramp.start + out.ramp.length)
+					{
+						double progress = out.ramp.clock > out.ramp.start? static_cast<double>(out.ramp.clock - out.ramp.start) / out.ramp.length : 0.0;
+						unsigned long long elapsed = static_cast<unsigned long long>((1.0 - progress) * length);
+
+						ramp.clock = out.ramp.clock;
+						ramp.start = out.ramp.clock > elapsed? out.ramp.clock - elapsed : 0;
+						ramp.curve = out.ramp.curve;
+					}
+
+					out.ramp = ramp;
+				}
+
+				in.channel->setDelay(FMOD_DELAYTYPE_DSPCLOCK_START, static_cast<unsigned int>(start >> 32), static_cast<unsigned int>(start));
+				in.channel->setPaused(false);
+
+				engine->FMOD()->unlockDSP();
+
+				opening = false;
+				fading = out.channel != NULL;
+				fadeEnd = start + length;
+			}
+		}
+
+		else if (fading && engine->GetDSPClock() >= fadeEnd)
+		{
+			stopDeck(decks[1 - active]);
+			fading = false;
+		}
+
+		// Once the stream is open, there is nothing to do until the fade ends
+		if (opening)
+			return;
+
+		if (fading)
+			WakeAtClock(fadeEnd);
+		else
+			Deactivate();
+	}
+
+	// Apply a deck's gain ramp to one block on the mixer thread
+	FMOD_RESULT F_CALLBACK Crossfader::read(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer, unsigned int length, int inchannels, int outchannels)
+	{
+		Ramp *ramp;
+		reinterpret_cast<FMOD::DSP *>(dsp_state->instance)->getUserData(reinterpret_cast<void **>(&ramp));
+
+		unsigned long long clock = ramp->clock;
+		ramp->clock += length;
+
+		// Whole block before or after the fade: constant gain
+		if (clock + length <= ramp->start || clock >= ramp->start + ramp->length)
+		{
+			float progress = (clock >= ramp->start + ramp->length)? 1.0f : 0.0f;
+			float gain = ramp->curve(ramp->fadeIn? progress : 1.0f - progress);
+
+			for (unsigned int i = 0; i < length * outchannels; i++)
+				outbuffer[i] = inbuffer[i] * gain;
+
+			return FMOD_OK;
+		}
+
+		for (unsigned int i = 0; i < length; i++)
+		{
+			unsigned long long position = clock + i;
+			float progress;
+
+			if (position < ramp->start)
+				progress = 0.0f;
+			else if (position >= ramp->start + ramp->length)
+				progress = 1.0f;
+			else
+				progress = static_cast<float>(position - ramp->start) / ramp->length;
+
+			float gain = ramp->curve(ramp->fadeIn? progress : 1.0f - progress);
+
+			for (int c = 0; c < outchannels; c++)
+				outbuffer[i * outchannels + c] = inbuffer[i * inchannels + c] * gain;
+		}
+
+		return FMOD_OK;
+	}
+
+	// Set up ducking from one bus to another
+	Ducker::Ducker(SimpleFMOD *fmod, Bus source, Bus target, float threshold, float r, float attack, float release, float lookaheadMs)
+		: delayer(NULL), sampleRate(static_cast<float>(fmod->GetSampleRate())), envelopeDb(-100.0f), gain(1.0f), delayPosition(0)
+	{
+		thresholdDb = threshold;
+		ratio = max(r, 1.0f);
+		attackMs = max(attack, 0.1f);
+		releaseMs = max(release, 0.1f);
+		targetGain = 1.0f;
+		fmod->MarkUnrecorded("Ducker");
+
+		// Lookahead delay line, allocated up front so the mixer thread never allocates
+		lookahead = max(static_cast<int>(lookaheadMs * sampleRate / 1000), 0);
+
+		if (lookahead)
+			delayLine.assign(lookahead * MaxChannels, 0.0f);
+
+		FMOD_DSP_DESCRIPTION desc;
+		memset(&desc, 0, sizeof(FMOD_DSP_DESCRIPTION));
+		desc.userdata = this;
+
+		strcpy(desc.name, "SimpleFMOD duck detector");
+		desc.read = detect;
+		ErrorCheck(fmod->FMOD()->createDSP(&desc, &detector));
+
+		strcpy(desc.name, "SimpleFMOD duck gain");
+		desc.read = apply;
+		ErrorCheck(fmod->FMOD()->createDSP(&desc, &gainer));
+
+		if (lookahead)
+		{
+			strcpy(desc.name, "SimpleFMOD duck lookahead");
+			desc.read = delay;
+			ErrorCheck(fmod->FMOD()->createDSP(&desc, &delayer));
+		}
+
+		// An unknown bus leaves the ducker doing nothing
+		FMOD::ChannelGroup *sourceGroup = fmod->GetBusChannelGroup(source);
+		FMOD::ChannelGroup *targetGroup = fmod->GetBusChannelGroup(target);
+
+		if (sourceGroup && targetGroup)
+		{
+			ErrorCheck(sourceGroup->addDSP(detector, 0));
+			ErrorCheck(targetGroup->addDSP(gainer, 0));
+
+			// Added last, so it runs after the detector has seen the undelayed signal
+			if (delayer)
+				ErrorCheck(sourceGroup->addDSP(delayer, 0));
+		}
+	}
+
+	Ducker::~Ducker()
+	{
+		detector->remove();
+		gainer->remove();
+		detector->release();
+		gainer->release();
+
+		if (delayer)
+		{
+			delayer->remove();
+			delayer->release();
+		}
+	}
+
+	float Ducker::GetGainReduction() const
+	{
+		return 20.0f * log10(max(targetGain.load(), 0.00001f));
+	}
+
+	// Sum of squares of a buffer, four values at a time
+	static float sumOfSquares(const float *values, unsigned int count)
+	{
+		unsigned int i = 0;
+		float sum = 0.0f;
+
+#ifdef SFMOD_SSE2
+		__m128 acc = _mm_setzero_ps();
+
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 v = _mm_loadu_ps(values + i);
+			acc = _mm_add_ps(acc, _mm_mul_ps(v, v));
+		}
+
+		float parts[4];
+		_mm_storeu_ps(parts, acc);
+		sum = parts[0] + parts[1] + parts[2] + parts[3];
+#endif
+
+		for (; i < count; i++)
+			sum += values[i] * values[i];
+
+		return sum;
+	}
+
+	// Multiply a buffer of frames by a gain ramping linearly from 'from' to 'to', four values at a time
+	static void applyGainRamp(float *values, unsigned int frames, int channels, float from, float to)
+	{
+		unsigned int count = frames * channels;
+		float step = (to - from) / max(frames, 1u);
+		unsigned int i = 0;
+
+#ifdef SFMOD_SSE2
+		// Interleaved frames share a gain: vectorize flat gains for any layout and ramps for stereo (two frames per vector)
+		if (from == to)
+		{
+			__m128 g = _mm_set1_ps(to);
+
+			for (; i + 4 <= count; i += 4)
+				_mm_storeu_ps(values + i, _mm_mul_ps(_mm_loadu_ps(values + i), g));
+		}
+
+		else if (channels == 2)
+		{
+			__m128 g = _mm_setr_ps(from, from, from + step, from + step);
+			__m128 increment = _mm_set1_ps(step * 2);
+
+			for (; i + 4 <= count; i += 4)
+			{
+				_mm_storeu_ps(values + i, _mm_mul_ps(_mm_loadu_ps(values + i), g));
+				g = _mm_add_ps(g, increment);
+			}
+		}
+#endif
+
+		for (; i < count; i++)
+			values[i] *= from + step * (i / channels);
+	}
+
+	// Source bus: follow the level of each block and publish the resulting target gain. Audio passes through
+	FMOD_RESULT F_CALLBACK Ducker::detect(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer, unsigned int length, int inchannels, int outchannels)
+	{
+		Ducker *me;
+		reinterpret_cast<FMOD::DSP *>(dsp_state->instance)->getUserData(reinterpret_cast<void **>(&me));
+
+		memcpy(outbuffer, inbuffer, length * outchannels * sizeof(float));
+
+		if (!length || !inchannels)
+			return FMOD_OK;
+
+		// Block level in dB
+		float meanSquare = sumOfSquares(inbuffer, length * inchannels) / (length * inchannels);
+		float levelDb = 10.0f * log10(max(meanSquare, 1e-10f));
+
+		// Envelope with separate attack and release, with time constants converted to per-block coefficients
+		float timeMs = (levelDb > me->envelopeDb)? me->attackMs.load() : me->releaseMs.load();
+		float coefficient = exp(-static_cast<float>(length) / (timeMs * me->sampleRate / 1000));
+		me->envelopeDb = levelDb + coefficient * (me->envelopeDb - levelDb);
+
+		// Gain reduction above the threshold according to the ratio
+		float overDb = max(me->envelopeDb - me->thresholdDb.load(), 0.0f);
+		float reductionDb = overDb * (1.0f - 1.0f / me->ratio.load());
+
+		me->targetGain.store(pow(10.0f, -reductionDb / 20.0f));
+
+		return FMOD_OK;
+	}
+
+	// Source bus, after the detector: delay by the lookahead time
+	FMOD_RESULT F_CALLBACK Ducker::delay(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer, unsigned int length, int inchannels, int outchannels)
+	{
+		Ducker *me;
+		reinterpret_cast<FMOD::DSP *>(dsp_state->instance)->getUserData(reinterpret_cast<void **>(&me));
+
+		int channels = outchannels;
+		unsigned int frames = static_cast<unsigned int>(me->lookahead);
+
+		if (channels > MaxChannels)
+		{
+			memcpy(outbuffer, inbuffer, length * channels * sizeof(float));
+			return FMOD_OK;
+		}
+
+		// Delay line: output the oldest frames followed by the start of this block, and keep the end of this block
+		float *ring = &me->delayLine[0];
+		unsigned int position = static_cast<unsigned int>(me->delayPosition);
+
+		for (unsigned int done = 0; done < length; )
+		{
+			// Largest run that neither wraps the ring nor overruns the block
+			unsigned int run = min(length - done, frames - position);
+
+			memcpy(outbuffer + done * channels, ring + position * channels, run * channels * sizeof(float));
+			memcpy(ring + position * channels, inbuffer + done * channels, run * channels * sizeof(float));
+
+			done += run;
+			position = (position + run) % frames;
+		}
+
+		me->delayPosition = static_cast<int>(position);
+
+		return FMOD_OK;
+	}
+
+	// Target bus: ramp towards the published gain across the block
+	FMOD_RESULT F_CALLBACK Ducker::apply(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer, unsigned int length, int inchannels, int outchannels)
+	{
+		Ducker *me;
+		reinterpret_cast<FMOD::DSP *>(dsp_state->instance)->getUserData(reinterpret_cast<void **>(&me));
+
+		memcpy(outbuffer, inbuffer, length * outchannels * sizeof(float));
+
+		float target = me->targetGain.load();
+		applyGainRamp(outbuffer, length, outchannels, me->gain, target);
+		me->gain = target;
+
+		return FMOD_OK;
+	}
+
+	// Set up an empty emitter system
+	EmitterSystem::EmitterSystem(SimpleFMOD *fmod, int voices, float size, Bus bus)
+		: SimpleFMODResource(fmod, false), cellSize(size), audibleRange(0.0f), maxVoices(voices)
+	{
+		fmod->MarkUnrecorded("EmitterSystem");
+
+		channelGroup = bus.IsValid()? fmod->GetBusChannelGroup(bus) : fmod->GetEffectsChannelGroup();
+
+		FMOD_VECTOR zero = { 0.0f, 0.0f, 0.0f }, forward = { 0.0f, 0.0f, 1.0f }, up = { 0.0f, 1.0f, 0.0f };
+		listenerPosition = listenerVelocity = zero;
+		listenerForward = forward;
+		listenerUp = up;
+	}
+
+	EmitterSystem::~EmitterSystem()
+	{
+		for (auto e : playing)
+			channels[e]->stop();
+	}
+
+	// Grid cell containing a point, packed as 21 bits per axis
+	unsigned long long EmitterSystem::cellKey(const FMOD_VECTOR &p) const
+	{
+		unsigned long long x = static_cast<unsigned long long>(static_cast<long long>(floor(p.x / cellSize)) + (1 << 20)) & 0x1FFFFF;
+		unsigned long long y = static_cast<unsigned long long>(static_cast<long long>(floor(p.y / cellSize)) + (1 << 20)) & 0x1FFFFF;
+		unsigned long long z = static_cast<unsigned long long>(static_cast<long long>(floor(p.z / cellSize)) + (1 << 20)) & 0x1FFFFF;
+
+		return (x << 42) | (y << 21) | z;
+	}
+
+	void EmitterSystem::insertIntoGrid(int e)
+	{
+		std::vector<int> &cell = grid[cellKeys[e] = cellKey(positions[e])];
+		cellSlots[e] = static_cast<int>(cell.size());
+		cell.push_back(e);
+	}
+
+	void EmitterSystem::removeFromGrid(int e)
+	{
+		std::vector<int> &cell = grid[cellKeys[e]];
+
+		// Swap-remove, fixing up the slot of the emitter moved into the hole
+		cell[cellSlots[e]] = cell.back();
+		cellSlots[cell.back()] = cellSlots[e];
+		cell.pop_back();
+	}
+
+	// Add an emitter
+	int EmitterSystem::Add(SoundEffect &effect, const FMOD_VECTOR &position, float minDistance, float maxDistance, bool loop, AttenuationCurve curve, float volume)
+	{
+		int e;
+
+		Activate();
+
+		if (!freeHandles.empty())
+		{
+			e = freeHandles.back();
+			freeHandles.pop_back();
+		}
+		else
+		{
+			e = static_cast<int>(sounds.size());
+
+			FMOD_VECTOR zero = { 0.0f, 0.0f, 0.0f };
+			sounds.push_back(NULL);
+			channels.push_back(NULL);
+			positions.push_back(zero);
+			velocities.push_back(zero);
+			minDistances.push_back(0.0f);
+			maxDistances.push_back(0.0f);
+			volumes.push_back(0.0f);
+			curves.push_back(0);
+			looping.push_back(0);
+			alive.push_back(0);
+			cellKeys.push_back(0);
+			cellSlots.push_back(0);
+		}
+
+		FMOD_VECTOR zero = { 0.0f, 0.0f, 0.0f };
+
+		sounds[e] = effect.Get();
+		channels[e] = NULL;
+		positions[e] = position;
+		velocities[e] = zero;
+		minDistances[e] = max(minDistance, 0.001f);
+		maxDistances[e] = max(maxDistance, minDistances[e]);
+		volumes[e] = volume;
+		curves[e] = static_cast<char>(curve);
+		looping[e] = loop;
+		alive[e] = 1;
+
+		audibleRange = max(audibleRange, maxDistances[e]);
+
+		insertIntoGrid(e);
+		return e;
+	}
+
+	// Remove an emitter (its handle may be reused)
+	void EmitterSystem::Remove(int e)
+	{
+		if (!alive[e])
+			return;
+
+		if (channels[e])
+			stopVoice(e);
+
+		removeFromGrid(e);
+		alive[e] = 0;
+		freeHandles.push_back(e);
+	}
+
+	// Move an emitter, changing grid cell if needed
+	void EmitterSystem::SetPosition(int e, const FMOD_VECTOR &position, const FMOD_VECTOR *velocity)
+	{
+		positions[e] = position;
+
+		if (velocity)
+			velocities[e] = *velocity;
+
+		if (cellKey(position) != cellKeys[e])
+		{
+			removeFromGrid(e);
+			insertIntoGrid(e);
+		}
+	}
+
+	void EmitterSystem::SetListener(const FMOD_VECTOR &position, const FMOD_VECTOR &forward, const FMOD_VECTOR &up, const FMOD_VECTOR *velocity)
+	{
+		listenerPosition = position;
+		listenerForward = forward;
+		listenerUp = up;
+
+		if (velocity)
+			listenerVelocity = *velocity;
+	}
+
+	// Release an emitter's channel
+	void EmitterSystem::stopVoice(int e)
+	{
+		channels[e]->stop();
+		channels[e] = NULL;
+
+		playing.erase(std::find(playing.begin(), playing.end(), e));
+	}
+
+	// Gain of an emitter at a distance from the listener
+	float EmitterSystem::attenuate(int e, float distance) const
+	{
+		float minDistance = minDistances[e], maxDistance = maxDistances[e];
+
+		if (distance <= minDistance)
+			return volumes[e];
+
+		switch (curves[e])
+		{
+		case AttenuationLinear:
+			return volumes[e] * (1.0f - (distance - minDistance) / (maxDistance - minDistance));
+
+		case AttenuationInverseSquare:
+			return volumes[e] * (minDistance * minDistance) / (distance * distance);
+
+		default:
+			return volumes[e] * minDistance / distance;
+		}
+	}
+
+	// Cull, choose the loudest voices and push 3D attributes
+	void EmitterSystem::Update()
+	{
+		// Idle until an emitter is added
+		if (playing.empty() && freeHandles.size() == alive.size())
+		{
+			audible.clear();
+			Deactivate();
+			return;
+		}
+
+		audible.clear();
+
+		// Visit only the grid cells within audible range of the listener
+		int range = static_cast<int>(ceil(audibleRange / cellSize));
+		FMOD_VECTOR corner = listenerPosition;
+
+		for (int dx = -range; dx <= range; dx++)
+			for (int dy = -range; dy <= range; dy++)
+				for (int dz = -range; dz <= range; dz++)
+				{
+					FMOD_VECTOR p = { corner.x + dx * cellSize, corner.y + dy * cellSize, corner.z + dz * cellSize };
+					auto cell = grid.find(cellKey(p));
+
+					if (cell == grid.end())
+						continue;
+
+					for (auto e : cell->second)
+					{
+						float x = positions[e].x - listenerPosition.x;
+						float y = positions[e].y - listenerPosition.y;
+						float z = positions[e].z - listenerPosition.z;
+						float distanceSquared = x * x + y * y + z * z;
+
+						// Beyond maximum distance
+						if (distanceSquared > maxDistances[e] * maxDistances[e])
+							continue;
+
+						float gain = attenuate(e, sqrt(distanceSquared));
+
+						if (gain > 0.0f)
+							audible.push_back(std::make_pair(gain, e));
+					}
+				}
+
+		// Keep the loudest voices
+		if (static_cast<int>(audible.size()) > maxVoices)
+			std::nth_element(audible.begin(), audible.begin() + maxVoices, audible.end(), std::greater<std::pair<float, int>>());
+
+		int voices = min(static_cast<int>(audible.size()), maxVoices);
+
+		// Gain each emitter should have this update (0 = no voice)
+		gains.resize(sounds.size());
+
+		for (auto e : playing)
+			gains[e] = 0.0f;
+
+		for (int i = 0; i < voices; i++)
+			gains[audible[i].second] = audible[i].first;
+
+		// Demote voices which are no longer among the loudest, and retire finished one-shots
+		for (size_t i = 0; i < playing.size(); )
+		{
+			int e = playing[i];
+			bool isPlaying = false;
+
+			channels[e]->isPlaying(&isPlaying);
+
+			if (gains[e] == 0.0f || !isPlaying)
+			{
+				bool oneShot = !looping[e];
+				stopVoice(e);
+
+				if (oneShot)
+					Remove(e);
+			}
+			else
+				i++;
+		}
+
+		// Promote newly audible emitters (they start paused and are unpaused once their attributes are set)
+		size_t firstNew = playing.size();
+
+		for (int i = 0; i < voices; i++)
+		{
+			int e = audible[i].second;
+
+			// Already playing, or a one-shot which finished and was retired above
+			if (channels[e] || !alive[e])
+				continue;
+
+			if (engine->FMOD()->playSound(FMOD_CHANNEL_FREE, sounds[e], true, &channels[e]) != FMOD_OK)
+			{
+				channels[e] = NULL;
+				continue;
+			}
+
+			if (channelGroup)
+				channels[e]->setChannelGroup(channelGroup);
+
+			// FMOD only pans (and applies doppler); attenuation is ours, so its rolloff starts beyond our range
+			channels[e]->setMode(FMOD_3D | (looping[e]? FMOD_LOOP_NORMAL : FMOD_LOOP_OFF));
+			channels[e]->set3DMinMaxDistance(maxDistances[e], maxDistances[e] * 2);
+
+			if (looping[e])
+				channels[e]->setLoopCount(-1);
+
+			playing.push_back(e);
+		}
+
+		// Push listener and voice attributes in one pass
+		engine->FMOD()->set3DListenerAttributes(0, &listenerPosition, &listenerVelocity, &listenerForward, &listenerUp);
+
+		for (size_t i = 0; i < playing.size(); i++)
+		{
+			int e = playing[i];
+
+			channels[e]->set3DAttributes(&positions[e], &velocities[e]);
+			channels[e]->setVolume(gains[e]);
+
+			if (i >= firstNew)
+				channels[e]->setPaused(false);
+		}
+	}
+
+	// Set up a voice manager
+	VoiceManager::VoiceManager(SimpleFMOD *fmod, int real) : SimpleFMODResource(fmod, false), maxReal(real), realCount(0)
+	{
+		fmod->MarkUnrecorded("VoiceManager");
+	}
+
+	VoiceManager::~VoiceManager()
+	{
+		for (auto v : active)
+			if (channels[v])
+				channels[v]->stop();
+	}
+
+	// Start logical voices
+	Voice VoiceManager::Play(SoundEffect &effect, float volume, bool loop, float priority, Bus bus)
+	{
+		return start(effect.Get(), bus.IsValid()? engine->GetBusChannelGroup(bus) : engine->GetEffectsChannelGroup(), volume, loop, priority);
+	}
+
+	Voice VoiceManager::Play(Song &song, float volume, bool loop, float priority, Bus bus)
+	{
+		return start(song.Get(), bus.IsValid()? engine->GetBusChannelGroup(bus) : engine->GetMusicChannelGroup(), volume, loop, priority);
+	}
+
+	Voice VoiceManager::start(FMOD::Sound *sound, FMOD::ChannelGroup *group, float volume, bool loop, float priority)
+	{
+		int v;
+
+		// The sound failed to load (for example over its memory budget)
+		if (!sound)
+			return Voice();
+
+		// A stream has a single playback position, so it can only back one voice at a time
+		FMOD_MODE mode = 0;
+		sound->getMode(&mode);
+
+		if (mode & FMOD_CREATESTREAM)
+			for (auto a : active)
+				if (sounds[a] == sound)
+					return Voice();
+
+		Activate();
+
+		if (!freeVoices.empty())
+		{
+			v = freeVoices.back();
+			freeVoices.pop_back();
+		}
+		else
+		{
+			v = static_cast<int>(sounds.size());
+
+			sounds.push_back(NULL);
+			groups.push_back(NULL);
+			channels.push_back(NULL);
+			startClocks.push_back(0);
+			lengths.push_back(0);
+			frequencies.push_back(0.0f);
+			volumes.push_back(0.0f);
+			priorities.push_back(0.0f);
+			looping.push_back(0);
+			generations.push_back(0);
+			alive.push_back(0);
+		}
+
+		unsigned int length;
+		float frequency;
+		sound->getLength(&length, FMOD_TIMEUNIT_PCM);
+		sound->getDefaults(&frequency, 0, 0, 0);
+
+		// The voice is considered started now, whether or not it gets a channel
+		sounds[v] = sound;
+		groups[v] = group;
+		channels[v] = NULL;
+		startClocks[v] = engine->GetDSPClock();
+		lengths[v] = static_cast<unsigned long long>(static_cast<double>(length) * engine->GetSampleRate() / frequency);
+		frequencies[v] = frequency;
+		volumes[v] = volume;
+		priorities[v] = priority;
+		looping[v] = loop;
+		alive[v] = 1;
+
+		active.push_back(v);
+
+		// Start straight away if a channel is free, rather than at the next update with the attack cut off
+		if (realCount < maxReal && volume * priority > 0.0f)
+			promote(v, startClocks[v]);
+
+		return Voice(v, generations[v]);
+	}
+
+	void VoiceManager::Stop(Voice voice)
+	{
+		if (valid(voice))
+			retire(voice.index);
+	}
+
+	void VoiceManager::SetVolume(Voice voice, float volume)
+	{
+		if (!valid(voice))
+			return;
+
+		volumes[voice.index] = volume;
+
+		if (channels[voice.index])
+			channels[voice.index]->setVolume(volume);
+	}
+
+	void VoiceManager::SetPriority(Voice voice, float priority)
+	{
+		if (valid(voice))
+			priorities[voice.index] = priority;
+	}
+
+	// Give a voice a channel, starting at the position it would have reached
+	void VoiceManager::promote(int v, unsigned long long now)
+	{
+		unsigned long long elapsed = now - startClocks[v];
+
+		if (looping[v] && lengths[v])
+			elapsed %= lengths[v];
+
+		unsigned int offset = static_cast<unsigned int>(static_cast<double>(elapsed) * frequencies[v] / engine->GetSampleRate());
+
+		if (engine->FMOD()->playSound(FMOD_CHANNEL_FREE, sounds[v], true, &channels[v]) != FMOD_OK)
+		{
+			channels[v] = NULL;
+			return;
+		}
+
+		if (groups[v])
+			channels[v]->setChannelGroup(groups[v]);
+
+		channels[v]->setMode(looping[v]? FMOD_LOOP_NORMAL : FMOD_LOOP_OFF);
+
+		if (looping[v])
+			channels[v]->setLoopCount(-1);
+
+		channels[v]->setVolume(volumes[v]);
+
+		// Seeking a stream blocks, so only seek when the voice has already moved on
+		if (offset)
+			channels[v]->setPosition(offset, FMOD_TIMEUNIT_PCM);
+
+		channels[v]->setPaused(false);
+
+		realCount++;
+	}
+
+	// Take a voice's channel away (the voice carries on virtually)
+	void VoiceManager::demote(int v)
+	{
+		channels[v]->stop();
+		channels[v] = NULL;
+		realCount--;
+	}
+
+	// End a logical voice
+	void VoiceManager::retire(int v)
+	{
+		if (channels[v])
+			demote(v);
+
+		alive[v] = 0;
+		generations[v]++;
+		freeVoices.push_back(v);
+
+		active.erase(std::find(active.begin(), active.end(), v));
+	}
+
+	// Retire finished voices, then re-rank and promote/demote
+	void VoiceManager::Update()
+	{
+		// Idle until a voice is started
+		if (active.empty())
+		{
+			Deactivate();
+			return;
+		}
+
+		unsigned long long now = engine->GetDSPClock();
+
+		ranking.clear();
+
+		for (size_t i = 0; i < active.size(); )
+		{
+			int v = active[i];
+
+			// One-shots end when their length has elapsed, whether they were real or virtual
+			if (!looping[v] && now - startClocks[v] >= lengths[v])
+			{
+				retire(v);
+				continue;
+			}
+
+			// A channel stolen or stopped by FMOD goes back to being virtual
+			if (channels[v])
+			{
+				bool isPlaying = false;
+				channels[v]->isPlaying(&isPlaying);
+
+				if (!isPlaying)
+				{
+					channels[v] = NULL;
+					realCount--;
+				}
+			}
+
+			ranking.push_back(std::make_pair(volumes[v] * priorities[v], v));
+			i++;
+		}
+
+		// Most audible voices first
+		int real = min(static_cast<int>(ranking.size()), maxReal);
+
+		if (static_cast<int>(ranking.size()) > maxReal)
+			std::nth_element(ranking.begin(), ranking.begin() + maxReal, ranking.end(), std::greater<std::pair<float, int>>());
+
+		// Demote before promoting so that channels are free
+		for (size_t i = real; i < ranking.size(); i++)
+			if (channels[ranking[i].second])
+				demote(ranking[i].second);
+
+		for (int i = 0; i < real; i++)
+			if (!channels[ranking[i].second] && ranking[i].first > 0.0f)
+				promote(ranking[i].second, now);
+	}
+
+	// Set up a step sequencer
+	Sequencer::Sequencer(SimpleFMOD *fmod, int s, float bpm, int spb, int lookaheadMs) : SimpleFMODResource(fmod, false), steps(s), dirty(true),
+		tempo(bpm), stepsPerBeat(spb), swing(0.0f), playing(false), starting(false), originClock(0.0), originStep(0), nextStep(0)
+	{
+		fmod->MarkUnrecorded("Sequencer");
+
+		lookahead = static_cast<unsigned int>(static_cast<unsigned long long>(lookaheadMs) * engine->GetSampleRate() / 1000);
+
+		unsigned int blockLength;
+		int numBlocks;
+		engine->FMOD()->getDSPBufferSize(&blockLength, &numBlocks);
+		startLatency = blockLength * 2;
+	}
+
+	int Sequencer::AddTrack(SoundEffect &effect, Bus bus)
+	{
+		Track t;
+		t.effect = &effect;
+		t.bus = bus;
+		t.velocity.assign(steps, 0.0f);
+		t.pitch.assign(steps, 1.0f);
+		t.mute = false;
+
+		tracks.push_back(std::move(t));
+		dirty = true;
+
+		return static_cast<int>(tracks.size()) - 1;
+	}
+
+	void Sequencer::SetStep(int track, int step, float velocity, float pitch)
+	{
+		tracks[track].velocity[step] = velocity;
+		tracks[track].pitch[step] = pitch;
+		dirty = true;
+	}
+
+	void Sequencer::SetTrackMute(int track, bool mute)
+	{
+		tracks[track].mute = mute;
+		dirty = true;
+	}
+
+	void Sequencer::SetLength(int s)
+	{
+		steps = s;
+
+		for (auto &t : tracks)
+		{
+			t.velocity.resize(steps, 0.0f);
+			t.pitch.resize(steps, 1.0f);
+		}
+
+		dirty = true;
+	}
+
+	// Change tempo from the next unscheduled step on
+	void Sequencer::SetTempo(float bpm)
+	{
+		if (playing)
+		{
+			originClock = static_cast<double>(stepClock(nextStep)) - (nextStep & 1? swing * stepLength() : 0.0);
+			originStep = nextStep;
+		}
+
+		tempo = bpm;
+	}
+
+	void Sequencer::Start()
+	{
+		playing = true;
+		starting = true;
+		originClock = static_cast<double>(engine->GetDSPClock() + startLatency);
+		originStep = 0;
+		nextStep = 0;
+
+		Activate();
+	}
+
+	// DSP clock of a step, with swing
+	unsigned long long Sequencer::stepClock(unsigned long long step) const
+	{
+		double length = stepLength();
+		double clock = originClock + (step - originStep) * length;
+
+		if (step & 1)
+			clock += swing * length;
+
+		return static_cast<unsigned long long>(clock + 0.5);
+	}
+
+	// Rebuild the per-step event lists
+	void Sequencer::compile()
+	{
+		events.clear();
+		stepStart.assign(steps + 1, 0);
+
+		for (int s = 0; s < steps; s++)
+		{
+			stepStart[s] = static_cast<int>(events.size());
+
+			for (auto &t : tracks)
+				if (!t.mute && t.velocity[s] > 0.0f)
+					events.push_back(PlayRequest(*t.effect, t.velocity[s], t.pitch[s], 0, t.bus));
+		}
+
+		stepStart[steps] = static_cast<int>(events.size());
+		dirty = false;
+	}
+
+	// Schedule the steps within the lookahead window
+	void Sequencer::Update()
+	{
+		// Idle until started again
+		if (!playing)
+		{
+			Deactivate();
+			return;
+		}
+
+		if (steps <= 0)
+			return;
+
+		if (dirty)
+			compile();
+
+		unsigned long long now = engine->GetDSPClock();
+		unsigned long long horizon = now + lookahead;
+
+		// The DSP clock has moved on since Start(): place step 0 at the earliest clock that can still be scheduled,
+		// so the downbeat isn't dropped as if it were late
+		if (starting)
+		{
+			originClock = static_cast<double>(now + startLatency);
+			starting = false;
+		}
+
+		// After a stall, drop the steps that can no longer start on time rather than playing them late
+		while (stepClock(nextStep) < now + startLatency)
+			nextStep++;
+
+		unsigned long long first = stepClock(nextStep);
+
+		batch.clear();
+
+		for (unsigned long long clock = first; clock < horizon; clock = stepClock(++nextStep))
+		{
+			int s = static_cast<int>(nextStep % steps);
+
+			for (int e = stepStart[s]; e < stepStart[s + 1]; e++)
+			{
+				batch.push_back(events[e]);
+				batch.back().delay = static_cast<unsigned int>(clock - first);
+			}
+		}
+
+		if (!batch.empty())
+			engine->PlayMany(&batch[0], static_cast<int>(batch.size()), NULL, first);
+	}
+
+	// Memory policy accounting
+	MemoryPolicy::MemoryPolicy(size_t budget)
+	{
+		memset(&stats, 0, sizeof(stats));
+		stats.budget = budget;
+	}
+
+	int MemoryPolicy::SizeClass(size_t size)
+	{
+		int c = 0;
+
+		while (c < MemorySizeClasses - 1 && (static_cast<size_t>(16) << c) < size)
+			c++;
+
+		return c;
+	}
+
+	bool MemoryPolicy::reserve(size_t size)
+	{
+		if (stats.budget && stats.current + size > stats.budget)
+		{
+			stats.failures++;
+			return false;
+		}
+
+		int c = SizeClass(size);
+
+		stats.current += size;
+		stats.peak = max(stats.peak, stats.current);
+		stats.allocations++;
+		stats.classCount[c]++;
+		stats.classPeak[c] = max(stats.classPeak[c], stats.classCount[c]);
+		return true;
+	}
+
+	void MemoryPolicy::released(size_t size)
+	{
+		stats.current -= size;
+		stats.classCount[SizeClass(size)]--;
+	}
+
+	MemoryStats MemoryPolicy::GetStats()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return stats;
+	}
+
+	// Fixed arena: FMOD requires a multiple of 512 bytes
+	FixedArenaPolicy::FixedArenaPolicy(size_t bytes) : MemoryPolicy(bytes & ~static_cast<size_t>(511)), length(static_cast<int>(bytes & ~static_cast<size_t>(511)))
+	{
+		arena.reset(new char[length]);
+	}
+
+	MemoryStats FixedArenaPolicy::GetStats()
+	{
+		int current = 0, peak = 0;
+		FMOD::Memory_GetStats(&current, &peak, false);
+
+		MemoryStats s = stats;
+		s.current = current;
+		s.peak = peak;
+		return s;
+	}
+
+	// Blocks carry a 16-byte header (keeping SSE alignment) holding their size
+	static const size_t blockHeader = 16;
+
+	static size_t &blockSize(void *block)
+	{
+		return *reinterpret_cast<size_t *>(static_cast<char *>(block) - blockHeader);
+	}
+
+	// Tracking over malloc
+	void *TrackingPolicy::Alloc(unsigned int size)
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+
+			if (!reserve(size))
+				return NULL;
+		}
+
+		char *block = static_cast<char *>(malloc(size + blockHeader));
+
+		if (!block)
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			released(size);
+			stats.failures++;
+			return NULL;
+		}
+
+		block += blockHeader;
+		blockSize(block) = size;
+		return block;
+	}
+
+	void *TrackingPolicy::Realloc(void *ptr, unsigned int size)
+	{
+		if (!ptr)
+			return Alloc(size);
+
+		size_t oldSize = blockSize(ptr);
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			released(oldSize);
+
+			if (!reserve(size))
+			{
+				reserve(oldSize);
+				stats.allocations--;
+				return NULL;
+			}
+		}
+
+		char *block = static_cast<char *>(realloc(static_cast<char *>(ptr) - blockHeader, size + blockHeader));
+
+		if (!block)
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			released(size);
+			reserve(oldSize);
+			stats.failures++;
+			return NULL;
+		}
+
+		block += blockHeader;
+		blockSize(block) = size;
+		return block;
+	}
+
+	void TrackingPolicy::Free(void *ptr)
+	{
+		if (!ptr)
+			return;
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			released(blockSize(ptr));
+		}
+
+		free(static_cast<char *>(ptr) - blockHeader);
+	}
+
+	// Size-class pools
+	SizeClassPolicy::SizeClassPolicy(size_t budget) : MemoryPolicy(budget), freeLists(PooledClasses, NULL) {}
+
+	SizeClassPolicy::~SizeClassPolicy()
+	{
+		for (auto slab : slabs)
+			free(slab);
+	}
+
+	void *SizeClassPolicy::Alloc(unsigned int size)
+	{
+		int c = SizeClass(size);
+
+		// Large blocks come straight from the heap
+		if (c >= PooledClasses)
+		{
+			{
+				std::lock_guard<std::mutex> guard(lock);
+
+				if (!reserve(size))
+					return NULL;
+			}
+
+			char *block = static_cast<char *>(malloc(size + blockHeader));
+
+			if (!block)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				released(size);
+				stats.failures++;
+				return NULL;
+			}
+
+			block += blockHeader;
+			blockSize(block) = size;
+			return block;
+		}
+
+		size_t classSize = static_cast<size_t>(16) << c;
+
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (!reserve(classSize))
+			return NULL;
+
+		// Carve a new slab into blocks of this class
+		if (!freeLists[c])
+		{
+			size_t stride = classSize + blockHeader;
+			char *slab = static_cast<char *>(malloc(SlabSize));
+
+			if (!slab)
+			{
+				released(classSize);
+				stats.failures++;
+				return NULL;
+			}
+
+			slabs.push_back(slab);
+
+			for (size_t offset = 0; offset + stride <= SlabSize; offset += stride)
+			{
+				void *block = slab + offset + blockHeader;
+				*static_cast<void **>(block) = freeLists[c];
+				freeLists[c] = block;
+			}
+		}
+
+		void *block = freeLists[c];
+		freeLists[c] = *static_cast<void **>(block);
+		blockSize(block) = classSize;
+		return block;
+	}
+
+	void *SizeClassPolicy::Realloc(void *ptr, unsigned int size)
+	{
+		if (!ptr)
+			return Alloc(size);
+
+		size_t oldSize = blockSize(ptr);
+
+		// Still fits in the same pooled block
+		if (SizeClass(oldSize) < PooledClasses && size <= oldSize)
+			return ptr;
+
+		void *block = Alloc(size);
+
+		if (block)
+		{
+			memcpy(block, ptr, min(oldSize, static_cast<size_t>(size)));
+			Free(ptr);
+		}
+
+		return block;
+	}
+
+	void SizeClassPolicy::Free(void *ptr)
+	{
+		if (!ptr)
+			return;
+
+		size_t size = blockSize(ptr);
+		int c = SizeClass(size);
+
+		std::lock_guard<std::mutex> guard(lock);
+		released(size);
+
+		if (c < PooledClasses)
+		{
+			*static_cast<void **>(ptr) = freeLists[c];
+			freeLists[c] = ptr;
+		}
+		else
+			free(static_cast<char *>(ptr) - blockHeader);
+	}
+
+	// The file system installed in FMOD (FMOD's open callback has no user data, so there can only be one)
+	static AsyncFileSystem *installedFileSystem = NULL;
+	static std::mutex fileSystemLock;
+
+	// Start the I/O threads and hand FMOD's file access over to them
+	AsyncFileSystem::AsyncFileSystem(SimpleFMOD *fmod, int threads, unsigned int block) : engine(fmod), sequence(0), quit(false)
+	{
+		blockSize = (max(block, 65536u) + 65535) & ~65535u;
+		memset(&stats, 0, sizeof(stats));
+
+		// Other instances (such as those of a RenderFarm) keep FMOD's own file access
+		{
+			std::lock_guard<std::mutex> guard(fileSystemLock);
+			installed = !installedFileSystem;
+
+			if (installed)
+				installedFileSystem = this;
+		}
+
+		if (!installed)
+		{
+			std::cout << "AsyncFileSystem: one is already installed in this process; FMOD's file access is unchanged" << std::endl;
+			return;
+		}
+
+		for (int i = 0; i < threads; i++)
+			workers.push_back(std::thread(&AsyncFileSystem::worker, this));
+
+		ErrorCheck(engine->FMOD()->setFileSystem(open, close, 0, 0, asyncRead, asyncCancel, 2048));
+	}
+
+	AsyncFileSystem::~AsyncFileSystem()
+	{
+		if (!installed)
+			return;
+
+		engine->FMOD()->setFileSystem(0, 0, 0, 0, 0, 0, 2048);
+
+		{
+			std::lock_guard<std::mutex> guard(fileSystemLock);
+			installedFileSystem = NULL;
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			quit = true;
+		}
+
+		wake.notify_all();
+
+		for (auto &t : workers)
+			t.join();
+
+		for (auto pack : packs)
+			CloseHandle(pack);
+	}
+
+	// Read a pack's directory
+	bool AsyncFileSystem::Mount(const char *packFile)
+	{
+		HANDLE pack = CreateFileA(packFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+
+		if (pack == INVALID_HANDLE_VALUE)
+			return false;
+
+		DWORD read;
+		char magic[4];
+		unsigned int count;
+
+		if (!ReadFile(pack, magic, 4, &read, NULL) || read != 4 || memcmp(magic, "SFPK", 4) || !ReadFile(pack, &count, 4, &read, NULL) || read != 4)
+		{
+			CloseHandle(pack);
+			return false;
+		}
+
+		std::unordered_map<std::string, PackEntry> entries;
+
+		for (unsigned int i = 0; i < count; i++)
+		{
+			unsigned int nameLength;
+			unsigned long long position[2];
+
+			if (!ReadFile(pack, &nameLength, 4, &read, NULL) || read != 4 || nameLength > 4096)
+			{
+				CloseHandle(pack);
+				return false;
+			}
+
+			std::string name(nameLength, '\0');
+
+			if ((nameLength && (!ReadFile(pack, &name[0], nameLength, &read, NULL) || read != nameLength)) || !ReadFile(pack, position, 16, &read, NULL) || read != 16)
+			{
+				CloseHandle(pack);
+				return false;
+			}
+
+			PackEntry entry = { pack, position[0], static_cast<unsigned int>(position[1]) };
+			entries[name] = entry;
+		}
+
+		std::lock_guard<std::mutex> guard(lock);
+
+		for (auto &e : entries)
+			packEntries[e.first] = e.second;
+
+		packs.push_back(pack);
+		return true;
+	}
+
+	AsyncFileSystem::Stats AsyncFileSystem::GetStats()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return stats;
+	}
+
+	// Open a file from a pack or from disk
+	FMOD_RESULT F_CALLBACK AsyncFileSystem::open(const char *name, int unicode, unsigned int *filesize, void **handle, void **userdata)
+	{
+		AsyncFileSystem *fs = installedFileSystem;
+		std::unique_ptr<File> file(new File);
+
+		memset(file.get(), 0, sizeof(File));
+
+		{
+			std::lock_guard<std::mutex> guard(fs->lock);
+			auto entry = unicode? fs->packEntries.end() : fs->packEntries.find(name);
+
+			if (entry != fs->packEntries.end())
+			{
+				file->handle = entry->second.pack;
+				file->base = entry->second.offset;
+				file->size = entry->second.size;
+			}
+		}
+
+		if (!file->handle)
+		{
+			if (unicode)
+				file->handle = CreateFileW(reinterpret_cast<const wchar_t *>(name), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			else
+				file->handle = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+			if (file->handle == INVALID_HANDLE_VALUE)
+				return FMOD_ERR_FILE_NOTFOUND;
+
+			LARGE_INTEGER size;
+			GetFileSizeEx(file->handle, &size);
+
+			file->ownsHandle = true;
+			file->size = static_cast<unsigned int>(size.QuadPart);
+		}
+
+		*filesize = file->size;
+		*handle = file.release();
+		*userdata = fs;
+		return FMOD_OK;
+	}
+
+	// Close a file once nothing is reading it
+	FMOD_RESULT F_CALLBACK AsyncFileSystem::close(void *handle, void *userdata)
+	{
+		File *file = static_cast<File *>(handle);
+
+		asyncCancel(handle, userdata);
+
+		if (file->ownsHandle)
+			CloseHandle(file->handle);
+
+		_aligned_free(file->cache.data);
+		_aligned_free(file->ahead.data);
+		delete file;
+
+		return FMOD_OK;
+	}
+
+	// Queue a read from FMOD. FMOD gives streams about to starve the highest priority
+	FMOD_RESULT F_CALLBACK AsyncFileSystem::asyncRead(FMOD_ASYNCREADINFO *info, void *userdata)
+	{
+		AsyncFileSystem *fs = static_cast<AsyncFileSystem *>(userdata);
+		File *file = static_cast<File *>(info->handle);
+
+		{
+			std::lock_guard<std::mutex> guard(fs->lock);
+
+			Request r = { info->priority, fs->sequence++, info, file };
+			fs->queue.push(r);
+			fs->stats.requests++;
+			file->inFlight++;
+		}
+
+		fs->wake.notify_one();
+		return FMOD_OK;
+	}
+
+	// Complete all queued reads of a file as cancelled and wait for those in progress
+	FMOD_RESULT F_CALLBACK AsyncFileSystem::asyncCancel(void *handle, void *userdata)
+	{
+		AsyncFileSystem *fs = static_cast<AsyncFileSystem *>(userdata);
+		File *file = static_cast<File *>(handle);
+
+		std::unique_lock<std::mutex> guard(fs->lock);
+
+		std::vector<Request> keep;
+
+		while (!fs->queue.empty())
+		{
+			Request r = fs->queue.top();
+			fs->queue.pop();
+
+			if (r.file != file)
+				keep.push_back(r);
+			else
+			{
+				if (r.info)
+				{
+					r.info->bytesread = 0;
+					r.info->result = FMOD_ERR_FILE_DISKEJECTED;
+				}
+
+				file->inFlight--;
+			}
+		}
+
+		for (auto &r : keep)
+			fs->queue.push(r);
+
+		fs->idle.wait(guard, [file] { return file->inFlight == 0; });
+		return FMOD_OK;
+	}
+
+	// Schedule reading the block after the cached one at the lowest priority
+	void AsyncFileSystem::queueReadAhead(File *file)
+	{
+		unsigned long long next = file->cache.offset + file->cache.length;
+
+		if (file->readingAhead || !file->cache.data || next >= file->size || (file->ahead.data && file->ahead.offset == next))
+			return;
+
+		file->readingAhead = true;
+		file->inFlight++;
+
+		Request r = { -1, sequence++, NULL, file };
+		queue.push(r);
+		wake.notify_one();
+	}
+
+	// Read the aligned block containing 'offset' into 'block' (called with the lock held; it is released while reading)
+	bool AsyncFileSystem::fill(File *file, Block &block, unsigned long long offset, std::unique_lock<std::mutex> &guard)
+	{
+		unsigned long long start = offset / blockSize * blockSize;
+		unsigned int length = static_cast<unsigned int>(min(static_cast<unsigned long long>(blockSize), file->size - start));
+
+		char *data = static_cast<char *>(_aligned_malloc(blockSize, 4096));
+
+		guard.unlock();
+
+		// Positional read: no shared file pointer, so threads can read the same handle at once
+		OVERLAPPED position;
+		memset(&position, 0, sizeof(position));
+		position.Offset = static_cast<DWORD>(file->base + start);
+		position.OffsetHigh = static_cast<DWORD>((file->base + start) >> 32);
+
+		DWORD read = 0;
+		bool ok = ReadFile(file->handle, data, length, &read, &position) && read == length;
+
+		guard.lock();
+
+		if (!ok)
+		{
+			_aligned_free(data);
+			return false;
+		}
+
+		_aligned_free(block.data);
+		block.data = data;
+		block.offset = start;
+		block.length = length;
+
+		stats.reads++;
+		stats.bytesRead += length;
+		return true;
+	}
+
+	// Serve one request (called with the lock held)
+	void AsyncFileSystem::serve(Request &request, std::unique_lock<std::mutex> &guard)
+	{
+		File *file = request.file;
+
+		// Read-ahead
+		if (!request.info)
+		{
+			unsigned long long next = file->cache.offset + file->cache.length;
+
+			Block block = { NULL, 0, 0 };
+
+			if (fill(file, block, next, guard))
+			{
+				_aligned_free(file->ahead.data);
+				file->ahead = block;
+			}
+
+			file->readingAhead = false;
+			return;
+		}
+
+		FMOD_ASYNCREADINFO *info = request.info;
+		char *out = static_cast<char *>(info->buffer);
+		unsigned long long offset = info->offset;
+		unsigned long long end = min(static_cast<unsigned long long>(info->offset) + info->sizebytes, static_cast<unsigned long long>(file->size));
+		bool hit = true;
+
+		// Copy from the cached block, moving on to the read-ahead block or reading new blocks as needed
+		while (offset < end)
+		{
+			Block &c = file->cache;
+
+			if (!c.data || offset < c.offset || offset >= c.offset + c.length)
+			{
+				hit = false;
+
+				if (file->ahead.data && offset >= file->ahead.offset && offset < file->ahead.offset + file->ahead.length)
+				{
+					std::swap(file->cache, file->ahead);
+					stats.readAheadHits++;
+				}
+				else if (!fill(file, file->cache, offset, guard))
+					break;
+			}
+
+			unsigned int count = static_cast<unsigned int>(min(end, c.offset + c.length) - offset);
+			memcpy(out, c.data + (offset - c.offset), count);
+			out += count;
+			offset += count;
+		}
+
+		if (hit)
+			stats.cacheHits++;
+
+		// Keep the next block coming for sequential readers
+		queueReadAhead(file);
+
+		info->bytesread = static_cast<unsigned int>(offset - info->offset);
+
+		// Setting the result tells FMOD the read is complete, so it must come last
+		info->result = info->bytesread == info->sizebytes? FMOD_OK : (offset >= file->size? FMOD_ERR_FILE_EOF : FMOD_ERR_FILE_BAD);
+	}
+
+	// I/O thread
+	void AsyncFileSystem::worker()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		while (true)
+		{
+			wake.wait(guard, [this] { return quit || !queue.empty(); });
+
+			if (quit)
+				return;
+
+			Request request = queue.top();
+			queue.pop();
+
+			serve(request, guard);
+
+			if (--request.file->inFlight == 0)
+				idle.notify_all();
+		}
+	}
+
+	// Read an asset manifest
+	bool Manifest::Load(const char *filename)
+	{
+		FILE *f = fopen(filename, "r");
+
+		if (!f)
+			return false;
+
+		char line[512], command[16], name[64], file[260], mode[16], bus[64];
+		float plays;
+
+		while (fgets(line, sizeof(line), f))
+		{
+			int fields = sscanf(line, "%15s %63s %259s", command, name, file);
+
+			if (fields < 2 || command[0] == '#')
+				continue;
+
+			if (!strcmp(command, "bus") || !strcmp(command, "send"))
+				busLines.push_back(line);
+
+			else if (!strcmp(command, "song") && fields == 3)
+			{
+				Asset a = { true, name, file, "", LoadStream, 0.0f };
+
+				if (sscanf(line, "%*s %*s %*s %63s", bus) == 1)
+					a.bus = bus;
+
+				assets.push_back(a);
+			}
+
+			else if (!strcmp(command, "effect") && fields == 3)
+			{
+				Asset a = { false, name, file, "", LoadAuto, 0.0f };
+
+				int options = sscanf(line, "%*s %*s %*s %15s %f %63s", mode, &plays, bus);
+
+				if (options >= 1)
+					a.loadMode = !strcmp(mode, "decoded")? LoadDecoded : !strcmp(mode, "compressed")? LoadCompressed : !strcmp(mode, "stream")? LoadStream : LoadAuto;
+
+				if (options >= 2)
+					a.playsPerMinute = plays;
+
+				if (options >= 3)
+					a.bus = bus;
+
+				assets.push_back(a);
+			}
+		}
+
+		fclose(f);
+		return true;
+	}
+
+	// Start reading every asset
+	Preloader::Preloader(const Manifest &m, int threads) : manifest(m), engine(NULL), nextRead(0), finished(0), quit(false)
+	{
+		items.resize(manifest.assets.size());
+
+		for (size_t i = 0; i < items.size(); i++)
+		{
+			items[i].asset = &manifest.assets[i];
+			items[i].state = Reading;
+			items[i].sound = NULL;
+			items[i].loadMode = manifest.assets[i].loadMode;
+			items[i].channelGroup = NULL;
+		}
+
+		if (threads <= 0)
+			threads = max(static_cast<int>(std::thread::hardware_concurrency()), 2);
+
+		threads = min(threads, max(static_cast<int>(items.size()), 1));
+
+		for (int i = 0; i < threads; i++)
+			workers.push_back(std::thread(&Preloader::worker, this));
+	}
+
+	Preloader::~Preloader()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			quit = true;
+		}
+
+		wake.notify_all();
+
+		for (auto &t : workers)
+			t.join();
+
+		// Release anything not handed over
+		for (auto &item : items)
+			if (item.sound)
+				item.sound->release();
+	}
+
+	// Create buses on the main thread, then let the workers create sounds
+	void Preloader::Warmup(SimpleFMOD *fmod)
+	{
+		for (auto &line : manifest.busLines)
+			fmod->busConfigLine(line.c_str());
+
+		// As for Song
+		fmod->FMOD()->setStreamBufferSize(65536, FMOD_TIMEUNIT_RAWBYTES);
+
+		// Load modes are chosen here rather than by the workers, as the choice depends on the memory in use,
+		// which only the main thread may read. The workers don't look at them until 'engine' is set
+		for (auto &item : items)
+		{
+			Bus bus = item.asset->bus.empty()? Bus() : fmod->FindBus(item.asset->bus.c_str());
+
+			item.channelGroup = bus.IsValid()? fmod->GetBusChannelGroup(bus) : item.asset->song? fmod->GetMusicChannelGroup() : fmod->GetEffectsChannelGroup();
+
+			if (item.loadMode == LoadAuto)
+				item.loadMode = fmod->chooseLoadMode(item.asset->filename.c_str(), item.asset->playsPerMinute, FMOD_DEFAULT);
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			engine = fmod;
+		}
+
+		wake.notify_all();
+	}
+
+	// Read a file into memory. Streams are opened by name and only ever read a buffer at a time, so they aren't read
+	// here. The load mode of an automatic asset isn't known yet (see Warmup()), so it is read in full
+	void Preloader::read(Item &item)
+	{
+		if (item.asset->loadMode == LoadStream)
+			return;
+
+		FILE *f = fopen(item.asset->filename.c_str(), "rb");
+
+		if (!f)
+			return;
+
+		fseek(f, 0, SEEK_END);
+		item.data.resize(static_cast<size_t>(ftell(f)));
+		fseek(f, 0, SEEK_SET);
+
+		if (!item.data.empty() && fread(&item.data[0], 1, item.data.size(), f) != item.data.size())
+			item.data.clear();
+
+		fclose(f);
+	}
+
+	// Create the sound from the data read
+	void Preloader::create(Item &item)
+	{
+		const Manifest::Asset &a = *item.asset;
+
+		// An automatic asset chosen to stream was read in full to no purpose, but the read leaves it in the OS file cache
+		if (item.loadMode == LoadStream)
+		{
+			std::vector<char>().swap(item.data);
+
+			if (engine->FMOD()->createStream(a.filename.c_str(), loadModeFlags[LoadStream], 0, &item.sound) != FMOD_OK)
+				item.sound = NULL;
+
+			return;
+		}
+
+		if (item.data.empty())
+			return;
+
+		FMOD_CREATESOUNDEXINFO info;
+		memset(&info, 0, sizeof(FMOD_CREATESOUNDEXINFO));
+		info.cbsize = sizeof(FMOD_CREATESOUNDEXINFO);
+		info.length = static_cast<unsigned int>(item.data.size());
+
+		if (engine->FMOD()->createSound(&item.data[0], FMOD_OPENMEMORY | loadModeFlags[item.loadMode], &info, &item.sound) != FMOD_OK)
+			item.sound = NULL;
+
+		// FMOD has its own copy
+		std::vector<char>().swap(item.data);
+	}
+
+	// Read files as soon as possible, and create sounds once FMOD is up
+	void Preloader::worker()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		while (true)
+		{
+			Item *work = NULL;
+
+			wake.wait(guard, [&] {
+				if (quit)
+					return true;
+
+				if (nextRead < items.size())
+				{
+					work = &items[nextRead++];
+					return true;
+				}
+
+				if (engine)
+					for (auto &item : items)
+						if (item.state == Read)
+						{
+							work = &item;
+							return true;
+						}
+
+				return false;
+			});
+
+			if (quit)
+				return;
+
+			if (work->state == Reading)
+			{
+				guard.unlock();
+				read(*work);
+				guard.lock();
+
+				work->state = Read;
+				wake.notify_all();
+			}
+			else
+			{
+				work->state = Creating;
+
+				guard.unlock();
+				create(*work);
+				guard.lock();
+
+				work->state = work->sound? Created : Failed;
+				finished++;
+				done.notify_all();
+			}
+		}
+	}
+
+	float Preloader::GetProgress() const
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (items.empty())
+			return 1.0f;
+
+		// Reading and creating count as half the work each
+		return (min(nextRead, items.size()) + finished) / (2.0f * items.size());
+	}
+
+	bool Preloader::IsReady() const
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return finished == static_cast<int>(items.size());
+	}
+
+	void Preloader::Wait()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		done.wait(guard, [this] { return finished == static_cast<int>(items.size()); });
+	}
+
+	// Wait for an asset to be ready
+	Preloader::Item *Preloader::find(const char *name, bool song)
+	{
+		for (auto &item : items)
+			if (item.asset->song == song && item.asset->name == name)
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				done.wait(guard, [&item] { return item.state == Created || item.state == Failed; });
+				return &item;
+			}
+
+		return NULL;
+	}
+
+	Song Preloader::GetSong(const char *name)
+	{
+		Item *item = find(name, true);
+
+		if (!item || !item->sound)
+			return Song();
+
+		Song song(engine, item->sound, item->channelGroup);
+		engine->recordLoad(song, true, item->asset->filename.c_str(), FMOD_DEFAULT, engine->FindBus(item->asset->bus.c_str()), -1, 0.0f);
+		item->sound = NULL;
+		return song;
+	}
+
+	SoundEffect Preloader::GetSoundEffect(const char *name)
+	{
+		Item *item = find(name, false);
+
+		if (!item || !item->sound)
+			return SoundEffect();
+
+		SoundEffect effect(engine, item->sound, item->channelGroup);
+		engine->account(effect, item->loadMode, true);
+		engine->recordLoad(effect, false, item->asset->filename.c_str(), FMOD_DEFAULT, engine->FindBus(item->asset->bus.c_str()), item->loadMode, item->asset->playsPerMinute);
+		item->sound = NULL;
+		return effect;
+	}
+
+	// Start recording API calls
+	bool SimpleFMOD::StartRecording(const char *filename)
+	{
+		StopRecording();
+
+		recordFile = fopen(filename, "wb");
+
+		if (!recordFile)
+			return false;
+
+		unsigned int header[2] = { 1, static_cast<unsigned int>(sampleRate) };
+		fwrite("SFRC", 1, 4, recordFile);
+		fwrite(header, sizeof(header), 1, recordFile);
+
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		recordLast = counter.QuadPart;
+
+		recordBuses();
+		return true;
+	}
+
+	// Write out the buses and sends made before recording started, so the ids used later refer to them on replay
+	void SimpleFMOD::recordBuses()
+	{
+		for (size_t i = 0; i < busGroups.size(); i++)
+		{
+			record(RecCreateBus);
+			recordString(busNames[i].c_str());
+			recordValue(busParents[i]);
+
+			if (busVolume[i] != 1.0f)
+			{
+				record(RecBusVolume);
+				recordValue(static_cast<int>(i));
+				recordValue(busVolume[i]);
+			}
+
+			if (busMute[i])
+			{
+				record(RecBusMute);
+				recordValue(static_cast<int>(i));
+				recordValue(static_cast<unsigned char>(1));
+			}
+
+			if (busPaused[i])
+			{
+				record(RecBusPaused);
+				recordValue(static_cast<int>(i));
+				recordValue(static_cast<unsigned char>(1));
+			}
+		}
+
+		for (size_t i = 0; i < sends.size(); i++)
+		{
+			float level = 1.0f;
+			sends[i]->getMix(&level);
+
+			record(RecAddSend);
+			recordValue(sendBuses[i].first);
+			recordValue(sendBuses[i].second);
+			recordValue(level);
+		}
+	}
+
+	void SimpleFMOD::StopRecording()
+	{
+		if (!recordFile)
+			return;
+
+		flushRecording();
+		fclose(recordFile);
+		recordFile = NULL;
+	}
+
+	void SimpleFMOD::flushRecording()
+	{
+		if (!recordBuffer.empty())
+			fwrite(&recordBuffer[0], 1, recordBuffer.size(), recordFile);
+
+		recordBuffer.clear();
+	}
+
+	// Start a record: time since the last one (as a varint) and the command
+	void SimpleFMOD::record(int command)
+	{
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+
+		unsigned long long delta = static_cast<unsigned long long>((counter.QuadPart - recordLast) / counterTicksPerUs);
+		recordLast += static_cast<long long>(delta * counterTicksPerUs);
+
+		while (delta >= 0x80)
+		{
+			recordBuffer.push_back(static_cast<unsigned char>(delta | 0x80));
+			delta >>= 7;
+		}
+
+		recordBuffer.push_back(static_cast<unsigned char>(delta));
+		recordBuffer.push_back(static_cast<unsigned char>(command));
+
+		if (command == RecUpdate && recordBuffer.size() >= 65536)
+			flushRecording();
+	}
+
+	void SimpleFMOD::recordData(const void *data, size_t size)
+	{
+		const unsigned char *bytes = static_cast<const unsigned char *>(data);
+		recordBuffer.insert(recordBuffer.end(), bytes, bytes + size);
+	}
+
+	void SimpleFMOD::recordString(const char *s)
+	{
+		unsigned short length = static_cast<unsigned short>(strlen(s));
+		recordValue(length);
+		recordData(s, length);
+	}
+
+	// Give a loaded resource an ID and record its load
+	void SimpleFMOD::recordLoad(SimpleFMODResource &resource, bool song, const char *filename, FMOD_MODE mode, Bus bus, int loadMode, float playsPerMinute)
+	{
+		if (!recordFile)
+			return;
+
+		resource.recordId = ++recordIds;
+
+		record(song? RecLoadSong : RecLoadEffect);
+		recordValue(resource.recordId);
+		recordString(filename);
+		recordValue(mode);
+		recordValue(bus.id);
+
+		if (!song)
+		{
+			recordValue(static_cast<signed char>(loadMode));
+			recordValue(playsPerMinute);
+		}
+	}
+
+	// Reads values from a recording
+	class RecordReader
+	{
+	private:
+		const std::vector<unsigned char> &data;
+		size_t position;
+
+	public:
+		RecordReader(const std::vector<unsigned char> &d, size_t start) : data(d), position(start) {}
+
+		bool AtEnd() const { return position >= data.size(); }
+		void SkipToEnd() { position = data.size(); }
+
+		template <typename T> T Read()
+		{
+			T value = T();
+
+			if (position + sizeof(T) <= data.size())
+				memcpy(&value, &data[position], sizeof(T));
+
+			position += sizeof(T);
+			return value;
+		}
+
+		unsigned long long ReadVarint()
+		{
+			unsigned long long value = 0;
+			int shift = 0;
+
+			while (position < data.size())
+			{
+				unsigned char b = data[position++];
+				value |= static_cast<unsigned long long>(b & 0x7F) << shift;
+				shift += 7;
+
+				if (!(b & 0x80))
+					break;
+			}
+
+			return value;
+		}
+
+		std::string ReadString()
+		{
+			unsigned short length = Read<unsigned short>();
+			size_t start = min(position, data.size());
+
+			position += length;
+			return std::string(data.begin() + start, data.begin() + min(position, data.size()));
+		}
+	};
+
+	// Hash of everything the master channel group outputs (FNV-1a over the sample bits)
+	struct OutputHash
+	{
+		unsigned long long hash;
+	};
+
+	static FMOD_RESULT F_CALLBACK outputHashRead(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer, unsigned int length, int inchannels, int outchannels)
+	{
+		OutputHash *state;
+		reinterpret_cast<FMOD::DSP *>(dsp_state->instance)->getUserData(reinterpret_cast<void **>(&state));
+
+		unsigned int count = length * inchannels;
+		const unsigned int *bits = reinterpret_cast<const unsigned int *>(inbuffer);
+
+		for (unsigned int i = 0; i < count; i++)
+			state->hash = (state->hash ^ bits[i]) * 1099511628211ULL;
+
+		memcpy(outbuffer, inbuffer, count * sizeof(float));
+		return FMOD_OK;
+	}
+
+	// Mark the recording as incomplete: an object whose calls aren't recorded is in use
+	void SimpleFMOD::MarkUnrecorded(const char *type)
+	{
+		if (!recordFile)
+			return;
+
+		record(RecUnrecorded);
+		recordString(type);
+	}
+
+	// Replay a recording as fast as possible on a new instance, so that every run starts from the same state
+	bool SimpleFMOD::Replay(const char *filename, ReplayStats &stats, const SimpleFMODSettings &settings)
+	{
+		std::vector<unsigned char> data;
+
+		if (FILE *f = fopen(filename, "rb"))
+		{
+			fseek(f, 0, SEEK_END);
+			data.resize(static_cast<size_t>(ftell(f)));
+			fseek(f, 0, SEEK_SET);
+
+			if (!data.empty() && fread(&data[0], 1, data.size(), f) != data.size())
+				data.clear();
+
+			fclose(f);
+		}
+
+		if (data.size() < 12 || memcmp(&data[0], "SFRC", 4))
+			return false;
+
+		SimpleFMODSettings replaySettings = settings;
+		replaySettings.nonRealtime = true;
+		replaySettings.recordFile = NULL;
+		replaySettings.mixOutput = NULL;
+
+		SimpleFMOD fmod(replaySettings);
+		return fmod.replay(data, stats);
+	}
+
+	bool SimpleFMOD::replay(const std::vector<unsigned char> &data, ReplayStats &stats)
+	{
+		memset(&stats, 0, sizeof(stats));
+
+		// Hash the master output
+		OutputHash hash = { 14695981039346656037ULL };
+		FMOD_DSP_DESCRIPTION desc;
+		memset(&desc, 0, sizeof(FMOD_DSP_DESCRIPTION));
+
+		strcpy(desc.name, "SimpleFMOD replay hash");
+		desc.read = outputHashRead;
+		desc.userdata = &hash;
+
+		FMOD::DSP *dsp;
+		FMOD::ChannelGroup *master;
+		ErrorCheck(system->createDSP(&desc, &dsp));
+		ErrorCheck(system->getMasterChannelGroup(&master));
+		ErrorCheck(master->addDSP(dsp, 0));
+
+		std::unordered_map<unsigned int, std::unique_ptr<Song>> songs;
+		std::unordered_map<unsigned int, std::unique_ptr<SoundEffect>> effects;
+		std::vector<PlayRequest> requests;
+
+		double start = nowUs();
+		unsigned long long startClock = GetDSPClock();
+		double updateUs = 0.0;
+
+		RecordReader r(data, 12);
+
+		// Bus ids in a recording are only trusted if they refer to a bus that exists (or to none, -1)
+		auto knownBus = [this](Bus bus) { return !bus.IsValid() || validBus(bus); };
+
+		while (!r.AtEnd())
+		{
+			// Replay ignores the timestamps: it runs as fast as possible
+			r.ReadVarint();
+			int command = r.Read<unsigned char>();
+			stats.commands++;
+
+			switch (command)
+			{
+			case RecUpdate:
+				{
+					double before = nowUs();
+					Update();
+					double took = nowUs() - before;
+
+					updateUs += took;
+					stats.maxUpdateUs = max(stats.maxUpdateUs, took);
+					stats.updates++;
+				}
+				break;
+
+			case RecLoadSong:
+				{
+					unsigned int id = r.Read<unsigned int>();
+					std::string file = r.ReadString();
+					FMOD_MODE mode = r.Read<FMOD_MODE>();
+					Bus bus(r.Read<int>());
+
+					if (knownBus(bus))
+						songs[id].reset(new Song(this, file.c_str(), bus.IsValid()? GetBusChannelGroup(bus) : channelMusic, mode));
+				}
+				break;
+
+			case RecLoadEffect:
+				{
+					unsigned int id = r.Read<unsigned int>();
+					std::string file = r.ReadString();
+					FMOD_MODE mode = r.Read<FMOD_MODE>();
+					Bus bus(r.Read<int>());
+					int loadMode = r.Read<signed char>();
+					float plays = r.Read<float>();
+
+					if (!knownBus(bus) || loadMode >= LoadModeCount)
+						break;
+
+					if (loadMode < 0)
+						effects[id].reset(new SoundEffect(this, file.c_str(), bus.IsValid()? GetBusChannelGroup(bus) : channelEffects, mode));
+					else
+						effects[id].reset(new SoundEffect(LoadSoundEffect(file.c_str(), static_cast<LoadMode>(loadMode), plays, bus, mode)));
+				}
+				break;
+
+			case RecCreateBus:
+				{
+					std::string name = r.ReadString();
+					Bus parent(r.Read<int>());
+
+					// The built-in buses already exist
+					if (!FindBus(name.c_str()).IsValid())
+						CreateBus(name.c_str(), parent);
+				}
+				break;
+
+			case RecBusVolume:
+				{
+					Bus bus(r.Read<int>());
+					float volume = r.Read<float>();
+
+					if (validBus(bus))
+						SetBusVolume(bus, volume);
+				}
+				break;
+
+			case RecBusMute:
+				{
+					Bus bus(r.Read<int>());
+					bool mute = r.Read<unsigned char>() != 0;
+
+					if (validBus(bus))
+						SetBusMute(bus, mute);
+				}
+				break;
+
+			case RecBusPaused:
+				{
+					Bus bus(r.Read<int>());
+					bool paused = r.Read<unsigned char>() != 0;
+
+					if (validBus(bus))
+						SetBusPaused(bus, paused);
+				}
+				break;
+
+			case RecCrossfade:
+				{
+					std::string file = r.ReadString();
+					int ms = r.Read<int>();
+					FadeCurve curve = static_cast<FadeCurve>(r.Read<unsigned char>());
+					FMOD_MODE mode = r.Read<FMOD_MODE>();
+
+					CrossfadeTo(file.c_str(), ms, curve, mode);
+				}
+				break;
+
+			case RecSongStart:
+			case RecSongStop:
+			case RecSongTogglePause:
+			case RecSongSetPaused:
+			case RecSongSetVolume:
+			case RecSongFade:
+				{
+					unsigned int id = r.Read<unsigned int>();
+					Song *song = songs.count(id)? songs[id].get() : NULL;
+
+					if (command == RecSongStart)
+					{
+						bool paused = r.Read<unsigned char>() != 0;
+
+						if (song)
+							song->Start(paused);
+					}
+
+					// Only songs that were started have a channel to control
+					else if (!song || !song->GetChannel())
+					{
+						if (command == RecSongSetPaused)
+							r.Read<unsigned char>();
+						else if (command == RecSongSetVolume)
+							r.Read<float>();
+						else if (command == RecSongFade)
+						{
+							r.Read<int>();
+							r.Read<float>();
+							r.Read<unsigned char>();
+						}
+					}
+
+					else if (command == RecSongStop)
+						song->Stop();
+					else if (command == RecSongTogglePause)
+						song->TogglePause();
+					else if (command == RecSongSetPaused)
+						song->SetPaused(r.Read<unsigned char>() != 0);
+					else if (command == RecSongSetVolume)
+						song->SetVolume(r.Read<float>());
+					else
+					{
+						int ms = r.Read<int>();
+						float target = r.Read<float>();
+						bool pause = r.Read<unsigned char>() != 0;
+
+						song->Fade(ms, target, pause);
+					}
+				}
+				break;
+
+			case RecEffectPlay:
+				{
+					unsigned int id = r.Read<unsigned int>();
+
+					if (effects.count(id))
+						effects[id]->Play();
+				}
+				break;
+
+			case RecEffectPlayAt:
+				{
+					unsigned int id = r.Read<unsigned int>();
+					long long offset = r.Read<long long>();
+
+					if (effects.count(id))
+						effects[id]->PlayAt(frameClock + offset);
+				}
+				break;
+
+			case RecPlayMany:
+				{
+					long long offset = r.Read<long long>();
+					int count = r.Read<int>();
+
+					requests.clear();
+
+					for (int i = 0; i < count && !r.AtEnd(); i++)
+					{
+						PlayRequest request;
+						unsigned int id = r.Read<unsigned int>();
+
+						request.effect = effects.count(id)? effects[id].get() : NULL;
+						request.bus = Bus(r.Read<int>());
+						request.volume = r.Read<float>();
+						request.pitch = r.Read<float>();
+						request.delay = r.Read<unsigned int>();
+
+						if (request.effect && knownBus(request.bus))
+							requests.push_back(request);
+					}
+
+					if (!requests.empty())
+						PlayMany(&requests[0], static_cast<int>(requests.size()), NULL, offset? frameClock + offset : 0);
+				}
+				break;
+
+			case RecAddSend:
+				{
+					Bus from(r.Read<int>()), to(r.Read<int>());
+					float level = r.Read<float>();
+
+					if (validBus(from) && validBus(to))
+						AddSend(from, to, level);
+				}
+				break;
+
+			case RecSendLevel:
+				{
+					int send = r.Read<int>();
+					float level = r.Read<float>();
+
+					if (send >= 0 && send < static_cast<int>(sends.size()))
+						SetSendLevel(send, level);
+				}
+				break;
+
+			case RecUnrecorded:
+				{
+					std::string type = r.ReadString();
+
+					if (!stats.unrecorded++)
+						std::cout << "Recording uses " << type << ", whose calls are not recorded: the replay will differ" << std::endl;
+				}
+				break;
+
+			default:
+				// Unknown command: the rest of the log can't be parsed
+				std::cout << "Unknown command " << command << " in recording" << std::endl;
+				r.SkipToEnd();
+				break;
+			}
+		}
+
+		stats.wallMs = (nowUs() - start) / 1000.0;
+		stats.meanUpdateUs = stats.updates? updateUs / stats.updates : 0.0;
+		stats.samplesMixed = GetDSPClock() - startClock;
+
+		// Songs and effects must go before the DSP that reads their output
+		songs.clear();
+		effects.clear();
+
+		dsp->remove();
+		dsp->release();
+
+		stats.outputHash = hash.hash;
+		return true;
+	}
+
+	// Capture the master output
+	OutputCapture::OutputCapture(SimpleFMOD *fmod, Sink s) : sink(s), channels(0)
+	{
+		FMOD_DSP_DESCRIPTION desc;
+		memset(&desc, 0, sizeof(FMOD_DSP_DESCRIPTION));
+
+		strcpy(desc.name, "SimpleFMOD output capture");
+		desc.read = read;
+		desc.userdata = this;
+
+		// Without memory for the DSP nothing is captured
+		FMOD::ChannelGroup *master;
+
+		if (!MemoryCheck(fmod->FMOD()->createDSP(&desc, &dsp)))
+		{
+			dsp = NULL;
+			return;
+		}
+
+		ErrorCheck(fmod->FMOD()->getMasterChannelGroup(&master));
+		ErrorCheck(master->addDSP(dsp, 0));
+	}
+
+	OutputCapture::~OutputCapture()
+	{
+		if (!dsp)
+			return;
+
+		dsp->remove();
+		dsp->release();
+	}
+
+	FMOD_RESULT F_CALLBACK OutputCapture::read(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer, unsigned int length, int inchannels, int outchannels)
+	{
+		OutputCapture *me;
+		reinterpret_cast<FMOD::DSP *>(dsp_state->instance)->getUserData(reinterpret_cast<void **>(&me));
+
+		me->channels = inchannels;
+
+		if (me->sink)
+			me->sink(inbuffer, length, inchannels);
+		else
+			me->samples.insert(me->samples.end(), inbuffer, inbuffer + length * inchannels);
+
+		memcpy(outbuffer, inbuffer, length * inchannels * sizeof(float));
+		return FMOD_OK;
+	}
+
+	// Start the render workers
+	RenderFarm::RenderFarm(int instances, const SimpleFMODSettings &s) : settings(s), running(0), quit(false)
+	{
+		settings.nonRealtime = true;
+		settings.recordFile = NULL;
+
+		if (instances <= 0)
+			instances = max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+
+		for (int i = 0; i < instances; i++)
+			workers.push_back(std::thread(&RenderFarm::worker, this, i));
+	}
+
+	RenderFarm::~RenderFarm()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			quit = true;
+		}
+
+		wake.notify_all();
+
+		for (auto &t : workers)
+			t.join();
+	}
+
+	void RenderFarm::Submit(RenderJob job)
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			jobs.push_back(job);
+		}
+
+		wake.notify_one();
+	}
+
+	void RenderFarm::Wait()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		idle.wait(guard, [this] { return jobs.empty() && running == 0; });
+	}
+
+	// Worker: pin to a core, create a private FMOD system, then run jobs until told to stop
+	void RenderFarm::worker(int index)
+	{
+		int cores = max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+		SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << (index % min(cores, static_cast<int>(sizeof(DWORD_PTR) * 8))));
+
+		SimpleFMOD fmod(settings);
+
+		while (true)
+		{
+			RenderJob job;
+
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [this] { return quit || !jobs.empty(); });
+
+				// Finish the queue before stopping
+				if (jobs.empty())
+					return;
+
+				job = jobs.front();
+				jobs.pop_front();
+				running++;
+			}
+
+			job(fmod, index);
+
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				running--;
+			}
+
+			idle.notify_all();
+		}
+	}
+
+	MixOutput::MixOutput(const MixOutputSettings &s) : settings(s), blockBytes(0), ringMask(0), head(0), tail(0),
+		framesMixed(0), overruns(0), backpressured(false), state(NULL), quit(false)
+	{
+	}
+
+	MixOutput::~MixOutput()
+	{
+		stop();
+	}
+
+	// Register the plugin with FMOD and make it the output, in the requested format
+	void MixOutput::select(FMOD::System *system)
+	{
+		FMOD_OUTPUT_DESCRIPTION desc;
+		memset(&desc, 0, sizeof(FMOD_OUTPUT_DESCRIPTION));
+
+		// Not polling: FMOD doesn't mix by itself, our thread pulls each block
+		desc.name = "SimpleFMOD mix output";
+		desc.version = 0x00010000;
+		desc.polling = 0;
+		desc.getnumdrivers = getNumDrivers;
+		desc.getdrivername = getDriverName;
+		desc.init = init;
+		desc.close = close;
+
+		unsigned int plugin;
+		ErrorCheck(system->registerOutput(&desc, &plugin));
+		ErrorCheck(system->setOutputByPlugin(plugin));
+
+		FMOD_SPEAKERMODE speakerMode = settings.channels == 1? FMOD_SPEAKERMODE_MONO : settings.channels == 2? FMOD_SPEAKERMODE_STEREO : FMOD_SPEAKERMODE_RAW;
+		ErrorCheck(system->setSpeakerMode(speakerMode));
+		ErrorCheck(system->setSoftwareFormat(settings.sampleRate, settings.format, speakerMode == FMOD_SPEAKERMODE_RAW? settings.channels : 0, 0, FMOD_DSP_RESAMPLER_LINEAR));
+
+		// One DSP buffer per block, so each read from the mixer is a single mix
+		ErrorCheck(system->setDSPBufferSize(settings.blockFrames, 2));
+	}
+
+	FMOD_RESULT F_CALLBACK MixOutput::getNumDrivers(FMOD_OUTPUT_STATE *output_state, int *numdrivers)
+	{
+		*numdrivers = 1;
+		return FMOD_OK;
+	}
+
+	FMOD_RESULT F_CALLBACK MixOutput::getDriverName(FMOD_OUTPUT_STATE *output_state, int id, char *name, int namelen)
+	{
+		strncpy(name, "SimpleFMOD mix output", namelen);
+		name[namelen - 1] = 0;
+		return FMOD_OK;
+	}
+
+	// FMOD is ready: size the ring for the format it settled on and start mixing
+	FMOD_RESULT F_CALLBACK MixOutput::init(FMOD_OUTPUT_STATE *output_state, int selecteddriver, FMOD_INITFLAGS flags, int *outputrate, int outputchannels, FMOD_SOUND_FORMAT *outputformat, int dspbufferlength, int dspnumbuffers, void *extradriverdata)
+	{
+		MixOutput *me = static_cast<MixOutput *>(extradriverdata);
+
+		if (!me)
+			return FMOD_ERR_INVALID_PARAM;
+
+		output_state->plugindata = me;
+		me->state = output_state;
+
+		me->settings.sampleRate = *outputrate;
+		me->settings.channels = outputchannels;
+		me->settings.format = *outputformat;
+		me->settings.blockFrames = dspbufferlength;
+
+		int sampleBytes;
+
+		switch (*outputformat)
+		{
+			case FMOD_SOUND_FORMAT_PCM8: sampleBytes = 1; break;
+			case FMOD_SOUND_FORMAT_PCM16: sampleBytes = 2; break;
+			case FMOD_SOUND_FORMAT_PCM24: sampleBytes = 3; break;
+			case FMOD_SOUND_FORMAT_PCM32: case FMOD_SOUND_FORMAT_PCMFLOAT: sampleBytes = 4; break;
+			default: return FMOD_ERR_INVALID_PARAM;
+		}
+
+		me->blockBytes = dspbufferlength * outputchannels * sampleBytes;
+
+		unsigned int blocks = 1;
+		while (blocks < me->settings.ringBlocks)
+			blocks <<= 1;
+
+		me->settings.ringBlocks = blocks;
+		me->ringMask = blocks - 1;
+		me->ring.assign(static_cast<size_t>(me->blockBytes) * (me->settings.sink? 1 : blocks), 0);
+		me->scratch.assign(me->blockBytes, 0);
+
+		me->head = 0;
+		me->tail = 0;
+		me->quit = false;
+		me->mixer = std::thread(&MixOutput::run, me);
+		return FMOD_OK;
+	}
+
+	FMOD_RESULT F_CALLBACK MixOutput::close(FMOD_OUTPUT_STATE *output_state)
+	{
+		static_cast<MixOutput *>(output_state->plugindata)->stop();
+		return FMOD_OK;
+	}
+
+	void MixOutput::stop()
+	{
+		quit = true;
+		signal();
+
+		if (mixer.joinable())
+			mixer.join();
+	}
+
+	// Wake the other side. Taking the lock first means a waiter can't miss the change between checking and sleeping
+	void MixOutput::signal()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+		}
+
+		wake.notify_all();
+	}
+
+	// Mixer thread: pull one block at a time from FMOD into the ring or the sink
+	void MixOutput::run()
+	{
+		std::chrono::microseconds blockTime(static_cast<long long>(settings.blockFrames) * 1000000 / settings.sampleRate);
+		std::chrono::steady_clock::time_point due = std::chrono::steady_clock::now();
+
+		while (!quit)
+		{
+			unsigned int h = head.load(std::memory_order_relaxed);
+			bool full = !settings.sink && h - tail.load(std::memory_order_acquire) > ringMask;
+
+			backpressured.store(full, std::memory_order_relaxed);
+
+			if (full && settings.backpressure == MixWait)
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [this, h] { return quit || h - tail.load(std::memory_order_acquire) <= ringMask; });
+
+				// Real-time pacing restarts after a stall rather than catching up
+				due = std::chrono::steady_clock::now();
+				continue;
+			}
+
+			char *block = full? &scratch[0] : &ring[settings.sink? 0 : (h & ringMask) * blockBytes];
+			state->readfrommixer(state, block, settings.blockFrames);
+			framesMixed.fetch_add(settings.blockFrames, std::memory_order_relaxed);
+
+			if (settings.sink)
+				settings.sink(block, settings.blockFrames);
+			else if (full)
+				overruns.fetch_add(1, std::memory_order_relaxed);
+			else
+			{
+				head.store(h + 1, std::memory_order_release);
+				signal();
+			}
+
+			if (settings.realtime)
+			{
+				due += blockTime;
+				std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+				if (due > now)
+					std::this_thread::sleep_until(due);
+				else
+					due = now;
+			}
+		}
+	}
+
+	const void *MixOutput::Acquire() const
+	{
+		unsigned int t = tail.load(std::memory_order_relaxed);
+
+		if (t == head.load(std::memory_order_acquire))
+			return NULL;
+
+		return &ring[(t & ringMask) * blockBytes];
+	}
+
+	void MixOutput::Release()
+	{
+		unsigned int t = tail.load(std::memory_order_relaxed);
+
+		if (t == head.load(std::memory_order_acquire))
+			return;
+
+		tail.store(t + 1, std::memory_order_release);
+
+		// Only a mixer waiting on a full ring needs waking
+		if (settings.backpressure == MixWait)
+			signal();
+	}
+
+	const void *MixOutput::Wait(unsigned int timeoutMs)
+	{
+		std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+		std::unique_lock<std::mutex> guard(lock);
+		const void *block;
+
+		while (!(block = Acquire()))
+			if (wake.wait_until(guard, until) == std::cv_status::timeout)
+				return Acquire();
+
+		return block;
+	}
+
+	// Multiply two buffers, four values at a time
+	static void multiplyBuffers(float *out, const float *a, const float *b, unsigned int count)
+	{
+		unsigned int i = 0;
+
+#ifdef SFMOD_SSE2
+		for (; i + 4 <= count; i += 4)
+			_mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+#endif
+
+		for (; i < count; i++)
+			out[i] = a[i] * b[i];
+	}
+
+	// Add the scaled product of two buffers to an accumulator (overlap-add), four values at a time
+	static void multiplyAdd(float *acc, const float *a, const float *b, float scale, unsigned int count)
+	{
+		unsigned int i = 0;
+
+#ifdef SFMOD_SSE2
+		__m128 s = _mm_set1_ps(scale);
+
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 product = _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)), s);
+			_mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), product));
+		}
+#endif
+
+		for (; i < count; i++)
+			acc[i] += a[i] * b[i] * scale;
+	}
+
+	// Dot product of two buffers, four values at a time
+	static float dotProduct(const float *a, const float *b, unsigned int count)
+	{
+		unsigned int i = 0;
+		float sum = 0.0f;
+
+#ifdef SFMOD_SSE2
+		__m128 acc = _mm_setzero_ps();
+
+		for (; i + 4 <= count; i += 4)
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+
+		float parts[4];
+		_mm_storeu_ps(parts, acc);
+		sum = parts[0] + parts[1] + parts[2] + parts[3];
+#endif
+
+		for (; i < count; i++)
+			sum += a[i] * b[i];
+
+		return sum;
+	}
+
+	// Create the DSP and the buffers which don't depend on the song
+	TimeStretcher::TimeStretcher(SimpleFMOD *fmod, StretchMethod m) : channel(NULL), method(m), baseFrequency(0.0f),
+		sampleRate(fmod->GetSampleRate()), channels(0), latency(0), rover(0), phasesStale(true), segment(0), hop(0),
+		tolerance(0), written(0), produced(0), segmentStart(0), previousStart(0), readPosition(0.0)
+	{
+		tempo = 1.0f;
+		pitch = 1.0f;
+
+		FMOD_DSP_DESCRIPTION desc;
+		memset(&desc, 0, sizeof(FMOD_DSP_DESCRIPTION));
+
+		fmod->MarkUnrecorded("TimeStretcher");
+
+		strcpy(desc.name, "SimpleFMOD time stretch");
+		desc.read = read;
+		desc.userdata = this;
+
+		ErrorCheck(fmod->FMOD()->createDSP(&desc, &dsp));
+
+		if (method == StretchPhaseVocoder)
+		{
+			fft.reset(new FFT(FrameSize));
+
+			// Periodic Hann window: the squared windows of frames at 4x overlap sum to 1.5
+			window.resize(FrameSize);
+
+			for (int i = 0; i < FrameSize; i++)
+				window[i] = static_cast<float>(0.5 - 0.5 * cos(2 * M_PI * i / FrameSize));
+
+			spectrum.resize(FrameSize);
+			frame[0].resize(FrameSize);
+			frame[1].resize(FrameSize);
+			shifted[0].resize(Bins);
+			shifted[1].resize(Bins);
+			magnitude.resize(Bins);
+			phase.resize(Bins);
+			trueBin.resize(Bins);
+			peaks.reserve(Bins);
+
+			latency = FrameSize - FrameSize / Overlap;
+		}
+		else
+		{
+			// 20ms segments at half overlap (periodic Hann windows summing to 1), searched a quarter segment either way
+			hop = max(sampleRate / 100, 64);
+			segment = hop * 2;
+			tolerance = segment / 4;
+
+			segmentWindow.resize(segment);
+
+			for (unsigned int i = 0; i < segment; i++)
+				segmentWindow[i] = static_cast<float>(0.5 - 0.5 * cos(2 * M_PI * i / segment));
+
+			// Reference, candidates and their running energy for the search, and one segment of one channel
+			scratch.resize(hop + 2 * (2 * tolerance + hop) + 1 + segment);
+
+			// Enough input to search a whole segment past where the resampler will read, at the highest shift ratio
+			latency = segment + tolerance + 4;
+		}
+	}
+
+	TimeStretcher::~TimeStretcher()
+	{
+		Detach();
+		dsp->release();
+	}
+
+	// Clear the per channel state for a new channel
+	void TimeStretcher::reset()
+	{
+		if (method == StretchPhaseVocoder)
+		{
+			inFifo.assign(channels * FrameSize, 0.0f);
+			outFifo.assign(channels * FrameSize, 0.0f);
+			accumulator.assign(channels * FrameSize, 0.0f);
+			lastPhase.assign(channels * Bins, 0.0f);
+			synthesisPhase.assign(channels * Bins, 0.0f);
+			rover = latency;
+			phasesStale = true;
+		}
+		else
+		{
+			history.assign(channels * HistorySize, 0.0f);
+			mono.assign(HistorySize, 0.0f);
+			stretched.assign(channels * StretchSize, 0.0f);
+			written = produced = segmentStart = previousStart = 0;
+			readPosition = 0.0;
+		}
+	}
+
+	// Start processing a song's channel
+	bool TimeStretcher::Attach(Song &song)
+	{
+		Detach();
+
+		FMOD::Channel *c = song.GetChannel();
+		int soundChannels = 0;
+
+		if (!c || !song.Get() || song.Get()->getFormat(0, 0, &soundChannels, 0) != FMOD_OK || soundChannels < 1 || soundChannels > MaxChannels)
+			return false;
+
+		if (c->getFrequency(&baseFrequency) != FMOD_OK)
+			return false;
+
+		// The DSP isn't connected yet, so the mixer thread can't see the buffers change
+		channels = soundChannels;
+		reset();
+
+		channel = c;
+		ErrorCheck(channel->addDSP(dsp, 0));
+		channel->setFrequency(baseFrequency * tempo);
+		return true;
+	}
+
+	// Stop processing, returning the channel to its own speed
+	void TimeStretcher::Detach()
+	{
+		if (!channel)
+			return;
+
+		dsp->remove();
+		channel->setFrequency(baseFrequency);
+		channel = NULL;
+	}
+
+	void TimeStretcher::SetTempo(float ratio)
+	{
+		tempo = ratio < 0.25f? 0.25f : ratio > 4.0f? 4.0f : ratio;
+
+		if (channel)
+			channel->setFrequency(baseFrequency * tempo);
+	}
+
+	void TimeStretcher::SetPitch(float ratio)
+	{
+		pitch = ratio < 0.25f? 0.25f : ratio > 4.0f? 4.0f : ratio;
+	}
+
+	// Pitch shift left for the DSP once the channel's frequency has applied the tempo
+	float TimeStretcher::shiftRatio() const
+	{
+		float shift = pitch.load() / tempo.load();
+		return shift < 0.25f? 0.25f : shift > 4.0f? 4.0f : shift;
+	}
+
+	FMOD_RESULT F_CALLBACK TimeStretcher::read(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer, unsigned int length, int inchannels, int outchannels)
+	{
+		TimeStretcher *me;
+		reinterpret_cast<FMOD::DSP *>(dsp_state->instance)->getUserData(reinterpret_cast<void **>(&me));
+
+		// Only the layout prepared by Attach() is processed
+		if (inchannels != me->channels || outchannels != inchannels)
+		{
+			memcpy(outbuffer, inbuffer, length * outchannels * sizeof(float));
+			return FMOD_OK;
+		}
+
+		if (me->method == StretchPhaseVocoder)
+			me->vocode(inbuffer, outbuffer, length);
+		else
+			me->similarityOverlapAdd(inbuffer, outbuffer, length);
+
+		return FMOD_OK;
+	}
+
+	// Phase vocoder: stream through the FIFOs, processing a frame every FrameSize / Overlap samples
+	void TimeStretcher::vocode(const float *in, float *out, unsigned int length)
+	{
+		float shift = shiftRatio();
+		unsigned int done = 0;
+
+		while (done < length)
+		{
+			unsigned int count = length - done;
+
+			if (count > FrameSize - rover)
+				count = FrameSize - rover;
+
+			for (int c = 0; c < channels; c++)
+			{
+				float *fifoIn = &inFifo[c * FrameSize + rover];
+				const float *fifoOut = &outFifo[c * FrameSize + rover - latency];
+
+				for (unsigned int i = 0; i < count; i++)
+				{
+					fifoIn[i] = in[(done + i) * channels + c];
+					out[(done + i) * channels + c] = fifoOut[i];
+				}
+			}
+
+			done += count;
+			rover += count;
+
+			// Stereo pairs share a transform
+			if (rover == FrameSize)
+			{
+				rover = latency;
+
+				for (int c = 0; c < channels; c += 2)
+					vocodeFrame(c, min(channels - c, 2), shift);
+
+				phasesStale = fabs(shift - 1.0f) < 0.0001f;
+			}
+		}
+	}
+
+	// Shift one frame of one or two channels
+	void TimeStretcher::vocodeFrame(int first, int count, float shift)
+	{
+		const int step = FrameSize / Overlap;
+		const float twoPi = static_cast<float>(2 * M_PI);
+
+		for (int p = 0; p < count; p++)
+			multiplyBuffers(&frame[p][0], &inFifo[(first + p) * FrameSize], &window[0], FrameSize);
+
+		// No shift: overlap-add the windowed input, which is what an unmodified spectrum would give
+		if (fabs(shift - 1.0f) < 0.0001f)
+		{
+			for (int p = 0; p < count; p++)
+				multiplyAdd(&accumulator[(first + p) * FrameSize], &frame[p][0], &window[0], 1.0f / 1.5f, FrameSize);
+		}
+		else
+		{
+			// Two real channels in one complex transform: one as the real part, one as the imaginary part
+			for (int i = 0; i < FrameSize; i++)
+				spectrum[i] = std::complex<float>(frame[0][i], count > 1? frame[1][i] : 0.0f);
+
+			fft->Transform(&spectrum[0]);
+
+			for (int p = 0; p < count; p++)
+			{
+				float *last = &lastPhase[(first + p) * Bins];
+				float *synthesis = &synthesisPhase[(first + p) * Bins];
+				std::complex<float> *out = &shifted[p][0];
+
+				// Separate this channel's half spectrum, and find each bin's true frequency from its phase advance
+				for (int k = 0; k < Bins; k++)
+				{
+					std::complex<float> a = spectrum[k];
+					std::complex<float> b = std::conj(spectrum[(FrameSize - k) & (FrameSize - 1)]);
+					std::complex<float> x = (p == 0)? (a + b) * 0.5f : (a - b) * std::complex<float>(0.0f, -0.5f);
+
+					magnitude[k] = std::abs(x);
+					phase[k] = std::arg(x);
+
+					float deviation = phase[k] - last[k] - twoPi * k / Overlap;
+					deviation -= twoPi * static_cast<float>(floor(deviation / twoPi + 0.5f));
+
+					// Without the previous frame's phases, take each bin at its centre frequency and restart the
+					// synthesis phases from the input's, so the output carries on from the unshifted signal
+					if (phasesStale)
+					{
+						deviation = 0.0f;
+						synthesis[k] = phase[k];
+					}
+
+					last[k] = phase[k];
+					trueBin[k] = k + deviation * Overlap / twoPi;
+				}
+
+				// Peaks: local maxima above the noise floor
+				float loudest = *std::max_element(magnitude.begin(), magnitude.end());
+				peaks.clear();
+
+				for (int k = 2; k < Bins - 2; k++)
+					if (magnitude[k] > loudest * 0.0001f && magnitude[k] > magnitude[k - 1] && magnitude[k] >= magnitude[k + 1]
+						&& magnitude[k] > magnitude[k - 2] && magnitude[k] >= magnitude[k + 2])
+						peaks.push_back(k);
+
+				// Move each peak's region (halfway to the neighbouring peaks) to the shifted peak frequency. The peak's
+				// phase advances at its new frequency and the rest of the region keeps its phase relative to the peak
+				// (identity phase locking), so each partial keeps its shape instead of smearing
+				std::fill(out, out + Bins, std::complex<float>(0.0f, 0.0f));
+
+				for (size_t n = 0; n < peaks.size(); n++)
+				{
+					int peak = peaks[n];
+					int target = static_cast<int>(peak * shift + 0.5f);
+
+					if (target >= Bins)
+						break;
+
+					int from = (n == 0)? 0 : (peaks[n - 1] + peak) / 2 + 1;
+					int to = (n + 1 == peaks.size())? Bins - 1 : (peak + peaks[n + 1]) / 2;
+					float peakPhase = phasesStale? phase[peak] : synthesis[target] + twoPi * trueBin[peak] * shift / Overlap;
+
+					for (int k = from; k <= to; k++)
+					{
+						int j = k + target - peak;
+
+						if (j >= 0 && j < Bins)
+							out[j] += std::polar(magnitude[k], peakPhase + phase[k] - phase[peak]);
+					}
+				}
+
+				// Remember the phases for the next frame; empty bins carry on at their own frequency
+				for (int j = 0; j < Bins; j++)
+				{
+					if (out[j] != std::complex<float>(0.0f, 0.0f))
+						synthesis[j] = std::arg(out[j]);
+					else
+					{
+						synthesis[j] += twoPi * j / Overlap;
+						synthesis[j] -= twoPi * static_cast<float>(floor(synthesis[j] / twoPi));
+					}
+				}
+
+				// DC and Nyquist of a real signal are real
+				out[0] = std::complex<float>(out[0].real(), 0.0f);
+				out[Bins - 1] = std::complex<float>(out[Bins - 1].real(), 0.0f);
+			}
+
+			// Recombine the half spectra into one complex spectrum and transform back
+			const std::complex<float> i(0.0f, 1.0f);
+
+			for (int k = 0; k < Bins; k++)
+			{
+				std::complex<float> a = shifted[0][k];
+				std::complex<float> b = (count > 1)? shifted[1][k] : std::complex<float>(0.0f, 0.0f);
+
+				spectrum[k] = a + i * b;
+
+				if (k > 0 && k < Bins - 1)
+					spectrum[FrameSize - k] = std::conj(a) + i * std::conj(b);
+			}
+
+			fft->Transform(&spectrum[0], true);
+
+			for (int n = 0; n < FrameSize; n++)
+			{
+				frame[0][n] = spectrum[n].real();
+				frame[1][n] = spectrum[n].imag();
+			}
+
+			// Synthesis window, scaled for the unscaled inverse transform and the overlapping windows
+			for (int p = 0; p < count; p++)
+				multiplyAdd(&accumulator[(first + p) * FrameSize], &frame[p][0], &window[0], 1.0f / (1.5f * FrameSize), FrameSize);
+		}
+
+		// Hand the finished step to the output FIFO, and move the accumulator and input on by one step
+		for (int p = 0; p < count; p++)
+		{
+			float *acc = &accumulator[(first + p) * FrameSize];
+			float *fifo = &inFifo[(first + p) * FrameSize];
+
+			memcpy(&outFifo[(first + p) * FrameSize], acc, step * sizeof(float));
+			memmove(acc, acc + step, (FrameSize - step) * sizeof(float));
+			memset(acc + FrameSize - step, 0, step * sizeof(float));
+			memmove(fifo, fifo + step, latency * sizeof(float));
+		}
+	}
+
+	// WSOLA: keep the input history, build the stretched signal a segment at a time as the resampler needs it, and
+	// resample it by the shift ratio, which brings it back to the pace of the input at the shifted pitch
+	void TimeStretcher::similarityOverlapAdd(const float *in, float *out, unsigned int length)
+	{
+		float shift = shiftRatio();
+
+		for (unsigned int i = 0; i < length; i++, written++)
+		{
+			unsigned int slot = static_cast<unsigned int>(written) & (HistorySize - 1);
+			float sum = 0.0f;
+
+			for (int c = 0; c < channels; c++)
+			{
+				history[c * HistorySize + slot] = in[i * channels + c];
+				sum += in[i * channels + c];
+			}
+
+			mono[slot] = sum;
+		}
+
+		for (unsigned int i = 0; i < length; i++, produced++)
+		{
+			float *frameOut = out + i * channels;
+			long long index = static_cast<long long>(readPosition);
+
+			// Silence until enough input has arrived
+			if (produced < latency)
+			{
+				memset(frameOut, 0, channels * sizeof(float));
+				continue;
+			}
+
+			// Interpolation needs both neighbours complete: everything before segmentStart is
+			while (index + 1 >= segmentStart && addSegment(shift))
+				;
+
+			if (index + 1 >= segmentStart)
+			{
+				memset(frameOut, 0, channels * sizeof(float));
+				continue;
+			}
+
+			float fraction = static_cast<float>(readPosition - index);
+			unsigned int a = static_cast<unsigned int>(index) & (StretchSize - 1);
+			unsigned int b = static_cast<unsigned int>(index + 1) & (StretchSize - 1);
+
+			for (int c = 0; c < channels; c++)
+			{
+				const float *s = &stretched[c * StretchSize];
+				frameOut[c] = s[a] + (s[b] - s[a]) * fraction;
+			}
+
+			readPosition += shift;
+		}
+	}
+
+	// Add the next segment of the stretched signal: the stretch of input which best continues the previous segment,
+	// searched around where the resampler's position says it should come from. Returns false if that input hasn't
+	// arrived yet
+	bool TimeStretcher::addSegment(float shift)
+	{
+		// Input for the stretched signal at segmentStart, given when the resampler will get there. Deriving this from
+		// the resampler rather than accumulating hops keeps input and output in step as the ratio changes
+		long long nominal = produced - latency + static_cast<long long>((segmentStart - readPosition) / shift);
+
+		if (nominal + tolerance + segment > written)
+			return false;
+
+		long long best = nominal;
+
+		// The candidate most like the natural continuation of the previous segment (normalised cross-correlation of
+		// the mono mix over the overlap), searched every other offset and then refined. The first segment has
+		// nothing to continue
+		if (segmentStart > 0)
+		{
+			unsigned int span = 2 * tolerance + hop;
+			float *reference = &scratch[0];
+			float *candidates = reference + hop;
+			float *energy = candidates + span;
+
+			for (unsigned int i = 0; i < hop; i++)
+				reference[i] = mono[static_cast<unsigned int>(previousStart + hop + i) & (HistorySize - 1)];
+
+			for (unsigned int i = 0; i < span; i++)
+				candidates[i] = mono[static_cast<unsigned int>(nominal - tolerance + i) & (HistorySize - 1)];
+
+			// Running sums of squares, so each candidate's energy is a difference
+			energy[0] = 0.0f;
+
+			for (unsigned int i = 0; i < span; i++)
+				energy[i + 1] = energy[i] + candidates[i] * candidates[i];
+
+			unsigned int bestOffset = tolerance;
+			float bestScore = -1e30f;
+
+			for (int pass = 0; pass < 2; pass++)
+			{
+				unsigned int from = (pass == 0)? 0 : (bestOffset > 0? bestOffset - 1 : 0);
+				unsigned int to = (pass == 0)? 2 * tolerance : (bestOffset < 2 * tolerance? bestOffset + 1 : bestOffset);
+				unsigned int stride = (pass == 0)? 2 : 1;
+
+				for (unsigned int offset = from; offset <= to; offset += stride)
+				{
+					float score = dotProduct(reference, candidates + offset, hop) / sqrt(energy[offset + hop] - energy[offset] + 1e-9f);
+
+					if (score > bestScore)
+					{
+						bestScore = score;
+						bestOffset = offset;
+					}
+				}
+			}
+
+			best = nominal - tolerance + bestOffset;
+		}
+
+		previousStart = best;
+
+		unsigned int start = static_cast<unsigned int>(segmentStart) & (StretchSize - 1);
+		unsigned int first = (segment < StretchSize - start)? segment : StretchSize - start;
+		float *copy = &scratch[scratch.size() - segment];
+
+		for (int c = 0; c < channels; c++)
+		{
+			const float *h = &history[c * HistorySize];
+			float *s = &stretched[c * StretchSize];
+
+			for (unsigned int i = 0; i < segment; i++)
+				copy[i] = h[static_cast<unsigned int>(best + i) & (HistorySize - 1)];
+
+			// The second half of the segment's span has nothing in it yet
+			for (unsigned int i = hop; i < segment; i++)
+				s[static_cast<unsigned int>(segmentStart + i) & (StretchSize - 1)] = 0.0f;
+
+			multiplyAdd(s + start, copy, &segmentWindow[0], 1.0f, first);
+			multiplyAdd(s, copy + first, &segmentWindow[first], 1.0f, segment - first);
+		}
+
+		segmentStart += hop;
+		return true;
 	}
 }
@@ -5,6 +5,18 @@
 #include <list>
 #include <algorithm> // for find
 #include <memory> // for unique_ptr in VS2012
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <mutex>
+#include <functional> // for greater
+#include <condition_variable>
+#include <queue>
+#include <deque>
+#include <chrono>
+#include <complex>
 
 #define _USE_MATH_DEFINES
 
@@ -15,29 +27,367 @@ namespace SFMOD
 	class SimpleFMODResource;
 	class Song;
 	class SoundEffect;
+	class WaveformCache;
+	class MeterTap;
+	class Spectrogram;
+	class FingerprintIndex;
+	class Playlist;
+	class Crossfader;
+	class Ducker;
+	class EmitterSystem;
+	class VoiceManager;
+	class Sequencer;
+	class AsyncFileSystem;
+	class Preloader;
+	class OutputCapture;
+	class RenderFarm;
+	class MixOutput;
+	template <typename T, unsigned int Capacity> class SPSCQueue;
+	class FFT;
+	class TimeStretcher;
 
-	// Main API. Create a single instance of SimpleFMOD in your application
+	// Built-in fade curves. Each gives the gain of the incoming sound at a point from 0.0f - 1.0f through the fade;
+	// the outgoing sound uses the mirror image
+	enum FadeCurve { FadeLinear, FadeEqualPower, FadeSineSquared };
+
+	// User-defined fade curve (called on the mixer thread, so it must not block)
+	typedef float (*FadeCurveFunction)(float progress);
+
+	// Handle to a mix bus (see SimpleFMOD::CreateBus())
+	struct Bus
+	{
+		int id;
+
+		Bus() : id(-1) {}
+		explicit Bus(int i) : id(i) {}
+
+		bool IsValid() const { return id >= 0; }
+	};
+
+	// How a sound effect is held in memory. LoadAuto lets SimpleFMOD choose from the asset and the memory budget
+	enum LoadMode { LoadAuto, LoadDecoded, LoadCompressed, LoadStream, LoadModeCount };
+
+	// One entry of a SimpleFMOD::PlayMany() batch
+	struct PlayRequest
+	{
+		SoundEffect *effect;
+
+		// Bus to play on (invalid: the effect's own channel group)
+		Bus bus;
+
+		// Channel volume and playback rate multiplier
+		float volume;
+		float pitch;
+
+		// Start offset from the batch's start clock, in DSP clock ticks (output samples)
+		unsigned int delay;
+
+		PlayRequest() : effect(NULL), volume(1.0f), pitch(1.0f), delay(0) {}
+		PlayRequest(SoundEffect &e, float v = 1.0f, float p = 1.0f, unsigned int d = 0, Bus b = Bus()) : effect(&e), bus(b), volume(v), pitch(p), delay(d) {}
+	};
+
+	// Statistics of one SimpleFMOD::Update()
+	struct FrameStats
+	{
+		// Update number, and when it started (microseconds since SimpleFMOD was created)
+		unsigned long long frame;
+		double startUs;
+
+		// Wall time spent in FMOD's update and in resource updates
+		double systemUpdateUs;
+		double resourceUpdateUs;
+
+		// FMOD CPU usage (percent)
+		float dspCPU;
+		float streamCPU;
+		float updateCPU;
+		float totalCPU;
+
+		// Channels playing, resources updated and resources whose streams are starving
+		int channelsPlaying;
+		int resourcesUpdated;
+		int starvingStreams;
+
+		// FMOD memory currently and at most allocated
+		int memoryCurrent;
+		int memoryMax;
+	};
+
+	// Number of allocation size classes in MemoryStats: 16 bytes doubling up to 64KB, then everything larger
+	const int MemorySizeClasses = 14;
+
+	// Memory use of a MemoryPolicy
+	struct MemoryStats
+	{
+		// Bytes in use now and at most, and the limit (0: none)
+		size_t current;
+		size_t peak;
+		size_t budget;
+
+		// Allocations made and refused
+		unsigned int allocations;
+		unsigned int failures;
+
+		// Live blocks per size class, now and at most
+		unsigned int classCount[MemorySizeClasses];
+		unsigned int classPeak[MemorySizeClasses];
+	};
+
+	// MemoryPolicy: Where FMOD gets its memory. Pass one to the SimpleFMOD constructor, which installs it with
+	// FMOD::Memory_Initialize() before the FMOD system is created. FMOD allows this once per process (so the first
+	// instance's policy is shared by any others), and the policy must outlive SimpleFMOD. Allocations over budget fail: FMOD then returns FMOD_ERR_MEMORY, and sounds that
+	// cannot be loaded or played are skipped rather than ending the program
+	class MemoryPolicy
+	{
+	protected:
+		// FMOD allocates from several threads
+		std::mutex lock;
+		MemoryStats stats;
+
+		// Account for a block: reserve() returns false if it would exceed the budget
+		bool reserve(size_t size);
+		void released(size_t size);
+
+	public:
+		MemoryPolicy(size_t budget);
+		virtual ~MemoryPolicy() {}
+
+		// A block of memory for FMOD to manage itself, or NULL to have FMOD call Alloc(), Realloc() and Free()
+		virtual void *GetPool(int &length) { length = 0; return NULL; }
+
+		virtual void *Alloc(unsigned int size) = 0;
+		virtual void *Realloc(void *ptr, unsigned int size) = 0;
+		virtual void Free(void *ptr) = 0;
+
+		virtual MemoryStats GetStats();
+
+		// Size class of an allocation size
+		static int SizeClass(size_t size);
+	};
+
+	// Fixed arena handed to FMOD's own allocator. Nothing is allocated from the system heap after start-up.
+	// Only current and peak use are known (from FMOD::Memory_GetStats())
+	class FixedArenaPolicy : public MemoryPolicy
+	{
+	private:
+		std::unique_ptr<char[]> arena;
+		int length;
+
+	public:
+		FixedArenaPolicy(size_t bytes);
+
+		virtual void *GetPool(int &poolLength) { poolLength = length; return arena.get(); }
+
+		virtual void *Alloc(unsigned int) { return NULL; }
+		virtual void *Realloc(void *, unsigned int) { return NULL; }
+		virtual void Free(void *) {}
+
+		virtual MemoryStats GetStats();
+	};
+
+	// System heap with statistics and an optional budget
+	class TrackingPolicy : public MemoryPolicy
+	{
+	public:
+		TrackingPolicy(size_t budget = 0) : MemoryPolicy(budget) {}
+
+		virtual void *Alloc(unsigned int size);
+		virtual void *Realloc(void *ptr, unsigned int size);
+		virtual void Free(void *ptr);
+	};
+
+	// Size-class pools: blocks up to 4KB come from per-class free lists carved out of 64KB slabs, which are kept for
+	// reuse rather than returned to the heap, so steady-state allocation never fragments or calls malloc.
+	// Larger blocks go to the system heap. The budget counts blocks at their class size
+	class SizeClassPolicy : public MemoryPolicy
+	{
+	private:
+		static const int PooledClasses = 9;
+		static const size_t SlabSize = 65536;
+
+		std::vector<void *> freeLists;
+		std::vector<void *> slabs;
+
+	public:
+		SizeClassPolicy(size_t budget = 0);
+		~SizeClassPolicy();
+
+		virtual void *Alloc(unsigned int size);
+		virtual void *Realloc(void *ptr, unsigned int size);
+		virtual void Free(void *ptr);
+	};
+
+	// Options for creating SimpleFMOD
+	struct SimpleFMODSettings
+	{
+		// Where FMOD gets its memory (see MemoryPolicy)
+		MemoryPolicy *memoryPolicy;
+
+		// Mix without a sound card, one block per Update(), as fast as Update() is called. Fades and other timing
+		// follow the DSP clock instead of the wall clock, so runs are repeatable
+		bool nonRealtime;
+
+		// Record API calls to this file from the start (see StartRecording())
+		const char *recordFile;
+
+		// Deliver the mix to this instead of the sound card (see MixOutput). Ignored when nonRealtime is set
+		MixOutput *mixOutput;
+
+		// Collect FrameStats from the start (see SimpleFMOD::EnableTelemetry())
+		bool telemetry;
+
+		SimpleFMODSettings() : memoryPolicy(NULL), nonRealtime(false), recordFile(NULL), mixOutput(NULL), telemetry(false) {}
+	};
+
+	// Results of SimpleFMOD::Replay()
+	struct ReplayStats
+	{
+		unsigned long long commands;
+		unsigned long long updates;
+
+		// Wall time of the whole replay, and of each Update()
+		double wallMs;
+		double meanUpdateUs;
+		double maxUpdateUs;
+
+		// Samples mixed and a hash of the master output
+		unsigned long long samplesMixed;
+		unsigned long long outputHash;
+
+		// Objects whose calls weren't recorded (see SimpleFMOD::StartRecording()). If not 0, the replay didn't
+		// reproduce the recorded session
+		int unrecorded;
+	};
+
+	// Main API. Create a single instance of SimpleFMOD in your application to play sound. For offline rendering,
+	// several non-realtime instances can run side by side, each used from one thread only (see RenderFarm)
 	class SimpleFMOD
 	{
-		// Allow resources to access registerResource() and unregisterResource()
+		// Allow resources to register and schedule their updates
 		friend class SimpleFMODResource;
 
+		// Allow sound effects to release their share of the memory budget
+		friend class SoundEffect;
+
+		// Allow warm-up to create buses and account for the sounds it loads
+		friend class Preloader;
+
+		// Allow songs to record their API calls
+		friend class Song;
+
 	public:
-		SimpleFMOD();
+		// Optionally pass a MemoryPolicy to control FMOD's memory (see above)
+		SimpleFMOD(MemoryPolicy *memoryPolicy = NULL);
+		SimpleFMOD(const SimpleFMODSettings &settings);
 		~SimpleFMOD();
 
 		// Return pointer to FMOD API
 		FMOD::System *FMOD() { return system; }
 
+		// Return the built-in channel groups
+		FMOD::ChannelGroup *GetMusicChannelGroup() { return channelMusic; }
+		FMOD::ChannelGroup *GetEffectsChannelGroup() { return channelEffects; }
+
+		// Mix buses: a tree of named channel groups (the built-in "music" and "effects" buses hang off the master).
+		// Volume, mute and pause state is cached so reads are free; writes are deduplicated and sent to FMOD once per Update()
+		Bus CreateBus(const char *name, Bus parent = Bus());
+		Bus FindBus(const char *name) const;
+		Bus GetMusicBus() const { return Bus(0); }
+		Bus GetEffectsBus() const { return Bus(1); }
+		FMOD::ChannelGroup *GetBusChannelGroup(Bus bus) { return validBus(bus)? busGroups[bus.id] : NULL; }
+
+		// Route a copy of one bus's output into another at a given level. Returns the send number (-1 for an unknown bus)
+		int AddSend(Bus from, Bus to, float level);
+		void SetSendLevel(int send, float level);
+
+		// Create buses and sends from a text file with lines of the form:
+		//   bus <name> [<parent> [<volume>]]   (use - for no parent)
+		//   send <from> <to> <level>
+		bool LoadBusConfig(const char *filename);
+
+		// Bus state. Unknown buses (such as FindBus() returns for a name not found) are ignored, and read as silent
+		void SetBusVolume(Bus bus, float volume);
+		void SetBusMute(Bus bus, bool mute);
+		void SetBusPaused(Bus bus, bool paused);
+		float GetBusVolume(Bus bus) const { return validBus(bus)? busVolume[bus.id] : 0.0f; }
+		bool GetBusMute(Bus bus) const { return validBus(bus) && busMute[bus.id] != 0; }
+		bool GetBusPaused(Bus bus) const { return validBus(bus) && busPaused[bus.id] != 0; }
+
 		// Per frame update
 		void Update();
 
+		// Collect statistics in each update. Off by default, since they cost several FMOD calls and a check of
+		// every playing stream per frame
+		void EnableTelemetry(bool enable) { telemetryEnabled = enable; }
+		bool IsTelemetryEnabled() const { return telemetryEnabled; }
+
+		// Statistics of recent updates: 'age' 0 is the last update. Up to GetFrameStatsCount() frames are kept
+		// (none before the first update with telemetry enabled)
+		const FrameStats &GetFrameStats(int age = 0) const { return telemetry[(telemetryFrames - 1 - age) % TelemetryFrames]; }
+		int GetFrameStatsCount() const { return telemetryFrames < TelemetryFrames? static_cast<int>(telemetryFrames) : TelemetryFrames; }
+
+		// Write the kept frames as a Chrome trace (load in chrome://tracing or Perfetto)
+		bool WriteChromeTrace(const char *filename) const;
+
+		// Get the current DSP clock (in output samples since the mixer started) and the output sample rate
+		unsigned long long GetDSPClock();
+		int GetSampleRate() const { return sampleRate; }
+
+		// DSP clock read at the start of the last Update() (no FMOD call; use for per-frame bookkeeping)
+		unsigned long long GetFrameClock() const { return frameClock; }
+
+		// Milliseconds for timing fades: the tick count, or the DSP clock when running non-realtime
+		unsigned int GetTimeMs() const;
+
+		// Record the calls made on SimpleFMOD, Song and SoundEffect objects (loads, plays, fades, volumes, buses
+		// and update ticks), with timestamps, to a compact binary log. PlayQuantized() is recorded as the PlayAt() it
+		// makes. Nothing else is recorded: songs loaded from memory or resources, calls on FMOD channels, and the
+		// Playlist, Ducker, EmitterSystem, VoiceManager, Sequencer and TimeStretcher classes. Creating one of those
+		// classes while recording marks the recording (see ReplayStats::unrecorded); so can your own classes.
+		// Buses and sends that already exist, and their state, are written at the start
+		bool StartRecording(const char *filename);
+		void StopRecording();
+		bool IsRecording() const { return recordFile != NULL; }
+		void MarkUnrecorded(const char *type);
+
+		// Drive a new non-realtime instance (created with 'settings') from a recording as fast as possible, measuring
+		// each update and hashing the mixed output. Returns false if the file can't be read
+		static bool Replay(const char *filename, ReplayStats &stats, const SimpleFMODSettings &settings = SimpleFMODSettings());
+
 		// Load and register resources
 		Song LoadSong(const char *data, FMOD::ChannelGroup *channelGroup, FMOD_MODE mode, FMOD_CREATESOUNDEXINFO info);
 		Song LoadSong(const char *filename, FMOD_MODE mode = FMOD_DEFAULT);
 		Song LoadSong(int resourceId, LPCTSTR resourceType, FMOD_MODE mode = 0);
 		SoundEffect LoadSoundEffect(const char *filename, FMOD_MODE mode = FMOD_DEFAULT);
 		SoundEffect LoadSoundEffect(int resourceId, LPCTSTR resourceType, FMOD_MODE mode = 0);
+		Song LoadSong(const char *filename, Bus bus, FMOD_MODE mode = FMOD_DEFAULT);
+		SoundEffect LoadSoundEffect(const char *filename, Bus bus, FMOD_MODE mode = FMOD_DEFAULT);
+
+		// Load a sound effect as decoded PCM (cheapest to play), a compressed sample (decoded as it plays, smallest
+		// for many voices) or a stream (one voice, almost no memory). With LoadAuto the mode is chosen from the decoded
+		// size, file size and duration of the asset, how often it is expected to play and what is left of the memory budget
+		SoundEffect LoadSoundEffect(const char *filename, LoadMode loadMode, float playsPerMinute = 0.0f, Bus bus = Bus(), FMOD_MODE mode = FMOD_DEFAULT);
+
+		// Memory budget for sound effect sample data (0: unlimited) and bytes currently resident per load mode
+		void SetMemoryBudget(size_t bytes) { memoryBudget = bytes; }
+		size_t GetMemoryBudget() const { return memoryBudget; }
+		size_t GetResidentBytes(LoadMode loadMode) const { return residentBytes[loadMode]; }
+		size_t GetResidentBytes() const;
+
+		// Crossfade the music from whatever is playing to a new stream. The stream is opened in the background,
+		// started on the DSP clock and faded sample-accurately; the outgoing stream is closed when the fade ends.
+		// During a fade, the stream fading out is ramped out within 50ms first and the new fade starts from the current level
+		void CrossfadeTo(const char *filename, int ms, FadeCurve curve = FadeEqualPower, FMOD_MODE mode = FMOD_DEFAULT);
+		void CrossfadeTo(const char *filename, int ms, FadeCurveFunction curve, FMOD_MODE mode = FMOD_DEFAULT);
+
+		// Start a batch of sound effects in one pass. Every voice is set up paused and released together, starting
+		// sample-aligned at 'startClock' (0: as soon as possible) plus its own delay. Each effect's PlaybackPolicy applies.
+		// Requests with a pitch of zero or less are dropped. If 'channels' is given it receives one entry per request
+		// (NULL if dropped or failed). Returns the start clock
+		unsigned long long PlayMany(const PlayRequest *requests, int count, FMOD::Channel **channels = NULL, unsigned long long startClock = 0);
+
+		// Channel of the music most recently started by CrossfadeTo()
+		FMOD::Channel *GetCrossfadeChannel();
 
 		// Volume controls
 		void SetMasterVolumeMusic(float vol);
@@ -49,16 +399,121 @@ namespace SFMOD
 		// FMOD API
 		FMOD::System *system;
 
-		// List of managed FMOD sounds
-		std::list<SimpleFMODResource *> updateableResources;
+		// Output sample rate (for converting times to DSP clock ticks)
+		int sampleRate;
 
-		// Register/unregister a sound
-		void registerResource(SimpleFMODResource *);
+		// DSP clock at the start of the current frame
+		unsigned long long frameClock;
+
+		// Set up FMOD (shared by the constructors)
+		void init(const SimpleFMODSettings &settings);
+		bool nonRealtime;
+
+		// Fades follow the DSP clock because mixing isn't paced by a sound card
+		bool dspTime;
+
+		// API call recording. Each record is a varint microsecond delta from the previous one, a command and its arguments
+		FILE *recordFile;
+		std::vector<unsigned char> recordBuffer;
+		long long recordLast;
+		unsigned int recordIds;
+
+		void record(int command);
+		void recordData(const void *data, size_t size);
+		template <typename T> void recordValue(T value) { recordData(&value, sizeof(T)); }
+		void recordString(const char *s);
+		void recordLoad(SimpleFMODResource &resource, bool song, const char *filename, FMOD_MODE mode, Bus bus, int loadMode, float playsPerMinute);
+		void recordBuses();
+		void flushRecording();
+		bool replay(const std::vector<unsigned char> &data, ReplayStats &stats);
+
+		// Lead time for sounds started on the DSP clock, so that they cannot be scheduled in a block already mixed
+		unsigned int startLatency;
+
+		// Sound effect memory accounting
+		size_t memoryBudget;
+		size_t residentBytes[LoadModeCount];
+
+		LoadMode chooseLoadMode(const char *filename, float playsPerMinute, FMOD_MODE mode);
+		void account(SoundEffect &effect, LoadMode loadMode, bool add);
+
+		// Apply one line of a bus configuration (see LoadBusConfig())
+		void busConfigLine(const char *line);
+
+		// Channels started by the PlayMany() batch being set up
+		std::vector<FMOD::Channel *> batch;
+
+		// Resources whose Update() is called every frame. Each resource knows its index, so leaving is O(1).
+		// While the update loop runs, leaving only clears the slot, and the holes are closed after the loop
+		std::vector<SimpleFMODResource *> activeResources;
+		bool updatingResources;
+		bool activeHoles;
+
+		// Resources playing streams, checked for starvation every frame while telemetry is enabled (see FrameStats)
+		std::vector<SimpleFMODResource *> streamResources;
+
+		// Hierarchical timer wheel of sleeping resources, in GetTimeMs() time. Level 0 has one slot per millisecond and
+		// each slot of a level spans the whole level below; a level's next slot is spread over the levels below when
+		// the level below wraps. Slots are lists linked through the resources, so waking and cancelling are O(1)
+		static const int WheelLevels = 4;
+		static const int WheelBits = 6;
+		static const int WheelSlots = 1 << WheelBits;
+		SimpleFMODResource *wheel[WheelLevels][WheelSlots];
+		unsigned int wheelTime;
+		int timerCount;
+
+		// Register/unregister a resource, or hand its registration to the object it is moved into
+		void registerResource(SimpleFMODResource *, bool active);
 		void unregisterResource(SimpleFMODResource *);
+		void moveResource(SimpleFMODResource *from, SimpleFMODResource *to);
+		void watchStream(SimpleFMODResource *);
+
+		// Update scheduling (see SimpleFMODResource)
+		void activate(SimpleFMODResource *);
+		void deactivate(SimpleFMODResource *);
+		void schedule(SimpleFMODResource *, unsigned int timeMs);
+		void scheduleClock(SimpleFMODResource *, unsigned long long clock);
+		void cancelTimer(SimpleFMODResource *);
+		void advanceTimers(unsigned int timeMs);
 
-		// Channel groups
+		// Channel groups of the built-in buses
 		FMOD::ChannelGroup *channelMusic;
 		FMOD::ChannelGroup *channelEffects;
+
+		// Mix buses, stored as flat arrays indexed by bus id
+		std::vector<std::string> busNames;
+		std::vector<int> busParents;
+		std::vector<FMOD::ChannelGroup *> busGroups;
+		std::vector<float> busVolume;
+		std::vector<char> busMute;
+		std::vector<char> busPaused;
+
+		// Buses whose state has changed since the last update
+		std::vector<char> busDirty;
+		std::vector<int> dirtyBuses;
+
+		// Bus sends, and the buses each one connects
+		std::vector<FMOD::DSPConnection *> sends;
+		std::vector<std::pair<int, int>> sendBuses;
+
+		bool validBus(Bus bus) const { return bus.id >= 0 && bus.id < static_cast<int>(busGroups.size()); }
+		void markBusDirty(int bus);
+		void flushBuses();
+
+		// Music crossfader (created on first use)
+		std::unique_ptr<Crossfader> crossfader;
+
+		// Ring of recent frame statistics
+		bool telemetryEnabled;
+		static const int TelemetryFrames = 256;
+		FrameStats telemetry[TelemetryFrames];
+		unsigned long long telemetryFrames;
+
+		// Performance counter at creation and ticks per microsecond
+		long long counterStart;
+		double counterTicksPerUs;
+
+		double nowUs() const;
 	};
 
 	// Function object for std::unique_ptr to automatically release FMOD resources
@@ -75,6 +530,9 @@ namespace SFMOD
 
 	class SimpleFMODResource
 	{
+		// Allow recordings to identify resources
+		friend class SimpleFMOD;
+
 	protected:
 		// Pointer to SimpleFMOD API
 		SimpleFMOD *engine;
@@ -82,21 +540,40 @@ namespace SFMOD
 		// The sound being managed by this object
 		ResourceType resource;
 
+		// Identifies the resource in recordings (0: not recorded)
+		unsigned int recordId;
+
 	private:
+		// Update scheduling, maintained by SimpleFMOD: index in the active set (-1 if not active), the link to this
+		// resource in a timer wheel slot (NULL if not sleeping) and when it wakes, and whether it plays a stream
+		int activeIndex;
+		SimpleFMODResource *timerNext;
+		SimpleFMODResource **timerLink;
+		unsigned int wakeTime;
+		bool stream;
+
+		// Set by KeepActive(): updated every frame whatever the resource asks for
+		bool keepActive;
+
 		// No copying allowed of this class or any derived class
 		SimpleFMODResource(SimpleFMODResource const &o);
 		SimpleFMODResource &operator=(SimpleFMODResource const &);
 
 	protected:
-		// Default constructors for when no resource has been assigned yet
-		SimpleFMODResource() : engine(NULL) {}
-		SimpleFMODResource(SimpleFMOD *fmod) : engine(fmod) { fmod->registerResource(this); }
+		// Default constructors for when no resource has been assigned yet.
+		// Resources which only need updates some of the time start idle ('active' false)
+		SimpleFMODResource() : engine(NULL), recordId(0), activeIndex(-1), timerNext(NULL), timerLink(NULL), wakeTime(0), stream(false), keepActive(false) {}
+		SimpleFMODResource(SimpleFMOD *fmod, bool active = true) : engine(fmod), recordId(0), activeIndex(-1), timerNext(NULL), timerLink(NULL), wakeTime(0), stream(false),
+			keepActive(false)
+		{
+			fmod->registerResource(this, active);
+		}
 
 		// Move constructor
-		SimpleFMODResource(SimpleFMODResource &&o) : engine(o.engine), resource(std::move(o.resource))
+		SimpleFMODResource(SimpleFMODResource &&o) : engine(o.engine), resource(std::move(o.resource)), recordId(o.recordId),
+			activeIndex(-1), timerNext(NULL), timerLink(NULL), wakeTime(0), stream(false), keepActive(o.keepActive)
 		{
-			o.engine->unregisterResource(&o);
-			engine->registerResource(this);
+			engine->moveResource(&o, this);
 		}
 
 		// Move assignment operator
@@ -104,22 +581,82 @@ namespace SFMOD
 		{
 			if (this != &o)
 			{
+				if (engine)
+					engine->unregisterResource(this);
+
 				engine = o.engine;
 				resource = std::move(o.resource);
-				o.engine->unregisterResource(&o);
-				engine->registerResource(this);
+				recordId = o.recordId;
+				keepActive = o.keepActive;
+				engine->moveResource(&o, this);
 			}
 			return *this;
 		}
 
+		// Update scheduling. Update() is only called while a resource is active, so a resource with nothing to do
+		// should Deactivate() and Activate() again when work arrives, or sleep until a time with WakeAt()
+		void Activate() { engine->activate(this); }
+		void Deactivate() { if (!keepActive) engine->deactivate(this); }
+		bool IsActive() const { return activeIndex != -1; }
+
+		// Sleep until GetTimeMs() reaches 'timeMs', or until the DSP clock reaches 'clock' (waking up to 1ms early)
+		void WakeAt(unsigned int timeMs) { if (!keepActive) engine->schedule(this, timeMs); }
+		void WakeAtClock(unsigned long long clock) { if (!keepActive) engine->scheduleClock(this, clock); }
+
+		// Stay active from now on: Deactivate() and WakeAt() are ignored, so Update() is called every frame.
+		// Classes derived from a built-in resource that override Update() call this from their constructor
+		void KeepActive() { keepActive = true; Activate(); }
+
+		// Include this resource's IsStarving() in the frame statistics
+		void WatchStarving() { engine->watchStream(this); }
+
 	public:
+		// Unregister from updates when destroyed
+		virtual ~SimpleFMODResource() { if (engine) engine->unregisterResource(this); }
+
 		// Get raw pointer to resource
 		FMOD::Sound *Get() const { return resource.get(); }
 
-		// User-definable per-frame update function
+		// User-definable per-frame update function (called while the resource is active). Built-in resources such as
+		// Song, Playlist and Crossfader go idle when they have nothing to do, which stops a derived class's Update()
+		// as well; a derived class that needs every frame calls KeepActive() and its base class Update()
 		virtual void Update() {}
+
+		// Whether a stream this resource plays is starving (for telemetry)
+		virtual bool IsStarving() { return false; }
+	};
+
+	// Kinds of song event
+	enum SongEventType
+	{
+		// Playback passed a marker
+		SongMarker,
+
+		// Playback reached the end and wrapped around to the start
+		SongLoop,
+
+		// The song's channel stopped (Stop(), the last loop finishing or the channel being stolen)
+		SongEnd,
+
+		SongEventTypes
+	};
+
+	// A song event, delivered by Song::Update()
+	struct SongEvent
+	{
+		SongEventType type;
+
+		// The marker number and name (SongMarker only; otherwise -1 and NULL)
+		int marker;
+		const char *name;
+
+		// Where in the song it happened (PCM samples of the sound), and the DSP clock at which that sample was mixed
+		unsigned int position;
+		unsigned long long clock;
 	};
 
+	typedef std::function<void(Song &song, const SongEvent &event)> SongEventCallback;
+
 	// Song: Example SimpleFMOD resource. Played as a stream. Uses 'channelMusic' channel group. Stores channel. Plays in a loop.
 	class Song : public SimpleFMODResource
 	{
@@ -132,22 +669,49 @@ namespace SFMOD
 		bool fade;
 		bool fadePauseAfter;
 
+		// Tempo grid: beats per minute and position of the first beat
+		float tempo;
+		float firstBeatMs;
+
 		// Channel and channel group
 		FMOD::Channel *channel;
 		FMOD::ChannelGroup *channelGroup;
 
+		// Markers are the sound's sync points. The loop point is an extra sync point on the last sample
+		struct Marker
+		{
+			FMOD_SYNCPOINT *point;
+			std::string name;
+			unsigned int position;
+		};
+
+		std::vector<Marker> markers;
+		FMOD_SYNCPOINT *loopPoint;
+
+		// Events raised by the channel callback, waiting for Update() (created with the first callback)
+		std::unique_ptr<SPSCQueue<SongEvent, 64>> events;
+		SongEventCallback callbacks[SongEventTypes];
+
+		void loadMarkers();
+		void raise(SongEventType type, int marker, unsigned int position);
+
+		static FMOD_RESULT F_CALLBACK channelCallback(FMOD_CHANNEL *channel, FMOD_CHANNEL_CALLBACKTYPE type, void *commanddata1, void *commanddata2);
+
 	public:
 		// Constructor
-		Song() {}
+		Song() : tempo(120.0f), firstBeatMs(0.0f), channel(NULL), loopPoint(NULL) {}
 		Song(SimpleFMOD *fmod, const char *data, FMOD::ChannelGroup *channelGroup, FMOD_MODE mode, FMOD_CREATESOUNDEXINFO info);
 		Song(SimpleFMOD *fmod, const char *filename, FMOD::ChannelGroup *channelGroup = NULL, FMOD_MODE mode = FMOD_DEFAULT);
+		Song(SimpleFMOD *fmod, FMOD::Sound *sound, FMOD::ChannelGroup *channelGroup = NULL);
 		Song(SimpleFMOD *fmod, int resource, LPCTSTR resourceType, FMOD::ChannelGroup *channelGroup = NULL, FMOD_MODE mode = 0);
 
 		// Move constructor
-		Song(Song &&o) : SimpleFMODResource(std::move(o)), channel(o.channel), fade(false) {}
-		Song &operator=(Song &&o) { if (this != &o) { this->SimpleFMODResource::operator=(std::move(o)); channel = o.channel; channelGroup = o.channelGroup; fade = false; } return *this; }
+		Song(Song &&o);
+		Song &operator=(Song &&o);
+		~Song();
 
-		// Sound controls
+		// Sound controls. Start() returns NULL if the song couldn't be played (for example over its memory budget);
+		// the other controls then do nothing
 		FMOD::Channel *Start(bool paused = false);
 		void Stop();
 		bool TogglePause();
@@ -156,29 +720,1469 @@ namespace SFMOD
 		void SetVolume(float volume);
 		void Fade(int ms, float target = 0.0f, bool pauseWhenDone = true);
 
+		// Tempo grid used for quantized scheduling
+		void SetTempo(float bpm, float firstBeatMs = 0.0f);
+		float GetTempo() const { return tempo; }
+
+		// Get the DSP clock of the next line on the tempo grid (gridDivision lines per beat), skipping 'gridOffset' further lines.
+		// The song must be playing
+		unsigned long long GetGridClock(int gridDivision = 1, int gridOffset = 0);
+
 		// Retrieve the sound's FMOD channel
 		FMOD::Channel *GetChannel();
 
+		// Markers: named positions which raise SongMarker events when playback passes them. Cue points embedded
+		// in the file are markers from the start. AddMarker() returns the new marker's number
+		int AddMarker(unsigned int ms, const char *name);
+		int GetMarkerCount() const { return static_cast<int>(markers.size()); }
+		const char *GetMarkerName(int marker) const { return markers[marker].name.c_str(); }
+		unsigned int GetMarkerPosition(int marker) const { return markers[marker].position; }
+
+		// Call 'callback' from Update() for each event of a type, in the order they happened (an empty callback
+		// turns them off). Events are raised by FMOD's channel callback, so positions are exact rather than
+		// rounded to a frame, and no polling is needed. Takes effect from the next Start()
+		void SetCallback(SongEventType type, SongEventCallback callback);
+
 		// Per-frame update
 		virtual void Update();
+		virtual bool IsStarving();
+	};
+
+	// Limits applied to a SoundEffect's triggers before anything reaches FMOD. Zero disables a limit
+	struct PlaybackPolicy
+	{
+		// Maximum concurrent instances; further triggers are dropped
+		int maxInstances;
+
+		// Triggers closer than this to the last started instance are dropped
+		int minRetriggerMs;
+
+		// Triggers within this window of the last started instance are merged into it, raising its gain
+		// by the square root of the number of merged triggers (the level of that many uncorrelated copies), up to maxCoalesceGain.
+		// FMOD can't raise a channel above full volume, so while coalescing is enabled instances start at 1 / maxCoalesceGain
+		// of their volume and merged triggers raise them towards it
+		int coalesceMs;
+		float maxCoalesceGain;
+
+		PlaybackPolicy() : maxInstances(0), minRetriggerMs(0), coalesceMs(0), maxCoalesceGain(2.0f) {}
 	};
 
-	// SoundEffect: Example SimpleFMOD resource. Played directly (not a stream). Uses 'channelEffects' channel group. Does not store channel. Plays one-shot.
+	// SoundEffect: Example SimpleFMOD resource. Played directly (not a stream). Uses 'channelEffects' channel group. Only tracks channels for its PlaybackPolicy. Plays one-shot.
 	class SoundEffect : public SimpleFMODResource
 	{
+		// Allow batches to apply the policy
+		friend class SimpleFMOD;
+
 	private:
 		FMOD::ChannelGroup *channelGroup;
 
+		// Trigger limiting
+		PlaybackPolicy policy;
+
+		// Instances started and the DSP clock at which each ends (~0 if looping)
+		std::vector<std::pair<FMOD::Channel *, unsigned long long>> instances;
+
+		// Length of the sound in DSP clock ticks (0 until first needed)
+		unsigned long long lengthClock;
+
+		// Last started instance, for retrigger and coalescing
+		FMOD::Channel *lastChannel;
+		unsigned long long lastTrigger;
+		int coalesced;
+		float lastVolume;
+
+		// How the sample data is held and how much memory it uses
+		LoadMode loadMode;
+		size_t residentBytes;
+
+		// Apply the policy to a trigger at 'clock': returns false if it must not start a new channel,
+		// setting 'existing' to the channel it was merged into, if any
+		bool admit(unsigned long long clock, FMOD::Channel *&existing);
+		FMOD::Channel *start(unsigned long long clock, bool delayed);
+
+		// Record a started instance for the policy, setting its volume
+		void track(FMOD::Channel *channel, unsigned long long clock, float pitch = 1.0f, float volume = 1.0f);
+
+		// Volume of the last instance for the number of triggers merged into it
+		void setCoalescedVolume();
+
+		// Give back the memory accounted to this sound
+		void release();
+
 	public:
 		// Constructor
-		SoundEffect() {}
+		SoundEffect() : lengthClock(0), lastChannel(NULL), lastTrigger(0), coalesced(0), lastVolume(1.0f), loadMode(LoadDecoded), residentBytes(0) {}
 		SoundEffect(SimpleFMOD *fmod, const char *filename, FMOD::ChannelGroup *channelGroup = NULL, FMOD_MODE mode = FMOD_DEFAULT);
+		SoundEffect(SimpleFMOD *fmod, FMOD::Sound *sound, FMOD::ChannelGroup *channelGroup = NULL);
 		SoundEffect(SimpleFMOD *fmod, int resource, LPCTSTR resourceType, FMOD::ChannelGroup *channelGroup = NULL, FMOD_MODE mode = 0);
 
 		// Move constructor
-		SoundEffect(SoundEffect &&o) : SimpleFMODResource(std::move(o)) {}
-		SoundEffect &operator=(SoundEffect &&o) { if (this != &o) { this->SimpleFMODResource::operator=(std::move(o)); channelGroup = o.channelGroup; } return *this; }
+		SoundEffect(SoundEffect &&o) : SimpleFMODResource(std::move(o)), channelGroup(o.channelGroup), policy(o.policy), instances(std::move(o.instances)),
+			lengthClock(o.lengthClock), lastChannel(o.lastChannel), lastTrigger(o.lastTrigger), coalesced(o.coalesced), lastVolume(o.lastVolume),
+			loadMode(o.loadMode), residentBytes(o.residentBytes) {}
+		SoundEffect &operator=(SoundEffect &&o) { if (this != &o) { release(); this->SimpleFMODResource::operator=(std::move(o)); channelGroup = o.channelGroup; policy = o.policy;
+			instances = std::move(o.instances); lengthClock = o.lengthClock; lastChannel = o.lastChannel; lastTrigger = o.lastTrigger; coalesced = o.coalesced;
+			lastVolume = o.lastVolume; loadMode = o.loadMode; residentBytes = o.residentBytes; } return *this; }
+		~SoundEffect() { release(); }
 
 		void Play();
+
+		// Trigger limiting (see PlaybackPolicy)
+		void SetPolicy(const PlaybackPolicy &p) { policy = p; }
+		const PlaybackPolicy &GetPolicy() const { return policy; }
+
+		// Number of instances believed to be playing
+		int GetInstanceCount() const { return static_cast<int>(instances.size()); }
+
+		// How the sample data is held and the bytes it occupies (a stream can only play one instance at a time)
+		LoadMode GetLoadMode() const { return loadMode; }
+		size_t GetResidentBytes() const { return residentBytes; }
+
+		// Play at an exact DSP clock tick (see SimpleFMOD::GetDSPClock()). Several calls per update can schedule ahead.
+		// Returns NULL if the policy dropped the trigger, or the existing channel if it was coalesced
+		FMOD::Channel *PlayAt(unsigned long long dspClock);
+
+		// Play on the next line of a song's tempo grid (gridDivision lines per beat), skipping 'gridOffset' further lines
+		FMOD::Channel *PlayQuantized(Song &song, int gridDivision = 1, int gridOffset = 0);
+	};
+
+	// One entry of a waveform pyramid: the sample range and loudness of a bucket of sample frames
+	struct WaveformPeak
+	{
+		float min;
+		float max;
+		float rms;
+	};
+
+	// WaveformCache: Multi-resolution min/max/RMS pyramid of a sound for drawing scrubbable waveforms.
+	// Decoded once on a background thread and stored as a file keyed by the content hash of the asset,
+	// then memory-mapped so that queries never touch the decoder.
+	class WaveformCache
+	{
+	private:
+		// Build state
+		enum State { Building, Ready, Failed };
+
+		// File header of a pyramid (followed by the levels, each an array of PackedPeak)
+		struct Header
+		{
+			char magic[8];
+			unsigned int version;
+			unsigned int sampleRate;
+			unsigned long long contentHash;
+			unsigned long long totalFrames;
+			unsigned int baseBucket;
+			unsigned int numLevels;
+			unsigned long long levelOffset[32];
+			unsigned long long levelCount[32];
+		};
+
+		// Peaks are stored as 16-bit fixed point to halve the size of the cache
+		struct PackedPeak
+		{
+			short min;
+			short max;
+			short rms;
+		};
+
+		// Pointer to SimpleFMOD API
+		SimpleFMOD *engine;
+
+		// Source asset and cache directory (empty = next to the asset)
+		std::string filename;
+		std::string cacheDir;
+
+		// Background builder
+		std::thread worker;
+		std::atomic<int> state;
+		std::atomic<int> progress;
+		std::atomic<bool> cancel;
+
+		// Mapped pyramid
+		HANDLE file;
+		HANDLE mapping;
+		const Header *header;
+
+		// No copying allowed
+		WaveformCache(WaveformCache const &);
+		WaveformCache &operator=(WaveformCache const &);
+
+		void build();
+		bool decode(std::vector<PackedPeak> &level0, unsigned int &sampleRate, unsigned long long &totalFrames);
+		bool write(const std::string &path, unsigned long long hash, unsigned int sampleRate, unsigned long long totalFrames, std::vector<PackedPeak> &level0);
+		bool map(const std::string &path, unsigned long long hash);
+		void unmap();
+
+	public:
+		// Frames per bucket at the finest level of the pyramid
+		static const unsigned int BaseBucket = 256;
+
+		// Constructor. Starts building (or loading) the pyramid for the file in the background
+		WaveformCache(SimpleFMOD *fmod, const char *filename, const char *cacheDir = NULL);
+		~WaveformCache();
+
+		// Build status
+		bool IsReady() const { return state == Ready; }
+		bool IsFailed() const { return state == Failed; }
+
+		// Build progress from 0.0f - 1.0f
+		float GetProgress() const { return progress / 1000.0f; }
+
+		// Length of the sound in seconds (0 until ready)
+		double GetLength() const;
+
+		// Fill 'pixels' peaks covering the time range from startSec to endSec. Returns the number of peaks written
+		int GetPeaks(double startSec, double endSec, int pixels, WaveformPeak *out) const;
+	};
+
+	// Lock-free single-producer single-consumer queue with a fixed capacity (must be a power of two). Never allocates.
+	// Used to publish data from the FMOD mixer thread and callbacks to the game thread:
+	// the producer never blocks (Push() fails if the queue is full) and the consumer never waits
+	template <typename T, unsigned int Capacity>
+	class SPSCQueue
+	{
+		static_assert((Capacity & (Capacity - 1)) == 0, "SPSCQueue capacity must be a power of two");
+
+	private:
+		// Write and read counters, kept on separate cache lines so the two threads don't contend
+		std::atomic<unsigned int> head;
+		char headPadding[64 - sizeof(std::atomic<unsigned int>)];
+		std::atomic<unsigned int> tail;
+		char tailPadding[64 - sizeof(std::atomic<unsigned int>)];
+
+		// Number of items the producer had to drop because the queue was full
+		std::atomic<unsigned int> dropped;
+
+		T items[Capacity];
+
+		// No copying allowed
+		SPSCQueue(SPSCQueue const &);
+		SPSCQueue &operator=(SPSCQueue const &);
+
+	public:
+		SPSCQueue() : head(0), tail(0), dropped(0) {}
+
+		// Producer: add an item. Returns false (and counts a drop) if the queue is full
+		bool Push(const T &item)
+		{
+			unsigned int h = head.load(std::memory_order_relaxed);
+
+			if (h - tail.load(std::memory_order_acquire) == Capacity)
+			{
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+
+			items[h & (Capacity - 1)] = item;
+			head.store(h + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Consumer: remove the oldest item. Returns false if the queue is empty
+		bool Pop(T &item)
+		{
+			unsigned int t = tail.load(std::memory_order_relaxed);
+
+			if (t == head.load(std::memory_order_acquire))
+				return false;
+
+			item = items[t & (Capacity - 1)];
+			tail.store(t + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Consumer: discard everything queued
+		void Clear()
+		{
+			tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+		}
+
+		// Approximate number of queued items (exact when called from either end)
+		unsigned int Size() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+		bool Empty() const { return Size() == 0; }
+
+		// Number of items dropped since the queue was created
+		unsigned int GetDropped() const { return dropped.load(std::memory_order_relaxed); }
+	};
+
+	// Wait-free "latest value" channel between one producer and one consumer.
+	// The producer fills the back buffer and publishes it; the consumer always sees the most recently published value
+	template <typename T>
+	class TripleBuffer
+	{
+	private:
+		// Flag set on the middle slot index when it holds a value the consumer hasn't seen yet
+		static const int Fresh = 4;
+
+		T slots[3];
+
+		// Index of the shared middle slot (plus the Fresh flag), and the slots owned by each side
+		std::atomic<int> middle;
+		int back;
+		int front;
+
+		// No copying allowed
+		TripleBuffer(TripleBuffer const &);
+		TripleBuffer &operator=(TripleBuffer const &);
+
+	public:
+		TripleBuffer() : middle(1), back(0), front(2) {}
+
+		// Producer: get the slot to write into, then call Publish()
+		T &Back() { return slots[back]; }
+		void Publish() { back = middle.exchange(back | Fresh, std::memory_order_acq_rel) & 3; }
+
+		// Producer: write and publish a value in one go
+		void Write(const T &value) { slots[back] = value; Publish(); }
+
+		// Consumer: fetch the latest published value, if there is a new one. Returns true if the front slot changed
+		bool Update()
+		{
+			if (!(middle.load(std::memory_order_relaxed) & Fresh))
+				return false;
+
+			front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+			return true;
+		}
+
+		// Consumer: get the latest published value
+		const T &Read() { Update(); return slots[front]; }
+
+		// Consumer: get the value fetched by the last Update() or Read()
+		const T &Front() const { return slots[front]; }
+	};
+
+	// Levels measured by a MeterTap over one mixer block
+	struct MeterFrame
+	{
+		// Per-channel peak and RMS levels (0.0f - 1.0f) of the first two channels
+		float peak[2];
+		float rms[2];
+
+		// Number of sample frames processed by the tap so far
+		unsigned long long position;
+	};
+
+	// MeterTap: DSP tap on a channel group which measures levels on the mixer thread and publishes them
+	// through a TripleBuffer, so reading the meter never calls into FMOD
+	class MeterTap
+	{
+	private:
+		FMOD::DSP *dsp;
+
+		// Levels published by the mixer thread
+		TripleBuffer<MeterFrame> levels;
+		unsigned long long position;
+
+		// No copying allowed
+		MeterTap(MeterTap const &);
+		MeterTap &operator=(MeterTap const &);
+
+		// DSP callback
+		static FMOD_RESULT F_CALLBACK read(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer, unsigned int length, int inchannels, int outchannels);
+
+	public:
+		MeterTap(SimpleFMOD *fmod, FMOD::ChannelGroup *channelGroup);
+		~MeterTap();
+
+		// Get the latest levels (wait-free)
+		const MeterFrame &Get() { return levels.Read(); }
+	};
+
+	// Spectrogram: Rolling history of the last N spectrum frames in a single contiguous ring buffer.
+	// Frames can optionally be re-binned onto a logarithmic or mel frequency scale (precomputed as a sparse matrix)
+	// and converted to decibels. Runs in constant memory and O(bins) per frame; consumers read the ring directly
+	class Spectrogram
+	{
+	public:
+		// Ring layout: FrameMajor stores each frame's bins contiguously (one row per frame),
+		// BinMajor stores each bin's history contiguously (one row per bin, suited to scrolling texture uploads)
+		enum Layout { FrameMajor, BinMajor };
+
+		// Frequency scale of the stored bins
+		enum Scale { Linear, Logarithmic, Mel };
+
+	private:
+		// One non-zero entry of the re-binning matrix
+		struct Weight
+		{
+			int input;
+			float weight;
+		};
+
+		Layout layout;
+		Scale scale;
+		bool decibels;
+		float floorDecibels;
+
+		// Input spectrum size, stored bins per frame and frames of history
+		int fftBins;
+		int bins;
+		int frames;
+
+		// Width of an input bin in Hz
+		float binWidth;
+
+		// Ring storage (frames * bins values), next frame to write and number of frames written (up to 'frames')
+		std::vector<float> data;
+		int writeIndex;
+		int count;
+
+		// Re-binning matrix in compressed sparse row form: row k uses weights[rowStart[k]] to weights[rowStart[k + 1] - 1]
+		std::vector<int> rowStart;
+		std::vector<Weight> weights;
+
+		// Scratch buffers for capture and processing (allocated once)
+		std::vector<float> captureLeft;
+		std::vector<float> captureRight;
+		std::vector<float> frame;
+
+		void buildFilterBank();
+
+	public:
+		// Constructor. fftBins must be a power of two from 64 to 8192; outputBins = 0 keeps fftBins bins
+		Spectrogram(SimpleFMOD *fmod, int fftBins, int frames, Layout layout = FrameMajor, Scale scale = Linear, int outputBins = 0, bool decibels = true, float floorDecibels = -100.0f);
+
+		// Capture the current spectrum of a channel or channel group (averaging the first 'channels' channels) and push it
+		void Capture(FMOD::Channel *channel, int channels = 2, FMOD_DSP_FFT_WINDOW window = FMOD_DSP_FFT_WINDOW_HANNING);
+		void Capture(FMOD::ChannelGroup *channelGroup, int channels = 2, FMOD_DSP_FFT_WINDOW window = FMOD_DSP_FFT_WINDOW_HANNING);
+
+		// Push a linear magnitude spectrum of fftBins values
+		void Push(const float *spectrum);
+
+		// Dimensions
+		int GetBins() const { return bins; }
+		int GetFrames() const { return frames; }
+		int GetCount() const { return count; }
+		Layout GetLayout() const { return layout; }
+
+		// Centre frequency of a stored bin in Hz
+		float GetBinFrequency(int bin) const;
+
+		// Zero-copy view of a frame (FrameMajor only). age 0 is the newest frame. Returns NULL if unavailable
+		const float *GetFrame(int age) const;
+
+		// Zero-copy view of a bin's history from oldest to newest (BinMajor only), as up to two spans of the ring.
+		// Returns the total number of values
+		int GetBinHistory(int bin, const float **first, int *firstCount, const float **second, int *secondCount) const;
+
+		// Raw ring access (e.g. for texture upload): the storage and the index of the next frame to be written
+		const float *GetData() const { return &data[0]; }
+		int GetWriteIndex() const { return writeIndex; }
+
+		// Convert linear magnitudes to decibels in place (SIMD)
+		static void ToDecibels(float *values, int count, float floorDecibels = -100.0f);
+	};
+
+	// Acoustic fingerprint of a sound: one 32-bit sub-band energy hash per 11.6ms frame
+	typedef std::vector<unsigned int> Fingerprint;
+
+	// Result of a fingerprint query
+	struct FingerprintMatch
+	{
+		// Matching track, fraction of fingerprint bits that agree (0.0f - 1.0f) and where the query starts in the track (seconds)
+		int track;
+		float similarity;
+		double offset;
+	};
+
+	// FingerprintIndex: On-disk inverted index of acoustic fingerprints for finding duplicate and near-duplicate
+	// (re-encoded, renamed or trimmed) tracks in a library. The index file is memory-mapped; tracks added since
+	// it was opened are searched from memory until the next Save()
+	class FingerprintIndex
+	{
+	private:
+		// Posting of the inverted index: where a hash occurs
+		struct Entry
+		{
+			unsigned int hash;
+			unsigned int track;
+			unsigned int frame;
+
+			bool operator<(const Entry &o) const { return hash < o.hash; }
+		};
+
+		// Per-track record in the index file
+		struct TrackInfo
+		{
+			unsigned long long hashOffset;
+			unsigned int hashCount;
+			unsigned int nameOffset;
+		};
+
+		// File header (followed by the track table, names, fingerprints and sorted postings)
+		struct Header
+		{
+			char magic[8];
+			unsigned int version;
+			unsigned int numTracks;
+			unsigned long long tracksOffset;
+			unsigned long long namesOffset;
+			unsigned long long hashesOffset;
+			unsigned long long entriesOffset;
+			unsigned long long numEntries;
+		};
+
+		// Mapped index file
+		HANDLE file;
+		HANDLE mapping;
+		const char *view;
+		const Header *header;
+
+		// Tracks added since the index was opened, and their postings (sorted on demand)
+		std::vector<std::string> pendingNames;
+		std::vector<Fingerprint> pendingPrints;
+		mutable std::vector<Entry> pendingEntries;
+		mutable bool pendingSorted;
+
+		// No copying allowed
+		FingerprintIndex(FingerprintIndex const &);
+		FingerprintIndex &operator=(FingerprintIndex const &);
+
+		int mappedTracks() const { return header? static_cast<int>(header->numTracks) : 0; }
+		const unsigned int *trackHashes(int track, unsigned int &count) const;
+		void close();
+
+	public:
+		// Frame rate of fingerprints and the largest number of postings a hash may have before it is ignored as noise
+		static const int SampleRate = 5512;
+		static const int FrameHop = 64;
+		static const unsigned int MaxPostings = 1000;
+
+		FingerprintIndex();
+		~FingerprintIndex();
+
+		// Open an existing index file. Returns false if it doesn't exist or is invalid
+		bool Open(const char *path);
+
+		// Add a track to the index. Returns the track number
+		int Add(const char *name, const Fingerprint &fingerprint);
+
+		// Write the index (including added tracks) to a file and re-open it from there
+		bool Save(const char *path);
+
+		// Tracks in the index
+		int GetTrackCount() const { return mappedTracks() + static_cast<int>(pendingNames.size()); }
+		const char *GetTrackName(int track) const;
+
+		// Find tracks which contain the fingerprinted audio, best first
+		std::vector<FingerprintMatch> Query(const Fingerprint &fingerprint, float minSimilarity = 0.65f, int maxResults = 10) const;
+
+		// Decode a sound file and compute its fingerprint (maxSeconds = 0 for the whole file). Runs much faster than real time
+		static bool Extract(SimpleFMOD *fmod, const char *filename, Fingerprint &fingerprint, float maxSeconds = 0.0f);
+	};
+
+	// Playlist: Plays a list of songs back to back without gaps. The next stream is opened in the background a
+	// configurable time before the current one ends and scheduled on the DSP clock to start on the exact sample
+	// where the current one finishes. Finished streams are released lazily in later updates.
+	// Uses 'channelMusic' channel group by default
+	class Playlist : public SimpleFMODResource
+	{
+	private:
+		// A track which is opening, scheduled or playing
+		struct Slot
+		{
+			int track;
+			FMOD::Sound *sound;
+			FMOD::Channel *channel;
+			bool scheduled;
+			unsigned long long startClock;
+			unsigned long long endClock;
+		};
+
+		// Files to play
+		std::vector<std::string> tracks;
+
+		// Playing and next tracks, and finished tracks waiting to be released
+		Slot current;
+		Slot next;
+		std::vector<FMOD::Sound *> finished;
+
+		FMOD::ChannelGroup *channelGroup;
+		FMOD_MODE mode;
+		int preloadMs;
+		bool loop;
+		bool paused;
+
+		// Scheduling headroom for the first track so its start clock is known exactly
+		unsigned int startLatency;
+
+		void open(Slot &slot, int track);
+		bool schedule(Slot &slot, unsigned long long clock);
+		void release(Slot &slot);
+		int following(int track) const;
+
+	public:
+		// Constructor
+		Playlist(SimpleFMOD *fmod, FMOD::ChannelGroup *channelGroup = NULL, int preloadMs = 5000, FMOD_MODE mode = FMOD_DEFAULT);
+		~Playlist();
+
+		// Add a song to the end of the playlist
+		void Add(const char *filename);
+
+		// Play from a track (starts as soon as the stream is open), and stop
+		void Play(int track = 0);
+		void Stop();
+
+		// Pause/unpause (the next track is rescheduled when playback resumes)
+		void SetPaused(bool pause);
+		bool GetPaused() const { return paused; }
+
+		// Return to the first track after the last one
+		void SetLoop(bool enable) { loop = enable; Activate(); }
+
+		// Currently playing track (-1 if none) and its channel
+		int GetCurrentTrack() const { return current.track; }
+		FMOD::Channel *GetChannel() { return current.channel; }
+
+		// Per-frame update
+		virtual void Update();
+		virtual bool IsStarving();
+	};
+
+	// Crossfader: Holds at most two music streams and crossfades between them with gain ramps computed per sample
+	// on the mixer thread. Used by SimpleFMOD::CrossfadeTo()
+	class Crossfader : public SimpleFMODResource
+	{
+	private:
+		// Gain ramp applied by a DSP on a deck's channel. Written under lockDSP(), read by the mixer thread
+		struct Ramp
+		{
+			// DSP clock of the next sample the DSP will process
+			unsigned long long clock;
+
+			// Fade start clock, length in samples, direction and shape
+			unsigned long long start;
+			unsigned long long length;
+			bool fadeIn;
+			FadeCurveFunction curve;
+		};
+
+		// One of the two streams
+		struct Deck
+		{
+			FMOD::Sound *sound;
+			FMOD::Channel *channel;
+			FMOD::DSP *dsp;
+			Ramp ramp;
+		};
+
+		Deck decks[2];
+
+		// Deck being faded in (or playing on its own)
+		int active;
+
+		// Whether the active deck is still opening, and when the current fade ends
+		bool opening;
+		bool fading;
+		unsigned long long fadeEnd;
+		int fadeMs;
+		FadeCurveFunction fadeCurve;
+
+		// A crossfade requested during a fade: the old outgoing deck ramps out until 'retireEnd', then this opens
+		bool retiring;
+		unsigned long long retireEnd;
+		std::string pendingFile;
+		FMOD_MODE pendingMode;
+
+		FMOD::ChannelGroup *channelGroup;
+		unsigned int startLatency;
+
+		// Longest ramp out of a deck abandoned by an interrupted fade
+		static const int RetireMs = 50;
+
+		void stopDeck(Deck &deck);
+		void open(const char *filename, FMOD_MODE mode);
+
+		// DSP callback
+		static FMOD_RESULT F_CALLBACK read(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer, unsigned int length, int inchannels, int outchannels);
+
+	public:
+		Crossfader(SimpleFMOD *fmod, FMOD::ChannelGroup *channelGroup);
+		~Crossfader();
+
+		// Begin a crossfade to a new stream
+		void CrossfadeTo(const char *filename, int ms, FadeCurveFunction curve, FMOD_MODE mode = FMOD_DEFAULT);
+
+		// Stop both streams
+		void Stop();
+
+		// Channel of the active stream (NULL while it is opening)
+		FMOD::Channel *GetChannel() { return opening? NULL : decks[active].channel; }
+
+		// Built-in curves
+		static float Linear(float progress);
+		static float EqualPower(float progress);
+		static float SineSquared(float progress);
+
+		// Per-frame update
+		virtual void Update();
+		virtual bool IsStarving();
+	};
+
+	// Ducker: Sidechain ducking on the mixer thread. An envelope follower on a source bus (e.g. effects or voice)
+	// drives the gain of a target bus (e.g. music) with a compressor-style threshold and ratio.
+	// Levels and gains are computed per mixer block with SIMD. By default neither bus is delayed, so the gain change
+	// follows the sound that caused it by the attack time, plus one mixer block if FMOD processes the target bus before
+	// the source bus. An optional lookahead delays the source bus after the detector, so the duck lands before the sound
+	// is heard; it should be at least one mixer block. The cost is that everything on the source bus then plays late by
+	// the lookahead, off the DSP clock grid used by PlayQuantized(), Playlist and Sequencer
+	class Ducker
+	{
+	private:
+		// Most channels the lookahead delay line is sized for
+		static const int MaxChannels = 8;
+
+		FMOD::DSP *detector;
+		FMOD::DSP *delayer;
+		FMOD::DSP *gainer;
+
+		// Parameters (written by the game thread, read by the mixer thread)
+		std::atomic<float> thresholdDb;
+		std::atomic<float> ratio;
+		std::atomic<float> attackMs;
+		std::atomic<float> releaseMs;
+		float sampleRate;
+
+		// Detector state (mixer thread only) and the target gain it publishes
+		float envelopeDb;
+		std::atomic<float> targetGain;
+
+		// Gain stage state (mixer thread only)
+		float gain;
+
+		// Source bus lookahead delay line, in frames (mixer thread only)
+		std::vector<float> delayLine;
+		int lookahead;
+		int delayPosition;
+
+		// No copying allowed
+		Ducker(Ducker const &);
+		Ducker &operator=(Ducker const &);
+
+		// DSP callbacks
+		static FMOD_RESULT F_CALLBACK detect(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer, unsigned int length, int inchannels, int outchannels);
+		static FMOD_RESULT F_CALLBACK delay(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer, unsigned int length, int inchannels, int outchannels);
+		static FMOD_RESULT F_CALLBACK apply(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer, unsigned int length, int inchannels, int outchannels);
+
+	public:
+		Ducker(SimpleFMOD *fmod, Bus source, Bus target, float thresholdDb = -30.0f, float ratio = 4.0f,
+			float attackMs = 10.0f, float releaseMs = 300.0f, float lookaheadMs = 0.0f);
+		~Ducker();
+
+		// Parameters
+		void SetThreshold(float db) { thresholdDb = db; }
+		void SetRatio(float r) { ratio = max(r, 1.0f); }
+		void SetAttack(float ms) { attackMs = max(ms, 0.1f); }
+		void SetRelease(float ms) { releaseMs = max(ms, 0.1f); }
+
+		// Current gain reduction applied to the target in dB (0 = none)
+		float GetGainReduction() const;
+	};
+
+	// Distance attenuation curves for 3D emitters (full volume inside the minimum distance, silent beyond the maximum)
+	enum AttenuationCurve { AttenuationLinear, AttenuationInverse, AttenuationInverseSquare };
+
+	// EmitterSystem: Positional sounds around a listener. Emitters live in flat arrays and a uniform spatial grid;
+	// each update only visits grid cells within audible range of the listener, culls emitters beyond their maximum
+	// distance and gives real channels to the loudest 'maxVoices' of the rest. 3D attributes for all playing
+	// channels are pushed in one pass. Per-update cost depends on the audible set, not the number of emitters.
+	// For best results the cell size should be close to the typical maximum distance of the emitters
+	class EmitterSystem : public SimpleFMODResource
+	{
+	private:
+		// Emitter data, indexed by emitter handle
+		std::vector<FMOD::Sound *> sounds;
+		std::vector<FMOD::Channel *> channels;
+		std::vector<FMOD_VECTOR> positions;
+		std::vector<FMOD_VECTOR> velocities;
+		std::vector<float> minDistances;
+		std::vector<float> maxDistances;
+		std::vector<float> volumes;
+		std::vector<char> curves;
+		std::vector<char> looping;
+		std::vector<char> alive;
+
+		// Spatial grid: emitters in each occupied cell, and each emitter's cell and index within it
+		std::unordered_map<unsigned long long, std::vector<int>> grid;
+		std::vector<unsigned long long> cellKeys;
+		std::vector<int> cellSlots;
+		float cellSize;
+
+		// Largest maximum distance of any emitter (the grid search radius)
+		float audibleRange;
+
+		// Free emitter handles
+		std::vector<int> freeHandles;
+
+		// Emitters holding a channel, and scratch space for the audible set
+		std::vector<int> playing;
+		std::vector<std::pair<float, int>> audible;
+		std::vector<float> gains;
+
+		// Listener
+		FMOD_VECTOR listenerPosition;
+		FMOD_VECTOR listenerVelocity;
+		FMOD_VECTOR listenerForward;
+		FMOD_VECTOR listenerUp;
+
+		FMOD::ChannelGroup *channelGroup;
+		int maxVoices;
+
+		unsigned long long cellKey(const FMOD_VECTOR &p) const;
+		void insertIntoGrid(int emitter);
+		void removeFromGrid(int emitter);
+		void stopVoice(int emitter);
+		float attenuate(int emitter, float distance) const;
+
+	public:
+		EmitterSystem(SimpleFMOD *fmod, int maxVoices = 32, float cellSize = 50.0f, Bus bus = Bus());
+		~EmitterSystem();
+
+		// Add an emitter playing a sound effect. Returns its handle.
+		// Looping emitters play whenever they are audible; one-shot emitters play once and are removed when they finish or lose their voice
+		int Add(SoundEffect &effect, const FMOD_VECTOR &position, float minDistance, float maxDistance,
+			bool loop = true, AttenuationCurve curve = AttenuationInverse, float volume = 1.0f);
+		void Remove(int emitter);
+
+		// Move an emitter
+		void SetPosition(int emitter, const FMOD_VECTOR &position, const FMOD_VECTOR *velocity = NULL);
+		void SetVolume(int emitter, float volume) { volumes[emitter] = volume; }
+
+		// Move the listener
+		void SetListener(const FMOD_VECTOR &position, const FMOD_VECTOR &forward, const FMOD_VECTOR &up, const FMOD_VECTOR *velocity = NULL);
+
+		// Statistics from the last update
+		int GetAudibleCount() const { return static_cast<int>(audible.size()); }
+		int GetVoiceCount() const { return static_cast<int>(playing.size()); }
+
+		// Per-frame update
+		virtual void Update();
+	};
+
+	// Handle to a logical voice of a VoiceManager
+	struct Voice
+	{
+		int index;
+		unsigned int generation;
+
+		Voice() : index(-1), generation(0) {}
+		Voice(int i, unsigned int g) : index(i), generation(g) {}
+
+		bool IsValid() const { return index >= 0; }
+	};
+
+	// VoiceManager: Virtual voices above SoundEffect and Song. Every logical sound instance is tracked in compact
+	// arrays (start clock, length, loop state, audibility) without holding an FMOD channel; each update the most
+	// audible instances are given real channels, started at the offset they would have reached, and the least
+	// audible are demoted. Many more logical sounds than mixer channels can play with no dropouts
+	class VoiceManager : public SimpleFMODResource
+	{
+	private:
+		// Logical voice data
+		std::vector<FMOD::Sound *> sounds;
+		std::vector<FMOD::ChannelGroup *> groups;
+		std::vector<FMOD::Channel *> channels;
+		std::vector<unsigned long long> startClocks;
+		std::vector<unsigned long long> lengths;
+		std::vector<float> frequencies;
+		std::vector<float> volumes;
+		std::vector<float> priorities;
+		std::vector<char> looping;
+		std::vector<unsigned int> generations;
+		std::vector<char> alive;
+
+		std::vector<int> freeVoices;
+		std::vector<int> active;
+		std::vector<std::pair<float, int>> ranking;
+
+		int maxReal;
+		int realCount;
+
+		bool valid(Voice v) const { return v.index >= 0 && v.index < static_cast<int>(alive.size()) && alive[v.index] && generations[v.index] == v.generation; }
+		Voice start(FMOD::Sound *sound, FMOD::ChannelGroup *group, float volume, bool loop, float priority);
+		void promote(int v, unsigned long long now);
+		void demote(int v);
+		void retire(int v);
+
+	public:
+		// maxReal: number of FMOD channels the manager may use at once
+		VoiceManager(SimpleFMOD *fmod, int maxReal = 64);
+		~VoiceManager();
+
+		// Start a logical voice, with a channel straight away if one is free. Audibility is volume * priority.
+		// Returns an invalid Voice if the sound isn't loaded, or if it is a stream already playing through the manager
+		Voice Play(SoundEffect &effect, float volume = 1.0f, bool loop = false, float priority = 1.0f, Bus bus = Bus());
+		Voice Play(Song &song, float volume = 1.0f, bool loop = true, float priority = 1.0f, Bus bus = Bus());
+
+		// Control a logical voice
+		void Stop(Voice voice);
+		void SetVolume(Voice voice, float volume);
+		void SetPriority(Voice voice, float priority);
+
+		// Voice state
+		bool IsPlaying(Voice voice) const { return valid(voice); }
+		bool IsVirtual(Voice voice) const { return valid(voice) && !channels[voice.index]; }
+
+		// Statistics
+		int GetLogicalCount() const { return static_cast<int>(active.size()); }
+		int GetRealCount() const { return realCount; }
+
+		// Per-frame update
+		virtual void Update();
+	};
+
+	// Sequencer: Step sequencer playing SoundEffects on the DSP clock. Each track is a row of steps (velocity and pitch)
+	// of one sound over a pattern of 'steps' steps. Each update the steps falling within the lookahead window are
+	// scheduled as one PlayMany() batch, so timing is sample-exact whatever the frame rate. Tracks are compiled into
+	// per-step event lists, so the cost of an update is proportional to the number of events played
+	class Sequencer : public SimpleFMODResource
+	{
+	private:
+		// One track: a sound and its step velocities (0.0f = off) and pitches
+		struct Track
+		{
+			SoundEffect *effect;
+			Bus bus;
+			std::vector<float> velocity;
+			std::vector<float> pitch;
+			bool mute;
+		};
+
+		std::vector<Track> tracks;
+		int steps;
+
+		// Compiled events: those of step 's' are events[stepStart[s]] to events[stepStart[s + 1] - 1]
+		std::vector<PlayRequest> events;
+		std::vector<int> stepStart;
+		bool dirty;
+
+		// Timing
+		float tempo;
+		int stepsPerBeat;
+		float swing;
+		unsigned int lookahead;
+		unsigned int startLatency;
+
+		// Step 'originStep' falls at 'originClock'; moved on whenever the tempo changes. Until the first update after
+		// Start() ('starting'), the origin is only provisional
+		bool playing;
+		bool starting;
+		double originClock;
+		unsigned long long originStep;
+		unsigned long long nextStep;
+
+		// Events of the current update
+		std::vector<PlayRequest> batch;
+
+		double stepLength() const { return engine->GetSampleRate() * 60.0 / (tempo * stepsPerBeat); }
+		unsigned long long stepClock(unsigned long long step) const;
+		void compile();
+
+	public:
+		// 'steps' steps per pattern, 'stepsPerBeat' steps per beat, scheduled 'lookaheadMs' ahead
+		Sequencer(SimpleFMOD *fmod, int steps = 16, float bpm = 120.0f, int stepsPerBeat = 4, int lookaheadMs = 100);
+
+		// Add a track of all-off steps. Returns the track number
+		int AddTrack(SoundEffect &effect, Bus bus = Bus());
+
+		// Set a step of a track. A velocity of 0.0f turns it off
+		void SetStep(int track, int step, float velocity = 1.0f, float pitch = 1.0f);
+		void ClearStep(int track, int step) { SetStep(track, step, 0.0f); }
+		void SetTrackMute(int track, bool mute);
+
+		// Number of steps in the pattern (extending tracks with off steps)
+		void SetLength(int steps);
+		int GetLength() const { return steps; }
+
+		// Timing. Swing delays every second step by a fraction (0.0f - 1.0f) of a step
+		void SetTempo(float bpm);
+		float GetTempo() const { return tempo; }
+		void SetSwing(float amount) { swing = amount; }
+
+		// Transport. Start() begins at step 0, which plays as soon as the next update can schedule it
+		void Start();
+		void Stop() { playing = false; }
+		bool IsPlaying() const { return playing; }
+
+		// Step that will be scheduled next (counting from 0 since Start())
+		unsigned long long GetPosition() const { return nextStep; }
+
+		// Per-frame update
+		virtual void Update();
+	};
+
+	// AsyncFileSystem: Replaces FMOD's blocking file reads. FMOD's read requests are queued by priority (streams
+	// closest to starving first) and served by a pool of I/O threads using positional reads of large aligned blocks,
+	// with the following block of each file read ahead in the background. Files can also be served from mounted pack
+	// files. Create it before loading any sounds, and destroy it only after they are all released. One per process:
+	// FMOD gives the file system no way to tell instances apart, so further ones are not installed (see IsInstalled())
+	class AsyncFileSystem
+	{
+	public:
+		struct Stats
+		{
+			unsigned long long requests;
+			unsigned long long reads;
+			unsigned long long bytesRead;
+			unsigned long long cacheHits;
+			unsigned long long readAheadHits;
+		};
+
+	private:
+		// An aligned block of file data
+		struct Block
+		{
+			char *data;
+			unsigned long long offset;
+			unsigned int length;
+		};
+
+		// An open file (on disk or inside a pack)
+		struct File
+		{
+			HANDLE handle;
+			bool ownsHandle;
+			unsigned long long base;
+			unsigned int size;
+
+			// Most recently read block, and the one after it if read ahead
+			Block cache;
+			Block ahead;
+			bool readingAhead;
+
+			// Requests being served for this file
+			int inFlight;
+		};
+
+		// A queued request: an FMOD read, or a read-ahead when 'info' is NULL
+		struct Request
+		{
+			int priority;
+			unsigned long long sequence;
+			FMOD_ASYNCREADINFO *info;
+			File *file;
+
+			bool operator<(const Request &o) const { return priority != o.priority? priority < o.priority : sequence > o.sequence; }
+		};
+
+		// A file inside a mounted pack
+		struct PackEntry
+		{
+			HANDLE pack;
+			unsigned long long offset;
+			unsigned int size;
+		};
+
+		SimpleFMOD *engine;
+		unsigned int blockSize;
+		bool installed;
+
+		std::vector<std::thread> workers;
+		std::priority_queue<Request> queue;
+		unsigned long long sequence;
+		bool quit;
+		std::mutex lock;
+		std::condition_variable wake;
+		std::condition_variable idle;
+
+		std::unordered_map<std::string, PackEntry> packEntries;
+		std::vector<HANDLE> packs;
+
+		Stats stats;
+
+		void worker();
+		void serve(Request &request, std::unique_lock<std::mutex> &guard);
+		bool fill(File *file, Block &block, unsigned long long offset, std::unique_lock<std::mutex> &guard);
+		void queueReadAhead(File *file);
+
+		// FMOD file system callbacks
+		static FMOD_RESULT F_CALLBACK open(const char *name, int unicode, unsigned int *filesize, void **handle, void **userdata);
+		static FMOD_RESULT F_CALLBACK close(void *handle, void *userdata);
+		static FMOD_RESULT F_CALLBACK asyncRead(FMOD_ASYNCREADINFO *info, void *userdata);
+		static FMOD_RESULT F_CALLBACK asyncCancel(void *handle, void *userdata);
+
+	public:
+		// 'threads' I/O threads reading 'blockSize' bytes at a time (rounded up to 64KB)
+		AsyncFileSystem(SimpleFMOD *fmod, int threads = 2, unsigned int blockSize = 256 * 1024);
+		~AsyncFileSystem();
+
+		// Serve the files in a pack before looking on disk. A pack starts with the four bytes "SFPK" and a 32-bit
+		// entry count, followed by entries of a 32-bit name length, the name, and 64-bit offset and size
+		bool Mount(const char *packFile);
+
+		// I/O statistics
+		Stats GetStats();
+
+		// Whether FMOD's file access goes through this object (false if another was already installed)
+		bool IsInstalled() const { return installed; }
+	};
+
+	// Manifest: The songs, sound effects and buses an application needs, read from a text file with lines of the form:
+	//   bus <name> [<parent> [<volume>]]   (as in SimpleFMOD::LoadBusConfig())
+	//   send <from> <to> <level>
+	//   song <name> <file> [<bus>]
+	//   effect <name> <file> [auto|decoded|compressed|stream [<plays per minute> [<bus>]]]
+	struct Manifest
+	{
+		struct Asset
+		{
+			bool song;
+			std::string name;
+			std::string filename;
+			std::string bus;
+			LoadMode loadMode;
+			float playsPerMinute;
+		};
+
+		std::vector<std::string> busLines;
+		std::vector<Asset> assets;
+
+		bool Load(const char *filename);
+	};
+
+	// Preloader: Warms up the assets of a manifest in parallel. Created before SimpleFMOD, it starts reading every
+	// file that isn't streamed on worker threads at once, so disk access overlaps with FMOD start-up; Warmup() then
+	// creates the buses, chooses automatic load modes and has the workers create the sounds as their data arrives. Startup time is bounded by the slowest asset rather than
+	// the sum of them all. Songs and sound effects are handed over on the main thread by GetSong() and GetSoundEffect()
+	class Preloader
+	{
+	private:
+		enum State { Reading, Read, Creating, Created, Failed };
+
+		struct Item
+		{
+			const Manifest::Asset *asset;
+			State state;
+			std::vector<char> data;
+			FMOD::Sound *sound;
+			LoadMode loadMode;
+			FMOD::ChannelGroup *channelGroup;
+		};
+
+		Manifest manifest;
+		std::vector<Item> items;
+
+		SimpleFMOD *engine;
+		std::vector<std::thread> workers;
+		mutable std::mutex lock;
+		std::condition_variable wake;
+		std::condition_variable done;
+		size_t nextRead;
+		int finished;
+		bool quit;
+
+		void worker();
+		void read(Item &item);
+		void create(Item &item);
+		Item *find(const char *name, bool song);
+
+	public:
+		// Start reading the manifest's files on 'threads' threads (0: one per core)
+		Preloader(const Manifest &manifest, int threads = 0);
+		~Preloader();
+
+		// Create the manifest's buses and start creating its sounds
+		void Warmup(SimpleFMOD *fmod);
+
+		// Fraction of the work done (0.0f - 1.0f)
+		float GetProgress() const;
+
+		// Ready barrier: whether every asset is loaded (or failed), and waiting for it (only after Warmup())
+		bool IsReady() const;
+		void Wait();
+
+		// Take a loaded asset after Warmup(), waiting for it if necessary. Returns an empty object if it failed or was already taken
+		Song GetSong(const char *name);
+		SoundEffect GetSoundEffect(const char *name);
+	};
+
+	// OutputCapture: Receives the mix of a SimpleFMOD from its master channel group, either into a buffer or block by
+	// block to a sink. With a non-realtime SimpleFMOD each Update() mixes one block on the calling thread
+	class OutputCapture
+	{
+	public:
+		// Receives each mixed block: 'frames' frames of 'channels' interleaved samples
+		typedef std::function<void(const float *samples, unsigned int frames, int channels)> Sink;
+
+	private:
+		FMOD::DSP *dsp;
+		Sink sink;
+		std::vector<float> samples;
+		int channels;
+
+		static FMOD_RESULT F_CALLBACK read(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer, unsigned int length, int inchannels, int outchannels);
+
+	public:
+		// Without a sink, the output is kept in GetSamples()
+		OutputCapture(SimpleFMOD *fmod, Sink sink = Sink());
+		~OutputCapture();
+
+		const std::vector<float> &GetSamples() const { return samples; }
+		int GetChannels() const { return channels; }
+		void Clear() { samples.clear(); }
+	};
+
+	// A render job: given a non-realtime SimpleFMOD and the number of the worker running it, it sets up a mix, captures
+	// it (see OutputCapture) and calls Update() until done. It must release everything it loads before returning
+	typedef std::function<void(SimpleFMOD &fmod, int worker)> RenderJob;
+
+	// RenderFarm: Runs render jobs in parallel for offline mixing. Each worker thread owns an independent non-realtime
+	// SimpleFMOD and is pinned to its own core, and takes the next queued job whenever it finishes one, so throughput
+	// grows with the number of cores
+	class RenderFarm
+	{
+	private:
+		SimpleFMODSettings settings;
+		std::vector<std::thread> workers;
+		std::deque<RenderJob> jobs;
+		int running;
+		bool quit;
+		std::mutex lock;
+		std::condition_variable wake;
+		std::condition_variable idle;
+
+		void worker(int index);
+
+	public:
+		// 'instances' workers (0: one per core). The settings are used for every instance, always non-realtime
+		RenderFarm(int instances = 0, const SimpleFMODSettings &settings = SimpleFMODSettings());
+		~RenderFarm();
+
+		// Queue a job for the next free worker
+		void Submit(RenderJob job);
+
+		// Wait for all submitted jobs to finish
+		void Wait();
+
+		int GetInstanceCount() const { return static_cast<int>(workers.size()); }
+	};
+
+	// What a MixOutput does when its ring is full because the consumer has fallen behind
+	enum MixBackpressure
+	{
+		// Stop mixing until the consumer releases a block (the mix runs at the consumer's pace and nothing is lost)
+		MixWait,
+
+		// Keep mixing and discard the block (for live monitoring, where the mix must keep real time)
+		MixDrop
+	};
+
+	// Receives each mixed block on the mixer thread: 'frames' frames in the output format. The block is only valid
+	// during the call, and mixing waits for the call to return
+	typedef std::function<void(const void *data, unsigned int frames)> MixSink;
+
+	// Options for MixOutput
+	struct MixOutputSettings
+	{
+		// Output format. Channel counts other than 1 or 2 use a raw speaker mode
+		int sampleRate;
+		int channels;
+		FMOD_SOUND_FORMAT format;
+
+		// Frames per mixed block, and blocks in the ring (rounded up to a power of two)
+		unsigned int blockFrames;
+		unsigned int ringBlocks;
+
+		// Mix no faster than real time. Otherwise the mix runs as fast as it is consumed and fades follow the DSP clock
+		bool realtime;
+
+		MixBackpressure backpressure;
+
+		// Hand blocks to this instead of the ring
+		MixSink sink;
+
+		MixOutputSettings() : sampleRate(48000), channels(2), format(FMOD_SOUND_FORMAT_PCMFLOAT), blockFrames(1024),
+			ringBlocks(8), realtime(false), backpressure(MixWait) {}
+	};
+
+	// MixOutput: An FMOD output plugin that delivers the final mix in-process instead of to a sound card, to feed an
+	// encoder, recorder or other pipeline. Pass it in SimpleFMODSettings::mixOutput; it must outlive the SimpleFMOD.
+	// Its own thread has the mixer write each block straight into the next free block of a lock-free ring (or into a
+	// buffer handed to the sink), so the mix is never copied. The consumer is a single thread calling Acquire()/Release()
+	class MixOutput
+	{
+		// Allow SimpleFMOD to select this output before initialising FMOD
+		friend class SimpleFMOD;
+
+	private:
+		MixOutputSettings settings;
+		unsigned int blockBytes;
+		unsigned int ringMask;
+		std::vector<char> ring;
+		std::vector<char> scratch;
+
+		// Blocks written by the mixer thread and released by the consumer, on separate cache lines
+		std::atomic<unsigned int> head;
+		char headPadding[64 - sizeof(std::atomic<unsigned int>)];
+		std::atomic<unsigned int> tail;
+		char tailPadding[64 - sizeof(std::atomic<unsigned int>)];
+
+		std::atomic<unsigned long long> framesMixed;
+		std::atomic<unsigned int> overruns;
+		std::atomic<bool> backpressured;
+
+		// Mixer thread. The mutex is only used to sleep when the ring is full or empty
+		FMOD_OUTPUT_STATE *state;
+		std::thread mixer;
+		std::atomic<bool> quit;
+		std::mutex lock;
+		std::condition_variable wake;
+
+		void select(FMOD::System *system);
+		void run();
+		void stop();
+		void signal();
+
+		static FMOD_RESULT F_CALLBACK getNumDrivers(FMOD_OUTPUT_STATE *output_state, int *numdrivers);
+		static FMOD_RESULT F_CALLBACK getDriverName(FMOD_OUTPUT_STATE *output_state, int id, char *name, int namelen);
+		static FMOD_RESULT F_CALLBACK init(FMOD_OUTPUT_STATE *output_state, int selecteddriver, FMOD_INITFLAGS flags, int *outputrate, int outputchannels, FMOD_SOUND_FORMAT *outputformat, int dspbufferlength, int dspnumbuffers, void *extradriverdata);
+		static FMOD_RESULT F_CALLBACK close(FMOD_OUTPUT_STATE *output_state);
+
+		// No copying allowed
+		MixOutput(MixOutput const &);
+		MixOutput &operator=(MixOutput const &);
+
+	public:
+		MixOutput(const MixOutputSettings &settings = MixOutputSettings());
+		~MixOutput();
+
+		// Consumer: the oldest mixed block (GetBlockFrames() frames), or NULL if none is ready. It stays valid until Release()
+		const void *Acquire() const;
+
+		// Consumer: hand the block from Acquire() back to the mixer
+		void Release();
+
+		// Consumer: like Acquire(), but wait up to timeoutMs for a block
+		const void *Wait(unsigned int timeoutMs);
+
+		unsigned int GetQueuedBlocks() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+
+		// Backpressure: true while the ring is full, so the mixer is waiting (MixWait) or discarding blocks (MixDrop)
+		bool IsBackpressured() const { return backpressured.load(std::memory_order_relaxed); }
+
+		// Blocks discarded because the ring was full (MixDrop)
+		unsigned int GetOverruns() const { return overruns.load(std::memory_order_relaxed); }
+
+		unsigned long long GetFramesMixed() const { return framesMixed.load(std::memory_order_relaxed); }
+
+		// The format FMOD actually mixes in, known once the SimpleFMOD is created
+		const MixOutputSettings &GetSettings() const { return settings; }
+		unsigned int GetBlockFrames() const { return settings.blockFrames; }
+		unsigned int GetBlockBytes() const { return blockBytes; }
+	};
+
+	// Time-stretch algorithms for TimeStretcher
+	enum StretchMethod
+	{
+		// Waveform-similarity overlap-add: cheap, and clean on speech and other single-voice material
+		StretchWSOLA,
+
+		// Phase vocoder with identity phase locking: keeps the timbre of polyphonic music
+		StretchPhaseVocoder
+	};
+
+	// TimeStretcher: Independent tempo and pitch for a Song, for example to beat-match songs of different BPM.
+	// The channel's frequency is scaled by the tempo ratio, which changes speed and pitch together, and a DSP on the
+	// channel shifts the pitch by pitch / tempo without changing the length, so the DSP's output keeps pace with its
+	// input as FMOD requires. Buffers are allocated when attaching; the mixer thread only processes. Stereo pairs
+	// share one complex FFT. Adds a fixed latency (GetLatency()). Ratios are limited to 0.25 - 4.0
+	class TimeStretcher
+	{
+	private:
+		static const int MaxChannels = 8;
+
+		// Phase vocoder frame size and overlap
+		static const int FrameSize = 2048;
+		static const int Overlap = 4;
+		static const int Bins = FrameSize / 2 + 1;
+
+		// WSOLA input history and stretched signal ring sizes
+		static const int HistorySize = 32768;
+		static const int StretchSize = 8192;
+
+		FMOD::DSP *dsp;
+		FMOD::Channel *channel;
+		StretchMethod method;
+		float baseFrequency;
+		int sampleRate;
+		int channels;
+		unsigned int latency;
+
+		// Ratios (written by the game thread, read by the mixer thread)
+		std::atomic<float> tempo;
+		std::atomic<float> pitch;
+
+		// Phase vocoder: per channel input and output FIFOs, overlap-add accumulators and phases
+		std::unique_ptr<FFT> fft;
+		std::vector<float> window;
+		std::vector<float> inFifo;
+		std::vector<float> outFifo;
+		std::vector<float> accumulator;
+		std::vector<float> lastPhase;
+		std::vector<float> synthesisPhase;
+		unsigned int rover;
+
+		// The phases are stale (nothing analysed yet, or the last frame took the unshifted fast path)
+		bool phasesStale;
+
+		// Phase vocoder scratch, shared by all channels
+		std::vector<std::complex<float>> spectrum;
+		std::vector<std::complex<float>> shifted[2];
+		std::vector<float> frame[2];
+		std::vector<float> magnitude;
+		std::vector<float> phase;
+		std::vector<float> trueBin;
+		std::vector<int> peaks;
+
+		// WSOLA: segment length, hop and search tolerance (in samples), per channel input history (plus a mono
+		// mix for the similarity search) and stretched signal, and positions in each
+		unsigned int segment;
+		unsigned int hop;
+		unsigned int tolerance;
+		std::vector<float> segmentWindow;
+		std::vector<float> history;
+		std::vector<float> mono;
+		std::vector<float> stretched;
+		std::vector<float> scratch;
+		long long written;
+		long long produced;
+		long long segmentStart;
+		long long previousStart;
+		double readPosition;
+
+		// No copying allowed
+		TimeStretcher(TimeStretcher const &);
+		TimeStretcher &operator=(TimeStretcher const &);
+
+		void reset();
+		float shiftRatio() const;
+		void vocode(const float *in, float *out, unsigned int length);
+		void vocodeFrame(int first, int count, float shift);
+		void similarityOverlapAdd(const float *in, float *out, unsigned int length);
+		bool addSegment(float shift);
+
+		// DSP callback
+		static FMOD_RESULT F_CALLBACK read(FMOD_DSP_STATE *dsp_state, float *inbuffer, float *outbuffer, unsigned int length, int inchannels, int outchannels);
+
+	public:
+		TimeStretcher(SimpleFMOD *fmod, StretchMethod method = StretchPhaseVocoder);
+		~TimeStretcher();
+
+		// Process a playing song's channel. Attach again after the song is restarted, since that gives it a new channel
+		bool Attach(Song &song);
+		void Detach();
+
+		// Ratios: tempo 2.0f plays twice as fast, pitch 2.0f an octave higher
+		void SetTempo(float ratio);
+		void SetPitch(float ratio);
+		float GetTempo() const { return tempo; }
+		float GetPitch() const { return pitch; }
+
+		// Play a song of 'songBpm' at 'targetBpm' (for example as detected by beat tracking), keeping its pitch
+		void MatchTempo(float songBpm, float targetBpm) { SetTempo(targetBpm / songBpm); }
+
+		// Delay added by the DSP, in output samples
+		unsigned int GetLatency() const { return latency; }
 	};
 }